@@ -2,6 +2,7 @@
 #include <lauxlib.h>
 
 #include "malloc_hook.h"
+#include "skynet_timer.h"
 #include "luashrtbl.h"
 
 static int
@@ -47,6 +48,12 @@ lcurrent(lua_State *L) {
 	return 1;
 }
 
+static int
+ltimer(lua_State *L) {
+	lua_pushinteger(L, (lua_Integer)skynet_timer_memory());
+	return 1;
+}
+
 int
 luaopen_memory(lua_State *L) {
 	luaL_checkversion(L);
@@ -60,6 +67,7 @@ luaopen_memory(lua_State *L) {
 		{ "ssinfo", luaS_shrinfo },
 		{ "ssexpand", lexpandshrtbl },
 		{ "current", lcurrent },
+		{ "timer", ltimer },
 		{ NULL, NULL },
 	};
 
@@ -120,8 +120,8 @@ lcallback(lua_State *L) {
 	return 0;
 }
 
-/* [lua_api] 调用 skynet 内置的命令, 命令有 TIMEOUT, REG, QUERY, NAME, EXIT, KILL, LAUNCH, GETENV, SETENV, STARTTIME, ENDLESS,
- * ABORT, MONITOR, MQLEN, LOGON, LOGOFF, SIGNAL .
+/* [lua_api] 调用 skynet 内置的命令, 命令有 TIMEOUT, TIMEOUTMS, CANCEL, REG, QUERY, NAME, EXIT, KILL, LAUNCH, GETENV, SETENV, STARTTIME, ENDLESS,
+ * ABORT, MONITOR, MQLEN, STAT, EXCLUSIVE, LIMIT, LATENCY, TRACE, LOGON, LOGOFF, SIGNAL .
  * 具体参考 skynet_server.c 的 cmd_funcs 数组, 命令的参数都是字符串形式, 有的命令没有参数. 命令是区分大小写的, 如果发起不存在的命令将返回 nil .
  *
  * 参数: string [1] 是命令字符串; string [2] 如果存在则为命令的参数;
@@ -144,8 +144,8 @@ lcommand(lua_State *L) {
 	return 0;
 }
 
-/* [lua_api] 以 int 类型值为参数调用 skynet 内置的命令. 命令有 TIMEOUT, REG, QUERY, NAME, EXIT, KILL, LAUNCH, GETENV, SETENV, STARTTIME, ENDLESS,
- * ABORT, MONITOR, MQLEN, LOGON, LOGOFF, SIGNAL .
+/* [lua_api] 以 int 类型值为参数调用 skynet 内置的命令. 命令有 TIMEOUT, TIMEOUTMS, CANCEL, REG, QUERY, NAME, EXIT, KILL, LAUNCH, GETENV, SETENV, STARTTIME, ENDLESS,
+ * ABORT, MONITOR, MQLEN, STAT, EXCLUSIVE, LIMIT, LATENCY, TRACE, LOGON, LOGOFF, SIGNAL .
  * 具体参考 skynet_server.c 的 cmd_funcs 数组, 内置命令的参数都是字符串类型, 再调用之前会将整数转为字符串类型. 得到的结果也会转为整数类型.
  *
  * 参数: string [1] 是命令字符串; int [2] 如果存在则为命令的参数;
@@ -209,7 +209,7 @@ get_dest_string(lua_State *L, int index) {
   * 参数: int/string [1] 表示服务句柄或者服务名字; int [2] 是消息类型, 定义在 skynet.lua 中; int/nil [3] 是会话号, 如果是 nil 将有系统分配;
   *       string/lightuserdata [4] 是消息数据; int [5] 仅在消息是轻量用户数据时提供, 用于指示数据的长度;
   *
-  * 返回: 发送成功后的会话号, 或者发送失败时返回 nil, 当参数不符合要求时将抛出错误 */
+  * 返回: 发送成功后的会话号, 或者发送失败时返回 nil, 目标服务的消息队列超出上限而拒绝时返回 false, 当参数不符合要求时将抛出错误 */
 static int
 lsend(lua_State *L) {
 	struct skynet_context * context = lua_touserdata(L, lua_upvalueindex(1));
@@ -260,6 +260,11 @@ lsend(lua_State *L) {
 		luaL_error(L, "skynet.send invalid param %s", lua_typename(L, lua_type(L,4)));
 	}
 	if (session < 0) {
+		if (session == -2) {
+			// the queue of destination is over its limit
+			lua_pushboolean(L, 0);
+			return 1;
+		}
 		// send to invalid address
 		// todo: maybe throw an error would be better
 		return 0;
@@ -411,6 +416,22 @@ ltrash(lua_State *L) {
 	return 0;
 }
 
+/* [lua_api] 解出 PTYPE_TIMER 消息中的会话号. 参数为消息内容 msg 、消息大小 sz 和一个用于存放会话号的表,
+ * 会话号依次写入表的 1 ~ n 项, 返回数量 n . 表可以重复使用以避免每个滴答都生成新表, 多出的旧项不会清除. */
+static int
+ltimersessions(lua_State *L) {
+	const int * session = lua_touserdata(L,1);
+	int n = (int)(luaL_checkinteger(L,2) / sizeof(int));
+	luaL_checktype(L,3,LUA_TTABLE);
+	int i;
+	for (i=0;i<n;i++) {
+		lua_pushinteger(L, session[i]);
+		lua_rawseti(L, 3, i+1);
+	}
+	lua_pushinteger(L, n);
+	return 1;
+}
+
 /* [lua_api] 获取当前时间, 单位是厘秒. 这个值可以看作是自系统启动以来经过的厘秒数. */
 static int
 lnow(lua_State *L) {
@@ -419,6 +440,13 @@ lnow(lua_State *L) {
 	return 1;
 }
 
+/* [lua_api] 获取单调递增的高精度时间戳, 单位是纳秒, 用于度量短时间间隔. */
+static int
+lhpc(lua_State *L) {
+	lua_pushinteger(L, skynet_hpc());
+	return 1;
+}
+
 /* 将 C 函数注册为 Lua 函数, 所有函数则都会共享服务实例对象为上值. */
 int
 luaopen_skynet_core(lua_State *L) {
@@ -439,6 +467,8 @@ luaopen_skynet_core(lua_State *L) {
 		{ "trash" , ltrash },
 		{ "callback", lcallback },
 		{ "now", lnow },
+		{ "hpc", lhpc },
+		{ "timersessions", ltimersessions },
 		{ NULL, NULL },
 	};
 
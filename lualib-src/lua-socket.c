@@ -44,7 +44,7 @@ lfreepool(lua_State *L) {
 	for (i=0;i<sz;i++) {
 		struct buffer_node *node = &pool[i];
 		if (node->msg) {
-			skynet_free(node->msg);
+			skynet_socket_free_buffer(node->msg, node->sz);
 			node->msg = NULL;
 		}
 	}
@@ -159,7 +159,7 @@ lpushbuffer(lua_State *L) {
 	return 1;
 }
 
-/* 回收缓存列表 sb 的头结点到缓存节点池中, 回收的同时将释放其消息体的内存. 并且会导致缓存列表的下次读取起点 offset 变为 0 .
+/* 回收缓存列表 sb 的头结点到缓存节点池中, 回收的同时将其消息体的内存归还给 socket 线程的接收缓冲池. 并且会导致缓存列表的下次读取起点 offset 变为 0 .
  * 参数: L 为 lua 虚拟机, 其 pool 索引处为缓存节点池; pool 是缓存节点池所在的索引, 它是一个 lua 表; sb 是缓存列表;
  * 函数将保证结束时虚拟机上的值的位置不会改变 */
 static void
@@ -173,7 +173,7 @@ return_free_node(lua_State *L, int pool, struct socket_buffer *sb) {
 	lua_rawgeti(L,pool,1);
 	free_node->next = lua_touserdata(L,-1);
 	lua_pop(L,1);
-	skynet_free(free_node->msg);
+	skynet_socket_free_buffer(free_node->msg, free_node->sz);
 	free_node->msg = NULL;
 
 	free_node->sz = 0;
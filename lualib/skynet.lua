@@ -26,6 +26,8 @@ local skynet = {
 	PTYPE_DEBUG = 9,
 	PTYPE_LUA = 10,
 	PTYPE_SNAX = 11,
+	PTYPE_OVERLOAD = 12,
+	PTYPE_TIMER = 13,
 }
 
 -- code cache
@@ -54,6 +56,7 @@ local watching_session = {}
 local dead_service = {}
 local error_queue = {}
 local fork_queue = {}
+local overload_func
 
 -- suspend is function
 local suspend
@@ -121,7 +124,12 @@ local function dispatch_wakeup()
 		wakeup_session[co] = nil
 		local session = sleep_session[co]
 		if session then
-			session_id_coroutine[session] = "BREAK"
+			-- 取消睡眠的定时器, 若已经到期则忽略之后到达的回应
+			if c.intcommand("CANCEL", session) then
+				session_id_coroutine[session] = nil
+			else
+				session_id_coroutine[session] = "BREAK"
+			end
 			return suspend(co, coroutine_resume(co, false, "BREAK"))
 		end
 	end
@@ -250,16 +258,15 @@ function suspend(co, result, command, param, size)
 	dispatch_error_queue()
 end
 
-function skynet.timeout(ti, func)
-	local session = c.intcommand("TIMEOUT",ti)
+local function timeout(session, func)
 	assert(session)
 	local co = co_create(func)
 	assert(session_id_coroutine[session] == nil)
 	session_id_coroutine[session] = co
+	return session
 end
 
-function skynet.sleep(ti)
-	local session = c.intcommand("TIMEOUT",ti)
+local function sleep(session)
 	assert(session)
 	local succ, ret = coroutine_yield("SLEEP", session)
 	sleep_session[coroutine.running()] = nil
@@ -273,6 +280,39 @@ function skynet.sleep(ti)
 	end
 end
 
+function skynet.timeout(ti, func)
+	return timeout(c.intcommand("TIMEOUT",ti), func)
+end
+
+function skynet.sleep(ti)
+	return sleep(c.intcommand("TIMEOUT",ti))
+end
+
+-- 与 skynet.timeout 和 skynet.sleep 相同, 但时间的单位是毫秒. 精度由配置 timer_tick 决定, 默认为 10 毫秒
+function skynet.timeout_ms(ms, func)
+	return timeout(c.intcommand("TIMEOUTMS",ms), func)
+end
+
+function skynet.sleep_ms(ms)
+	return sleep(c.intcommand("TIMEOUTMS",ms))
+end
+
+-- 取消 skynet.timeout 或 skynet.timeout_ms 返回的定时器, 它的函数不会再被调用. 定时器还未到期时返回 true ,
+-- 此时定时器从定时线程中移除, 不会再产生消息; 已经到期(消息已在队列中)时返回 false , 之后到达的消息会被忽略.
+function skynet.cancel(session)
+	local co = session_id_coroutine[session]
+	if co == nil or co == "BREAK" then
+		return false
+	end
+	if c.intcommand("CANCEL", session) then
+		session_id_coroutine[session] = nil
+		return true
+	else
+		session_id_coroutine[session] = "BREAK"
+		return false
+	end
+end
+
 function skynet.yield()
 	return skynet.sleep(0)
 end
@@ -302,6 +342,7 @@ function skynet.localname(name)
 end
 
 skynet.now = c.now
+skynet.hpc = c.hpc	-- 高精度时间戳, 单位纳秒
 
 local starttime
 
@@ -377,18 +418,28 @@ local function yield_call(service, session)
 	return msg,sz
 end
 
+-- f(address, length) is called when a service limited with the "signal" policy (see skynet.limit) is over its limit
+function skynet.overload(f)
+	overload_func = f
+end
+
 function skynet.call(addr, typename, ...)
 	local p = proto[typename]
 	local session = c.send(addr, p.id , nil , p.pack(...))
 	if session == nil then
 		error("call to invalid address " .. skynet.address(addr))
+	elseif session == false then
+		error("call to overloaded service " .. skynet.address(addr))
 	end
 	return p.unpack(yield_call(addr, session))
 end
 
 function skynet.rawcall(addr, typename, msg, sz)
 	local p = proto[typename]
-	local session = assert(c.send(addr, p.id , nil , msg, sz), "call to invalid address")
+	local session = c.send(addr, p.id , nil , msg, sz)
+	if not session then
+		error(session == nil and "call to invalid address" or "call to overloaded service")
+	end
 	return yield_call(addr, session)
 end
 
@@ -455,18 +506,43 @@ function skynet.fork(func,...)
 	return co
 end
 
+local function dispatch_response(session, source, msg, sz)
+	local co = session_id_coroutine[session]
+	if co == "BREAK" then
+		session_id_coroutine[session] = nil
+	elseif co == nil then
+		unknown_response(session, source, msg, sz)
+	else
+		session_id_coroutine[session] = nil
+		suspend(co, coroutine_resume(co, true, msg, sz))
+	end
+end
+
+local timer_sessions = {}
+
+-- 开启 timer_coalesce 时, 同一滴答内到期的多个定时器合并为一条消息, 依次唤醒它们的协程.
+-- 一个协程出错不影响唤醒其余的协程, 所有错误在最后一并抛出
+local function dispatch_timer(msg, sz, source)
+	local n = c.timersessions(msg, sz, timer_sessions)
+	local err
+	for i = 1, n do
+		local ok, e = pcall(dispatch_response, timer_sessions[i], source, nil, 0)
+		if not ok then
+			err = err and (err .. "\n" .. tostring(e)) or tostring(e)
+		end
+	end
+	if err then
+		error(err)
+	end
+end
+
 local function raw_dispatch_message(prototype, msg, sz, session, source)
 	-- skynet.PTYPE_RESPONSE = 1, read skynet.h
 	if prototype == 1 then
-		local co = session_id_coroutine[session]
-		if co == "BREAK" then
-			session_id_coroutine[session] = nil
-		elseif co == nil then
-			unknown_response(session, source, msg, sz)
-		else
-			session_id_coroutine[session] = nil
-			suspend(co, coroutine_resume(co, true, msg, sz))
-		end
+		dispatch_response(session, source, msg, sz)
+	-- skynet.PTYPE_TIMER = 13
+	elseif prototype == 13 then
+		dispatch_timer(msg, sz, source)
 	else
 		local p = proto[prototype]
 		if p == nil then
@@ -572,6 +648,17 @@ do
 		unpack = function(...) return ... end,
 		dispatch = _error_dispatch,
 	}
+
+	REG {
+		name = "overload",
+		id = skynet.PTYPE_OVERLOAD,
+		unpack = function(msg, sz) return tonumber(c.tostring(msg, sz)) end,
+		dispatch = function(_, source, length)
+			if overload_func then
+				overload_func(source, length)
+			end
+		end,
+	}
 end
 
 local init_func = {}
@@ -641,6 +728,10 @@ function skynet.mqlen()
 	return c.intcommand "MQLEN"
 end
 
+function skynet.stat(what)
+	return tonumber(c.command("STAT", what))
+end
+
 function skynet.task(ret)
 	local t = 0
 	for session,co in pairs(session_id_coroutine) do
@@ -27,6 +27,12 @@ local function init(skynet, export)
 			local stat = {}
 			stat.mqlen = skynet.mqlen()
 			stat.task = skynet.task()
+			stat.message = skynet.stat "message"
+			stat.slice = skynet.stat "slice"
+			stat.batch = skynet.stat "batch"
+			stat.cost = skynet.stat "cost"
+			stat.drain = skynet.stat "drain"
+			stat.budget = skynet.stat "budget"
 			skynet.ret(skynet.pack(stat))
 		end
 
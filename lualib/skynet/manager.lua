@@ -49,6 +49,23 @@ function skynet.name(name, handle)
 	end
 end
 
+-- 让服务独占一条专用工作线程 (需要配置 exclusive ), addr 缺省为自身. 返回专用线程编号, 没有空闲线程时返回 nil
+function skynet.exclusive(addr)
+	local id
+	if addr then
+		id = c.command("EXCLUSIVE", skynet.address(addr))
+	else
+		id = c.command("EXCLUSIVE")
+	end
+	return tonumber(id)
+end
+
+-- 设置自身消息队列长度的上限, 0 表示不限制. policy 为 "reject" (缺省, 发送者的 skynet.send 返回 false, skynet.call 抛出错误),
+-- "drop" (分发时丢弃最旧的消息, 队列达到两倍上限时与 "reject" 一样拒绝新的消息) 或 "signal" (接受消息, 并通知发送者, 参见 skynet.overload)
+function skynet.limit(n, policy)
+	c.command("LIMIT", string.format("%d %s", n, policy or "reject"))
+end
+
 local dispatch_message = skynet.dispatch_message
 
 function skynet.forward_type(map, start_func)
@@ -54,7 +54,7 @@ messagepool_free(struct messagepool *pool) {
 	pool->freelist = NULL;
 }
 
-/* 将数据缓存中的头结点重新放回消息池中, 供下次使用. 当全部归还之后 head 和 tail 将重置为 NULL . */
+/* 将数据缓存中的头结点重新放回消息池中, 供下次使用, 消息内容归还给 socket 线程的接收缓冲池. 当全部归还之后 head 和 tail 将重置为 NULL . */
 static inline void
 _return_message(struct databuffer *db, struct messagepool *mp) {
 	struct message *m = db->head;
@@ -64,7 +64,7 @@ _return_message(struct databuffer *db, struct messagepool *mp) {
 	} else {
 		db->head = m->next;
 	}
-	skynet_free(m->buffer);
+	skynet_socket_free_buffer(m->buffer, m->size);
 	m->buffer = NULL;
 	m->size = 0;
 	m->next = mp->freelist;
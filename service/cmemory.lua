@@ -10,5 +10,6 @@ end
 
 print("Total memory:", memory.total())
 print("Total block:", memory.block())
+print("Timer pool:", memory.timer())
 
 skynet.start(function() skynet.exit() end)
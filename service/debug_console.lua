@@ -143,6 +143,8 @@ function COMMAND.help()
 		cmem = "Show C memory info",
 		shrtbl = "Show shared short string table info",
 		ping = "ping address",
+		trace = "trace filename : dump recent message dispatch of all worker threads as chrome trace json",
+		latency = "latency [address] : show message service/wait time percentiles (wait needs -DMESSAGE_LATENCY), latency reset [address]",
 	}
 end
 
@@ -294,6 +296,49 @@ function COMMAND.shrtbl()
 	return { n = n, total = total, longest = longest, space = space }
 end
 
+-- 以 "count mean p50 p90 p99 p99.9 max" 的格式返回服务 address 的一类耗时统计, 时间单位为微秒
+local function latency_line(address, kind)
+	local function get(stat)
+		return tonumber((core.command("LATENCY", string.format("%s %s %s", address, kind, stat))))
+	end
+	local count = get "count"
+	if count == nil then
+		return
+	end
+	local line = { string.format("count=%d", count) }
+	for _, stat in ipairs { "mean", "50", "90", "99", "99.9", "max" } do
+		local name = tonumber(stat) and "p" .. stat or stat
+		table.insert(line, string.format("%s=%.1fus", name, get(stat) / 1000))
+	end
+	return table.concat(line, " ")
+end
+
+function COMMAND.latency(fd, address, ...)
+	if address == "reset" then
+		local list = ... and { [skynet.address(adjust_address(...))] = true } or skynet.call(".launcher", "lua", "LIST")
+		for k in pairs(list) do
+			core.command("LATENCY", k .. " reset")
+		end
+		return
+	end
+	if address then
+		address = skynet.address(adjust_address(address))
+		return { service = latency_line(address, "service"), wait = latency_line(address, "wait") }
+	end
+	local result = {}
+	for k in pairs(skynet.call(".launcher", "lua", "LIST")) do
+		local wait = latency_line(k, "wait")
+		result[k] = "service: " .. tostring(latency_line(k, "service")) .. (wait and ("  wait: " .. wait) or "")
+	end
+	return result
+end
+
+function COMMAND.trace(fd, filename)
+	local n = core.command("TRACE", assert(filename, "Need a filename"))
+	assert(n, "Can't write trace file " .. filename)
+	return string.format("%s events written to %s", n, filename)
+end
+
 function COMMAND.ping(fd, address)
 	address = adjust_address(address)
 	local ti = skynet.now()
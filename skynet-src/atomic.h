@@ -6,6 +6,12 @@
 
 /* ATOM_CAS_POINTER 专门用于比较交换指针的原子操作, 当交换成功时返回 true */
 #define ATOM_CAS_POINTER(ptr, oval, nval) __sync_bool_compare_and_swap(ptr, oval, nval)
+
+/* 以原子方式将 ptr 指向的变量设置为 nval 并返回原先的值, 同时是一道完整的内存屏障 */
+#define ATOM_XCHG(ptr, nval) __atomic_exchange_n(ptr, nval, __ATOMIC_SEQ_CST)
+/* 带获取语义的读取和带释放语义的写入, 用于单写者发布数据: 写入之前的内容对读到新值的读者可见 */
+#define ATOM_LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define ATOM_STORE(ptr, nval) __atomic_store_n(ptr, nval, __ATOMIC_RELEASE)
 #define ATOM_INC(ptr) __sync_add_and_fetch(ptr, 1)
 #define ATOM_FINC(ptr) __sync_fetch_and_add(ptr, 1)
 #define ATOM_DEC(ptr) __sync_sub_and_fetch(ptr, 1)
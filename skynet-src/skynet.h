@@ -23,6 +23,10 @@
 #define PTYPE_RESERVED_DEBUG 9
 #define PTYPE_RESERVED_LUA 10
 #define PTYPE_RESERVED_SNAX 11
+// read lualib/skynet.lua , sent back to the sender when the destination queue is over its limit
+#define PTYPE_OVERLOAD 12
+// read lualib/skynet.lua , timers of one service expiring in the same tick, the data is an int array of sessions (timer_coalesce)
+#define PTYPE_TIMER 13
 
 #define PTYPE_TAG_DONTCOPY 0x10000
 #define PTYPE_TAG_ALLOCSESSION 0x20000
@@ -45,6 +49,7 @@ void skynet_callback(struct skynet_context * context, void *ud, skynet_cb cb);
 
 uint32_t skynet_current_handle(void);
 uint64_t skynet_now(void);
+uint64_t skynet_hpc(void);	// high-performance counter in nanoseconds
 void skynet_debug_memory(const char *info);	// for debug use, output current service memory to stderr
 
 #endif
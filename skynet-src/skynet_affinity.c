@@ -0,0 +1,213 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include "skynet.h"
+#include "skynet_affinity.h"
+#include "skynet_imp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* skynet_affinity 模块负责将工作线程、socket 线程、定时线程和监控线程绑定到配置的 cpu 上,
+ * 并在开启 numa 选项时将工作线程依次分布到各个 numa 节点上. 每条线程在启动时调用 skynet_affinity_bind
+ * 绑定自身, 此后它分配的内存会按照操作系统的首次访问策略落在本地节点上. 目前仅支持 linux . */
+
+#if defined(__linux__)
+
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+
+#define MAX_NUMA_NODE 64
+#define MPOL_MF_MOVE (1<<1)
+
+/* 一组 cpu 编号, 保持配置中的顺序, 工作线程依次轮流选取其中一个 */
+struct cpu_list {
+	int n;                                    /* cpu 的数量 */
+	int cpu[CPU_SETSIZE];                     /* cpu 编号 */
+};
+
+/* 线程布局信息, 只在启动时初始化一次, 之后只读 */
+struct affinity {
+	int node_count;                           /* numa 节点数量, 未开启 numa 选项时为 0 */
+	cpu_set_t node[MAX_NUMA_NODE];            /* 每个 numa 节点拥有的 cpu */
+	struct cpu_list thread[THREAD_MONITOR+1]; /* 各类线程配置的 cpu 列表, 以线程类别为索引 */
+};
+
+static struct affinity A;
+
+/* 解析形如 "0-3,8,10-11" 的 cpu 列表字符串, 并追加到 l 中. 成功返回 0, 格式错误返回 -1 . */
+static int
+parse_cpulist(const char *str, struct cpu_list *l) {
+	const char *p = str;
+	while (*p) {
+		char *end;
+		long from = strtol(p, &end, 10);
+		if (end == p || from < 0 || from >= CPU_SETSIZE) {
+			return -1;
+		}
+		long to = from;
+		p = end;
+		if (*p == '-') {
+			++p;
+			to = strtol(p, &end, 10);
+			if (end == p || to < from || to >= CPU_SETSIZE) {
+				return -1;
+			}
+			p = end;
+		}
+		for (;from <= to && l->n < CPU_SETSIZE; from++) {
+			l->cpu[l->n++] = (int)from;
+		}
+		while (*p == ',' || *p == ' ' || *p == '\n') {
+			++p;
+		}
+	}
+	return 0;
+}
+
+/* 从 sysfs 中读取每个 numa 节点拥有的 cpu , 节点编号需要从 0 开始连续 */
+static void
+load_numa() {
+	int i;
+	for (i=0;i<MAX_NUMA_NODE;i++) {
+		char path[64];
+		char buf[1024];
+		sprintf(path, "/sys/devices/system/node/node%d/cpulist", i);
+		FILE *f = fopen(path, "r");
+		if (f == NULL) {
+			break;
+		}
+		struct cpu_list *l = skynet_malloc(sizeof(*l));
+		l->n = 0;
+		CPU_ZERO(&A.node[i]);
+		if (fgets(buf, sizeof(buf), f) && parse_cpulist(buf, l) == 0) {
+			int j;
+			for (j=0;j<l->n;j++) {
+				CPU_SET(l->cpu[j], &A.node[i]);
+			}
+		}
+		skynet_free(l);
+		fclose(f);
+	}
+	A.node_count = i;
+}
+
+/* 获取 cpu 所在的 numa 节点, 未知时返回 -1 */
+static int
+node_of(int cpu) {
+	int i;
+	for (i=0;i<A.node_count;i++) {
+		if (CPU_ISSET(cpu, &A.node[i])) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* 设置 type 类别线程的 cpu 列表, 配置项 key 的值为 str , 没有配置时不做任何事情 */
+static int
+set_cpulist(int type, const char *key, const char *str) {
+	if (str == NULL) {
+		return 0;
+	}
+	if (parse_cpulist(str, &A.thread[type]) || A.thread[type].n == 0) {
+		fprintf(stderr, "Invalid cpu list %s = %s\n", key, str);
+		return -1;
+	}
+	return 0;
+}
+
+/* 依据配置初始化线程布局, 配置错误时返回 -1 */
+int
+skynet_affinity_init(struct skynet_config * config) {
+	memset(&A, 0, sizeof(A));
+	if (config->numa) {
+		load_numa();
+	}
+	if (set_cpulist(THREAD_WORKER, "cpu_worker", config->cpu_worker) ||
+		set_cpulist(THREAD_SOCKET, "cpu_socket", config->cpu_socket) ||
+		set_cpulist(THREAD_TIMER, "cpu_timer", config->cpu_timer) ||
+		set_cpulist(THREAD_MONITOR, "cpu_monitor", config->cpu_monitor)) {
+		return -1;
+	}
+	return 0;
+}
+
+/* 将当前线程绑定到 type 类别线程所配置的 cpu 上. 工作线程依据编号 id 轮流选取一个 cpu ,
+ * 若没有配置而开启了 numa 选项, 则依次绑定到各个 numa 节点的所有 cpu 上; 其它类别的线程绑定到整个 cpu 列表.
+ * 返回当前线程所在的 numa 节点, 未知时返回 -1 . */
+int
+skynet_affinity_bind(int type, int id) {
+	cpu_set_t set;
+	int node = -1;
+	CPU_ZERO(&set);
+	struct cpu_list *l = &A.thread[type];
+	if (l->n > 0) {
+		if (type == THREAD_WORKER) {
+			int cpu = l->cpu[id % l->n];
+			CPU_SET(cpu, &set);
+			node = node_of(cpu);
+		} else {
+			int i;
+			for (i=0;i<l->n;i++) {
+				CPU_SET(l->cpu[i], &set);
+			}
+			node = node_of(l->cpu[0]);
+		}
+	} else if (type == THREAD_WORKER && A.node_count > 1) {
+		node = id % A.node_count;
+		set = A.node[node];
+	}
+	if (CPU_COUNT(&set) > 0) {
+		int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (err) {
+			skynet_error(NULL, "Set cpu affinity of thread (type = %d, id = %d) failed : %s", type, id, strerror(err));
+		}
+	}
+	return node;
+}
+
+/* 将 [addr, addr+sz) 所在的内存页迁移到 numa 节点 node 上. 用于启动前已经被别的线程访问过的常驻对象,
+ * 如工作线程的运行队列. 迁移失败(如不支持 numa )时保持原样. */
+void
+skynet_affinity_migrate(void *addr, size_t sz, int node) {
+#ifdef SYS_move_pages
+	if (node < 0 || A.node_count < 2) {
+		return;
+	}
+	uintptr_t pagesize = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t page = (uintptr_t)addr & ~(pagesize - 1);
+	uintptr_t end = (uintptr_t)addr + sz;
+	for (;page < end; page += pagesize) {
+		void * p = (void *)page;
+		int status;
+		syscall(SYS_move_pages, 0, 1, &p, &node, &status, MPOL_MF_MOVE);
+	}
+#endif
+}
+
+#else
+
+int
+skynet_affinity_init(struct skynet_config * config) {
+	if (config->numa || config->cpu_worker || config->cpu_socket || config->cpu_timer || config->cpu_monitor) {
+		fprintf(stderr, "cpu affinity is not supported on this platform, ignored\n");
+	}
+	return 0;
+}
+
+int
+skynet_affinity_bind(int type, int id) {
+	return -1;
+}
+
+void
+skynet_affinity_migrate(void *addr, size_t sz, int node) {
+}
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef SKYNET_AFFINITY_H
+#define SKYNET_AFFINITY_H
+
+#include <stddef.h>
+
+struct skynet_config;
+
+int skynet_affinity_init(struct skynet_config * config);
+int skynet_affinity_bind(int type, int id);	// return numa node of the thread, -1 for unknown
+void skynet_affinity_migrate(void *addr, size_t sz, int node);
+
+#endif
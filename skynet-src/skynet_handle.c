@@ -3,39 +3,212 @@
 #include "skynet_handle.h"
 #include "skynet_server.h"
 #include "rwlock.h"
+#include "spinlock.h"
+#include "atomic.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 
 /* 服务插槽的起始容量 */
 #define DEFAULT_SLOT_SIZE 4
-/* 名字数组的最大容量 */
+/* 名字哈希表的起始桶数量 */
+#define DEFAULT_NAME_SIZE 16
+/* 名字哈希表的最大桶数量 */
 #define MAX_SLOT_SIZE 0x40000000
+/* 名字哈希表渐进式扩容时, 每次修改名字顺带迁移的桶的数量 */
+#define NAME_REHASH_STEP 4
+/* 名字缓存中名字的最大长度(包括结尾的 0 ), 更长的名字不会被缓存 */
+#define NAMECACHE_LENGTH 32
 
-/* skynet 服务的名字结构, 在调用时用 .name 表示服务名字 */
+/* skynet 服务的名字结构, 在调用时用 .name 表示服务名字. 名字同时串在两个链表中:
+ * 名字哈希表的桶链表, 以及它所属服务所在插槽的名字链表, 后者用于卸载服务时删除它的所有名字. */
 struct handle_name {
-	char * name;        /* 服务的名字 */
-	uint32_t handle;    /* 服务的地址 */
+	char * name;                /* 服务的名字 */
+	uint32_t handle;            /* 服务的地址 */
+	uint32_t hash;              /* 名字的哈希值 */
+	struct handle_name *next;   /* 同一个桶中的下一个名字 */
+	struct handle_name *link;   /* 同一个插槽中的下一个名字 */
+};
+
+/* 以名字为键的哈希表, 以链表解决冲突 */
+struct name_table {
+	int size;                       /* 桶的数量, 为 2 的幂, 0 表示未分配 */
+	int count;                      /* 名字的数量 */
+	struct handle_name **bucket;    /* 桶数组 */
+};
+
+/* 服务的名字缓存中的一项 */
+struct namecache_entry {
+	char name[NAMECACHE_LENGTH];    /* 名字 */
+	uint32_t handle;                /* 名字对应的服务地址, 0 表示空项 */
+	unsigned version;               /* 缓存时名字的版本号, 与当前版本号不同时失效 */
+};
+
+/* 服务私有的名字缓存, 直接映射, 只能被它所属的服务使用 */
+struct handle_namecache {
+	int mask;                       /* 项数减 1 , 项数为 2 的幂 */
+	struct namecache_entry entry[1];
+};
+
+/* 容纳服务指针的插槽数组, 容量与数组一起分配, 以便以一次指针读取得到一致的容量和数组 */
+struct handle_slot {
+	int size;                           /* 插槽的容量, 为 2 的倍数, 方便做位与形式的哈希运算 */
+	struct handle_name ** name;         /* 每个插槽中的服务的名字链表, 与插槽在同一块内存中, 只在持有写锁时访问 */
+	struct skynet_context * ctx[1];     /* 服务指针, 实际长度为 size */
+};
+
+/* 以服务地址查找服务(skynet_handle_grab)是无锁的, 读者只需要在查找期间声明自己所处的纪元(epoch).
+ * 插槽数组扩容后的旧数组以及销毁的服务对象不会立即释放, 而是挂在待回收链表上, 等到所有读者都离开了
+ * 回收时的纪元才释放. 每条调用过 skynet_handle_grab 的线程拥有一个纪元记录, 记录在线程结束后可以被新线程重用. */
+struct epoch_record {
+	unsigned active;                    /* 读者正在查找时为 (纪元 << 1) | 1 , 否则为 0 */
+	int used;                           /* 是否被一条线程占用 */
+	struct epoch_record *next;          /* 所有记录串成的链表, 记录永远不会被释放 */
+};
+
+/* 待回收的内存 */
+struct epoch_garbage {
+	void *ptr;                          /* 待释放的内存 */
+	unsigned epoch;                     /* 挂上链表时的全局纪元 */
+	struct epoch_garbage *next;
 };
 
 /* 所有服务的句柄存储器, 服务以其地址的哈希值为索引存储于插槽中, 而服务名字则以
  * 字典顺序存储. */
 struct handle_storage {
-	struct rwlock lock;                 /* 读写锁, 当需要以地址获取服务对象时对读锁加锁, 当插入新的服务时对写锁加锁 */
+	struct rwlock lock;                 /* 读写锁, 修改插槽时对写锁加锁; 以地址查找服务不加锁, 查找名字时对读锁加锁 */
 
 	uint32_t harbor;                    /* 当前 skynet 节点的 harbor id , 但是被移位到了最高 8 位 */
 	uint32_t handle_index;              /* 下一个服务地址分配的起点, 此值保证单调递增 */
-	int slot_size;                      /* 容纳服务指针的插槽的容量, 为 2 的倍数, 方便做位与形式的哈希运算 */
-	struct skynet_context ** slot;      /* 容纳服务指针的插槽 */
+	struct handle_slot * slot;          /* 容纳服务指针的插槽, 扩容时整体替换 */
+
+	unsigned epoch;                     /* 全局纪元, 只在所有正在查找的读者都处于当前纪元时才推进 */
+	struct epoch_record *record;        /* 所有线程的纪元记录 */
+	pthread_key_t record_key;           /* 保存当前线程的纪元记录的线程特定数据键 */
+	struct spinlock lock_garbage;       /* 待回收链表的锁 */
+	struct epoch_garbage *garbage;      /* 待回收链表, 新挂上的在前 */
 	
-	int name_cap;                       /* 供存储名字的内存可容纳的名字个数 */
-	int name_count;                     /* 当前已经存储的名字个数 */
-	struct handle_name *name;           /* 容纳服务名字的数组 */
+	struct name_table name[2];          /* 名字哈希表, 渐进式扩容时新插入的名字放在 name[1] 中 */
+	int rehash;                         /* 渐进式扩容时 name[0] 中下一个待迁移的桶, -1 表示没有在扩容 */
+	unsigned name_version;              /* 名字的版本号, 删除名字时增加, 令所有名字缓存失效 */
+	int namecache;                      /* 每个服务的名字缓存的项数, 0 表示不使用名字缓存 */
 };
 
 static struct handle_storage *H = NULL;
 
+/* 分配容量为 size 的空插槽数组 */
+static struct handle_slot *
+slot_new(int size) {
+	size_t sz = sizeof(struct handle_slot) + (size - 1) * sizeof(struct skynet_context *) + size * sizeof(struct handle_name *);
+	struct handle_slot * slot = skynet_malloc(sz);
+	memset(slot, 0, sz);
+	slot->size = size;
+	slot->name = (struct handle_name **)&slot->ctx[size];
+	return slot;
+}
+
+/* 获取当前线程的纪元记录, 第一次调用时优先重用已经结束的线程留下的记录, 否则分配一个新的并以无锁方式插入链表 */
+static struct epoch_record *
+epoch_local(struct handle_storage *s) {
+	struct epoch_record *r = pthread_getspecific(s->record_key);
+	if (r) {
+		return r;
+	}
+	for (r = s->record; r; r = r->next) {
+		if (r->used == 0 && ATOM_CAS(&r->used, 0, 1)) {
+			break;
+		}
+	}
+	if (r == NULL) {
+		r = skynet_malloc(sizeof(*r));
+		r->active = 0;
+		r->used = 1;
+		do {
+			r->next = s->record;
+		} while (!ATOM_CAS_POINTER(&s->record, r->next, r));
+	}
+	pthread_setspecific(s->record_key, r);
+	return r;
+}
+
+/* 线程结束时归还纪元记录 */
+static void
+epoch_release(void *p) {
+	struct epoch_record *r = p;
+	r->active = 0;
+	ATOM_STORE(&r->used, 0);
+}
+
+/* 读者开始无锁查找, 声明自己处于当前纪元. 屏障保证声明先于之后对插槽的读取对回收者可见 */
+static inline struct epoch_record *
+epoch_enter(struct handle_storage *s) {
+	struct epoch_record *r = epoch_local(s);
+	r->active = (s->epoch << 1) | 1;
+	__sync_synchronize();
+	return r;
+}
+
+/* 读者结束查找 */
+static inline void
+epoch_leave(struct epoch_record *r) {
+	ATOM_STORE(&r->active, 0);
+}
+
+/* 尝试推进全局纪元, 当所有正在查找的读者都处于当前纪元时才能推进. 返回推进之后的纪元 */
+static unsigned
+epoch_advance(struct handle_storage *s) {
+	unsigned epoch = s->epoch;
+	unsigned current = (epoch << 1) | 1;
+	__sync_synchronize();
+	struct epoch_record *r;
+	for (r = s->record; r; r = r->next) {
+		unsigned active = ATOM_LOAD(&r->active);
+		if (active && active != current) {
+			return epoch;
+		}
+	}
+	if (ATOM_CAS(&s->epoch, epoch, epoch + 1)) {
+		return epoch + 1;
+	}
+	return s->epoch;
+}
+
+/* 推进纪元并释放所有挂上链表之后已经经过两个纪元的内存, 此时不可能还有读者持有它们 */
+static void
+epoch_collect(struct handle_storage *s) {
+	unsigned epoch = epoch_advance(s);
+	spinlock_lock(&s->lock_garbage);
+	struct epoch_garbage **pp = &s->garbage;
+	while (*pp && epoch - (*pp)->epoch < 2) {
+		pp = &(*pp)->next;
+	}
+	struct epoch_garbage *g = *pp;
+	*pp = NULL;
+	spinlock_unlock(&s->lock_garbage);
+	while (g) {
+		struct epoch_garbage *next = g->next;
+		skynet_free(g->ptr);
+		skynet_free(g);
+		g = next;
+	}
+}
+
+/* 推迟释放 ptr 直到所有可能正在无锁访问它的读者都结束查找, 用于被替换的插槽数组和销毁的服务对象. 此函数是线程安全的. */
+void
+skynet_handle_defer(void *ptr) {
+	struct handle_storage *s = H;
+	struct epoch_garbage *g = skynet_malloc(sizeof(*g));
+	g->ptr = ptr;
+	spinlock_lock(&s->lock_garbage);
+	g->epoch = s->epoch;
+	g->next = s->garbage;
+	s->garbage = g;
+	spinlock_unlock(&s->lock_garbage);
+	epoch_collect(s);
+}
+
 /* 将服务 ctx 注册到服务句柄存储中去并返回相应的服务地址.
  * 参数: ctx 为待注册的服务
  * 返回: 注册成功后返回服务的地址 */
@@ -49,13 +222,14 @@ skynet_handle_register(struct skynet_context *ctx) {
 		/* 以 handle_index 为起点查询插槽中所有的空槽, 查询的方式是以增加后的 handle 值
 		 * 对槽的大小位与并作为其索引查询是否空闲. 整个过程中 handle 和 handle_index 都是单调递增的.
 		 * 如果没有一个空闲槽, 则对插槽进行扩容再插入. */
+		struct handle_slot *slot = s->slot;
 		int i;
-		for (i=0;i<s->slot_size;i++) {
+		for (i=0;i<slot->size;i++) {
 			/* 将值与插槽容量的位与值作为哈希值 */
 			uint32_t handle = (i+s->handle_index) & HANDLE_MASK;
-			int hash = handle & (s->slot_size-1);
-			if (s->slot[hash] == NULL) {
-				s->slot[hash] = ctx;
+			int hash = handle & (slot->size-1);
+			if (slot->ctx[hash] == NULL) {
+				ATOM_STORE(&slot->ctx[hash], ctx);
 				s->handle_index = handle + 1;
 
 				rwlock_wunlock(&s->lock);
@@ -64,22 +238,23 @@ skynet_handle_register(struct skynet_context *ctx) {
 				return handle;
 			}
 		}
-		assert((s->slot_size*2 - 1) <= HANDLE_MASK);
-		struct skynet_context ** new_slot = skynet_malloc(s->slot_size * 2 * sizeof(struct skynet_context *));
-		memset(new_slot, 0, s->slot_size * 2 * sizeof(struct skynet_context *));
+		assert((slot->size*2 - 1) <= HANDLE_MASK);
+		struct handle_slot * new_slot = slot_new(slot->size * 2);
 		
-		/* 扩容之后需要将元素重新哈希到新的位置去 */
-		for (i=0;i<s->slot_size;i++) {
-			int hash = skynet_context_handle(s->slot[i]) & (s->slot_size * 2 - 1);
-			assert(new_slot[hash] == NULL);
-			new_slot[hash] = s->slot[i];
+		/* 扩容之后需要将元素重新哈希到新的位置去. 新数组完整之后才发布, 旧数组可能还有读者在访问, 推迟回收 */
+		for (i=0;i<slot->size;i++) {
+			int hash = skynet_context_handle(slot->ctx[i]) & (new_slot->size - 1);
+			assert(new_slot->ctx[hash] == NULL);
+			new_slot->ctx[hash] = slot->ctx[i];
+			new_slot->name[hash] = slot->name[i];
 		}
-		skynet_free(s->slot);
-		s->slot = new_slot;
-		s->slot_size *= 2;
+		ATOM_STORE(&s->slot, new_slot);
+		skynet_handle_defer(slot);
 	}
 }
 
+static void _remove_name(struct handle_storage *s, struct handle_name *n);
+
 /* 将一个地址为 handle 的服务卸载, 并将与之相关的名字删除. 当卸载成功时返回 1 , 如果尝试卸载时服务
  * 已经不存在了, 那么不做任何操作并返回 0 . 整个函数是线程安全的.
  *
@@ -93,26 +268,26 @@ skynet_handle_retire(uint32_t handle) {
 	rwlock_wlock(&s->lock);
 
 	/* 将服务地址与插槽容量的位与值作为哈希值 */
-	uint32_t hash = handle & (s->slot_size-1);
-	struct skynet_context * ctx = s->slot[hash];
+	struct handle_slot *slot = s->slot;
+	uint32_t hash = handle & (slot->size-1);
+	struct skynet_context * ctx = slot->ctx[hash];
 
-	/* 查询到服务存在且地址确实是传入的参数时才会执行卸载 */
+	/* 查询到服务存在且地址确实是传入的参数时才会执行卸载. 之后正在查找的读者可能还会读到它,
+	 * 但服务对象的内存由 skynet_handle_defer 推迟回收, 引用计数为 0 时读者也不会再引用它 */
 	if (ctx != NULL && skynet_context_handle(ctx) == handle) {
-		s->slot[hash] = NULL;
+		ATOM_STORE(&slot->ctx[hash], NULL);
 		ret = 1;
-		/* 将服务的名字删除, 且空出来的位置被后面的名字填充掉. */
-		int i;
-		int j=0, n=s->name_count;
-		for (i=0; i<n; ++i) {
-			if (s->name[i].handle == handle) {
-				skynet_free(s->name[i].name);
-				continue;
-			} else if (i!=j) {
-				s->name[j] = s->name[i];
+		/* 将服务的名字删除. 插槽的名字链表中也可能有给其它(不存在的)地址起的名字, 需要保留 */
+		struct handle_name **pp = &slot->name[hash];
+		while (*pp) {
+			struct handle_name *n = *pp;
+			if (n->handle == handle) {
+				*pp = n->link;
+				_remove_name(s, n);
+			} else {
+				pp = &n->link;
 			}
-			++j;
 		}
-		s->name_count = j;
 	} else {
 		ctx = NULL;
 	}
@@ -134,14 +309,20 @@ skynet_handle_retireall() {
 	for (;;) {
 		int n=0;
 		int i;
-		/* 遍历整个插槽并卸载其中的服务, 计数器 n 表示卸载成功的服务数 */
-		for (i=0;i<s->slot_size;i++) {
-			rwlock_rlock(&s->lock);
-			struct skynet_context * ctx = s->slot[i];
+		/* 插槽数组可能在扩容之后被延迟释放, 只能在 epoch 之内读取, 所以先取得插槽大小的快照 */
+		struct epoch_record *r = epoch_enter(s);
+		int size = ATOM_LOAD(&s->slot)->size;
+		epoch_leave(r);
+		/* 遍历整个插槽并卸载其中的服务, 计数器 n 表示卸载成功的服务数. 每次都在 epoch 之内重新读取插槽及其大小 */
+		for (i=0;i<size;i++) {
+			r = epoch_enter(s);
+			struct handle_slot *slot = ATOM_LOAD(&s->slot);
+			size = slot->size;
+			struct skynet_context * ctx = i < size ? ATOM_LOAD(&slot->ctx[i]) : NULL;
 			uint32_t handle = 0;
 			if (ctx)
 				handle = skynet_context_handle(ctx);
-			rwlock_runlock(&s->lock);
+			epoch_leave(r);
 			if (handle != 0) {
 				if (skynet_handle_retire(handle)) {
 					++n;
@@ -155,7 +336,8 @@ skynet_handle_retireall() {
 }
 
 /* 由服务地址获取到服务对象, 并对服务的引用计数加 1 . 如果存在相应的服务则返回服务对象,
- * 否则将返回 NULL.
+ * 否则将返回 NULL. 查找是无锁的, 只有一次插槽读取和一次引用计数的原子操作, 不会被注册、卸载服务或者插槽扩容阻塞.
+ * 读到的服务可能正在被销毁(引用计数已经为 0 ), 此时视为服务不存在.
  *
  * 参数: handle 是服务地址
  * 返回: 查找到并引用计数加 1 的服务或者 NULL */
@@ -164,21 +346,101 @@ skynet_handle_grab(uint32_t handle) {
 	struct handle_storage *s = H;
 	struct skynet_context * result = NULL;
 
-	rwlock_rlock(&s->lock);
+	struct epoch_record *r = epoch_enter(s);
 
 	/* 将服务地址与插槽容量的位与值作为哈希值 */
-	uint32_t hash = handle & (s->slot_size-1);
-	struct skynet_context * ctx = s->slot[hash];
-	if (ctx && skynet_context_handle(ctx) == handle) {
+	struct handle_slot *slot = ATOM_LOAD(&s->slot);
+	struct skynet_context * ctx = ATOM_LOAD(&slot->ctx[handle & (slot->size-1)]);
+	if (ctx && skynet_context_handle(ctx) == handle && skynet_context_trygrab(ctx)) {
 		result = ctx;
-		skynet_context_grab(result);
 	}
 
-	rwlock_runlock(&s->lock);
+	epoch_leave(r);
 
 	return result;
 }
 
+/* 计算名字的哈希值 */
+static inline uint32_t
+name_hash(const char *name) {
+	uint32_t h = 2166136261u;
+	const unsigned char *p = (const unsigned char *)name;
+	while (*p) {
+		h = (h ^ *p++) * 16777619u;
+	}
+	return h;
+}
+
+/* 分配有 size 个空桶的哈希表 */
+static void
+name_table_init(struct name_table *t, int size) {
+	t->size = size;
+	t->count = 0;
+	t->bucket = skynet_malloc(size * sizeof(struct handle_name *));
+	memset(t->bucket, 0, size * sizeof(struct handle_name *));
+}
+
+/* 渐进式扩容: 将 name[0] 中至多 NAME_REHASH_STEP 个非空桶迁移到 name[1] 中, 全部迁移完毕后以 name[1] 替换 name[0] .
+ * 每次插入或者删除名字时调用, 因而扩容的开销被分摊到之后的修改上, 不会在某一次命名时停顿. 必须持有写锁. */
+static void
+name_rehash(struct handle_storage *s) {
+	if (s->rehash < 0) {
+		return;
+	}
+	struct name_table *from = &s->name[0];
+	struct name_table *to = &s->name[1];
+	int step = NAME_REHASH_STEP;
+	int empty = NAME_REHASH_STEP * 10;	/* 限制每次访问的空桶数量 */
+	while (step > 0 && empty > 0 && s->rehash < from->size) {
+		struct handle_name *n = from->bucket[s->rehash];
+		if (n == NULL) {
+			--empty;
+		} else {
+			while (n) {
+				struct handle_name *next = n->next;
+				int b = n->hash & (to->size - 1);
+				n->next = to->bucket[b];
+				to->bucket[b] = n;
+				--from->count;
+				++to->count;
+				n = next;
+			}
+			from->bucket[s->rehash] = NULL;
+			--step;
+		}
+		++s->rehash;
+	}
+	if (s->rehash == from->size) {
+		assert(from->count == 0);
+		skynet_free(from->bucket);
+		*from = *to;
+		to->size = 0;
+		to->count = 0;
+		to->bucket = NULL;
+		s->rehash = -1;
+	}
+}
+
+/* 在名字哈希表中查找名字, 扩容期间名字可能在两个表中的任意一个. 必须持有读锁或者写锁 */
+static struct handle_name *
+name_lookup(struct handle_storage *s, const char *name, uint32_t hash) {
+	int i;
+	for (i=0;i<2;i++) {
+		struct name_table *t = &s->name[i];
+		if (t->size == 0) {
+			break;
+		}
+		struct handle_name *n = t->bucket[hash & (t->size - 1)];
+		while (n) {
+			if (n->hash == hash && strcmp(n->name, name) == 0) {
+				return n;
+			}
+			n = n->next;
+		}
+	}
+	return NULL;
+}
+
 /* 在服务句柄存储中查找名字为 name 的服务的地址. 如果查到则返回服务地址, 查不到则返回 0 .
  * 此函数是线程安全的.
  *
@@ -187,26 +449,14 @@ skynet_handle_grab(uint32_t handle) {
 uint32_t 
 skynet_handle_findname(const char * name) {
 	struct handle_storage *s = H;
+	uint32_t hash = name_hash(name);
 
 	rwlock_rlock(&s->lock);
 
 	uint32_t handle = 0;
-
-	int begin = 0;
-	int end = s->name_count - 1;
-	while (begin<=end) {
-		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);
-		if (c==0) {
-			handle = n->handle;
-			break;
-		}
-		if (c<0) {
-			begin = mid + 1;
-		} else {
-			end = mid - 1;
-		}
+	struct handle_name *n = name_lookup(s, name, hash);
+	if (n) {
+		handle = n->handle;
 	}
 
 	rwlock_runlock(&s->lock);
@@ -214,68 +464,72 @@ skynet_handle_findname(const char * name) {
 	return handle;
 }
 
-/* 将服务名字 name 以及相关联的服务地址 handle 插入到服务句柄存储的名字数组中索引为 before 的位置,
- * 并将其后的所有名字后移. 以此得到一个按字典排序的名字数组. 如果名字数组的容量不够时, 将扩展数组.
- *
- * 参数: s 是服务句柄存储, name 是待插入的名字, handle 是与名字相关联的服务地址, before 是待插入的索引
- * 此函数无返回值 */
+/* 从名字哈希表中删除名字 n 并释放它, 调用者负责将它从插槽的名字链表中摘除. 删除名字会使所有服务的名字缓存失效.
+ * 必须持有写锁. */
 static void
-_insert_name_before(struct handle_storage *s, char *name, uint32_t handle, int before) {
-	if (s->name_count >= s->name_cap) {
-		s->name_cap *= 2;
-		assert(s->name_cap <= MAX_SLOT_SIZE);
-		struct handle_name * n = skynet_malloc(s->name_cap * sizeof(struct handle_name));
-		/* 将名字放到新的数组中去, 索引 before 的元素会被腾出来, 其后的元素会被后移. */
-		int i;
-		for (i=0;i<before;i++) {
-			n[i] = s->name[i];
+_remove_name(struct handle_storage *s, struct handle_name *n) {
+	int i;
+	for (i=0;i<2;i++) {
+		struct name_table *t = &s->name[i];
+		if (t->size == 0) {
+			break;
 		}
-		for (i=before;i<s->name_count;i++) {
-			n[i+1] = s->name[i];
+		struct handle_name **pp = &t->bucket[n->hash & (t->size - 1)];
+		while (*pp && *pp != n) {
+			pp = &(*pp)->next;
 		}
-		skynet_free(s->name);
-		s->name = n;
-	} else {
-		/* 直接后移其后的元素, 使得索引为 before 的元素被腾出来 */
-		int i;
-		for (i=s->name_count;i>before;i--) {
-			s->name[i] = s->name[i-1];
+		if (*pp) {
+			*pp = n->next;
+			--t->count;
+			break;
 		}
 	}
-	s->name[before].name = name;
-	s->name[before].handle = handle;
-	s->name_count ++;
+	assert(i < 2);
+	ATOM_INC(&s->name_version);
+	skynet_free(n->name);
+	skynet_free(n);
+	name_rehash(s);
 }
 
-/* 将名字 name 及其相关联的服务地址 handle 插入到服务句柄存储的名字数组中去. 函数首先
- * 会查找名字是否已经存在于名字数组中, 如果是则返回 NULL, 否则执行插入并返回名字数组中的名字指针.
- * 由于名字数组中的名字在堆内存中, 因而返回的名字指针可以传递到任意地方.
+/* 将名字 name 及其相关联的服务地址 handle 插入到服务句柄存储的名字哈希表中去. 函数首先
+ * 会查找名字是否已经存在, 如果是则返回 NULL, 否则执行插入并返回哈希表中的名字指针.
+ * 由于名字在堆内存中, 因而返回的名字指针可以传递到任意地方. 名字的数量达到桶的数量时开始渐进式扩容.
  *
  * 参数: s 是服务句柄存储, name 是待插入的名字, handle 是与名字相关联的服务地址
  * 返回: 服务的名字指针或者名字已经存在时返回 NULL */
 static const char *
 _insert_name(struct handle_storage *s, const char * name, uint32_t handle) {
-	int begin = 0;
-	int end = s->name_count - 1;
-	while (begin<=end) {
-		int mid = (begin+end)/2;
-		struct handle_name *n = &s->name[mid];
-		int c = strcmp(n->name, name);
-		if (c==0) {
-			return NULL;
-		}
-		if (c<0) {
-			begin = mid + 1;
-		} else {
-			end = mid - 1;
-		}
+	uint32_t hash = name_hash(name);
+	if (name_lookup(s, name, hash)) {
+		return NULL;
 	}
-	/* 名字被复制到堆内存中 */
-	char * result = skynet_strdup(name);
+	name_rehash(s);
 
-	_insert_name_before(s, result, handle, begin);
+	/* 名字被复制到堆内存中 */
+	struct handle_name *n = skynet_malloc(sizeof(*n));
+	n->name = skynet_strdup(name);
+	n->handle = handle;
+	n->hash = hash;
+
+	struct name_table *t = &s->name[s->rehash < 0 ? 0 : 1];
+	int b = hash & (t->size - 1);
+	n->next = t->bucket[b];
+	t->bucket[b] = n;
+	++t->count;
+
+	/* 串入服务所在插槽的名字链表, 即使这个地址的服务并不存在 */
+	struct handle_slot *slot = s->slot;
+	int i = handle & (slot->size - 1);
+	n->link = slot->name[i];
+	slot->name[i] = n;
+
+	if (s->rehash < 0 && s->name[0].count >= s->name[0].size) {
+		assert(s->name[0].size * 2 <= MAX_SLOT_SIZE);
+		name_table_init(&s->name[1], s->name[0].size * 2);
+		s->rehash = 0;
+	}
 
-	return result;
+	return n->name;
 }
 
 /* 将服务地址 handle 所表示的服务命名为 name. 此函数是线程安全的.
@@ -292,28 +546,92 @@ skynet_handle_namehandle(uint32_t handle, const char *name) {
 	return ret;
 }
 
-/* 对服务句柄模块进行初始化, 分配服务插槽和名字数组, 初始化读写锁以及将 harbor 值移动到最高 8 位.
+/* 创建一个服务私有的名字缓存, 没有开启名字缓存时返回 NULL */
+struct handle_namecache *
+skynet_handle_namecache_new(void) {
+	int n = H->namecache;
+	if (n <= 0) {
+		return NULL;
+	}
+	struct handle_namecache *c = skynet_malloc(sizeof(*c) + (n - 1) * sizeof(struct namecache_entry));
+	memset(c, 0, sizeof(*c) + (n - 1) * sizeof(struct namecache_entry));
+	c->mask = n - 1;
+	return c;
+}
+
+/* 释放名字缓存 */
+void
+skynet_handle_namecache_delete(struct handle_namecache *c) {
+	skynet_free(c);
+}
+
+/* 与 skynet_handle_findname 相同, 但先查找服务私有的名字缓存 c , 命中时不需要加锁. 只能被 c 所属的服务调用.
+ * 名字在服务存在期间不会改变所指的地址, 因而只有删除名字时需要让缓存失效: 先读取版本号再查找,
+ * 查找期间发生的删除会令这次缓存的结果在下一次使用前失效. 查不到的名字不会被缓存. */
+uint32_t
+skynet_handle_findname_cache(struct handle_namecache *c, const char * name) {
+	struct handle_storage *s = H;
+	uint32_t hash = name_hash(name);
+	struct namecache_entry *e = &c->entry[hash & c->mask];
+	unsigned version = ATOM_LOAD(&s->name_version);
+	if (e->handle && e->version == version && strcmp(e->name, name) == 0) {
+		return e->handle;
+	}
+
+	rwlock_rlock(&s->lock);
+
+	uint32_t handle = 0;
+	struct handle_name *n = name_lookup(s, name, hash);
+	if (n) {
+		handle = n->handle;
+	}
+
+	rwlock_runlock(&s->lock);
+
+	size_t sz = strlen(name);
+	if (handle && sz < NAMECACHE_LENGTH) {
+		memcpy(e->name, name, sz + 1);
+		e->handle = handle;
+		e->version = version;
+	}
+	return handle;
+}
+
+/* 对服务句柄模块进行初始化, 分配服务插槽和名字哈希表, 初始化读写锁以及将 harbor 值移动到最高 8 位.
  * 给句柄存储器分配的内存最终不会被回收, 而是随着进程结束而回收.
  *
- * 参数: harbor 为当前节点的 id, 要求值的范围在 255 以内
+ * 参数: harbor 为当前节点的 id, 要求值的范围在 255 以内, namecache 为每个服务的名字缓存的项数, 向上取整为 2 的幂, 0 表示不使用
  * 此函数无返回值. */
 void 
-skynet_handle_init(int harbor) {
+skynet_handle_init(int harbor, int namecache) {
 	assert(H==NULL);
 	struct handle_storage * s = skynet_malloc(sizeof(*H));
-	s->slot_size = DEFAULT_SLOT_SIZE;
-	s->slot = skynet_malloc(s->slot_size * sizeof(struct skynet_context *));
-	memset(s->slot, 0, s->slot_size * sizeof(struct skynet_context *));
+	s->slot = slot_new(DEFAULT_SLOT_SIZE);
 
 	rwlock_init(&s->lock);
+	s->epoch = 0;
+	s->record = NULL;
+	pthread_key_create(&s->record_key, epoch_release);
+	spinlock_init(&s->lock_garbage);
+	s->garbage = NULL;
 	// reserve 0 for system
 	s->harbor = (uint32_t) (harbor & 0xff) << HANDLE_REMOTE_SHIFT;
 
 	/* 服务地址分配的起点是 1 , 0 被保留到系统内部 */
 	s->handle_index = 1;
-	s->name_cap = 2;
-	s->name_count = 0;
-	s->name = skynet_malloc(s->name_cap * sizeof(struct handle_name));
+	name_table_init(&s->name[0], DEFAULT_NAME_SIZE);
+	s->name[1].size = 0;
+	s->name[1].count = 0;
+	s->name[1].bucket = NULL;
+	s->rehash = -1;
+	s->name_version = 0;
+	s->namecache = 0;
+	if (namecache > 0) {
+		s->namecache = 1;
+		while (s->namecache < namecache) {
+			s->namecache *= 2;
+		}
+	}
 
 	H = s;
 
@@ -8,15 +8,21 @@
 #define HANDLE_REMOTE_SHIFT 24
 
 struct skynet_context;
+struct handle_namecache;
 
 uint32_t skynet_handle_register(struct skynet_context *);
 int skynet_handle_retire(uint32_t handle);
 struct skynet_context * skynet_handle_grab(uint32_t handle);
 void skynet_handle_retireall();
+void skynet_handle_defer(void *ptr);	// free ptr after all concurrent lookups are done
 
 uint32_t skynet_handle_findname(const char * name);
 const char * skynet_handle_namehandle(uint32_t handle, const char *name);
 
-void skynet_handle_init(int harbor);
+struct handle_namecache * skynet_handle_namecache_new(void);	// NULL when the name cache is disabled
+void skynet_handle_namecache_delete(struct handle_namecache *);
+uint32_t skynet_handle_findname_cache(struct handle_namecache *, const char * name);
+
+void skynet_handle_init(int harbor, int namecache);
 
 #endif
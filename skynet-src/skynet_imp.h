@@ -4,12 +4,24 @@
 /* skynet 启动配置参数 */
 struct skynet_config {
 	int thread;                     /* 工作线程的数量 (默认为 8) */
+	int exclusive;                  /* 可被服务独占的专用工作线程的数量 (默认为 0) */
 	int harbor;                     /* harbor id (默认为 1) */
 	const char * daemon;            /* 守护进程 pid 文件名 */
 	const char * module_path;       /* C 服务的路径 (默认为 ./cservice/?.so) */
 	const char * bootstrap;         /* 启动整个 skynet 系统的入口服务 (默认为 snlua bootstrap) */
 	const char * logger;            /* 日志文件的路径, nil 表示标准输出 */
 	const char * logservice;        /* 日志服务 (默认为 logger) */
+	const char * dispatch;          /* 工作线程分发消息的策略, static 或者 adaptive (默认为 static) */
+	const char * cpu_worker;        /* 工作线程绑定的 cpu 列表, 如 "2-7,10", 每条工作线程轮流绑定其中一个 */
+	const char * cpu_socket;        /* socket 线程绑定的 cpu 列表 */
+	const char * cpu_timer;         /* 定时线程绑定的 cpu 列表 */
+	const char * cpu_monitor;       /* 监控线程绑定的 cpu 列表 */
+	int trace;                      /* 每条工作线程的分发跟踪环形缓冲区的记录数量 (默认为 4096), 0 表示关闭 */
+	int numa;                       /* 是否将工作线程及其运行队列自动分布到各个 numa 节点 (默认为 false) */
+	int namecache;                  /* 每个服务以 .name 发送消息时使用的名字缓存的项数 (默认为 0 , 不使用) */
+	int timer_tick;                 /* 定时器的精度, 单位毫秒, 可选 1 或 10 (默认为 10) */
+	int timer_coalesce;             /* 是否将同一滴答内到期的属于同一服务的定时器合并为一条消息 (默认为 false) */
+	int socket_thread;              /* socket 线程的数量, 套接字以 id 的哈希值分配给各条线程 (默认为 1) */
 };
 
 /* 线程的类别, 作为线程初始化的参数, 它们的负值将被转为 unit32 整数并与服务句柄一样设置在线程特定数据中,
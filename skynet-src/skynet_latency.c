@@ -0,0 +1,68 @@
+#include "skynet_latency.h"
+
+#include <string.h>
+
+/* 获取 ns 所在的桶的编号 */
+static inline int
+bucket_index(uint64_t ns) {
+	uint64_t v = ns >> LATENCY_UNIT_BITS;
+	if (v < LATENCY_SUB) {
+		return (int)v;
+	}
+	int e = 63 - __builtin_clzll(v);
+	int index = (e - LATENCY_SUB_BITS + 1) * LATENCY_SUB + (int)((v >> (e - LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+	return index < LATENCY_BUCKETS ? index : LATENCY_BUCKETS - 1;
+}
+
+/* 获取编号为 index 的桶的下界, 单位纳秒 */
+static inline uint64_t
+bucket_lower(int index) {
+	uint64_t octave = index / LATENCY_SUB;
+	uint64_t sub = index % LATENCY_SUB;
+	if (octave == 0) {
+		return sub << LATENCY_UNIT_BITS;
+	}
+	return ((LATENCY_SUB + sub) << (octave - 1)) << LATENCY_UNIT_BITS;
+}
+
+/* 清空直方图 */
+void
+skynet_latency_reset(struct skynet_latency *h) {
+	memset(h, 0, sizeof(*h));
+}
+
+/* 记录一次耗时, 单位纳秒. 只是几次整数运算, 可以在每条消息的分发路径上调用. */
+void
+skynet_latency_record(struct skynet_latency *h, uint64_t ns) {
+	++ h->count;
+	h->sum += ns;
+	if (ns > h->max) {
+		h->max = ns;
+	}
+	++ h->bucket[bucket_index(ns)];
+}
+
+/* 获取第 p 百分位的耗时, 返回其所在的桶的上界(不超过记录到的最大值), 没有记录时返回 0 .
+ * 读取时不加锁, 与写入并发时得到的是近似值. */
+uint64_t
+skynet_latency_percentile(struct skynet_latency *h, double p) {
+	uint64_t count = h->count;
+	uint64_t max = h->max;
+	if (count == 0) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t)(count * p / 100.0 + 0.5);
+	if (rank == 0) {
+		rank = 1;
+	}
+	uint64_t sum = 0;
+	int i;
+	for (i=0;i<LATENCY_BUCKETS - 1;i++) {
+		sum += h->bucket[i];
+		if (sum >= rank) {
+			uint64_t upper = bucket_lower(i+1) - 1;
+			return upper < max ? upper : max;
+		}
+	}
+	return max;
+}
@@ -0,0 +1,25 @@
+#ifndef SKYNET_LATENCY_H
+#define SKYNET_LATENCY_H
+
+#include <stdint.h>
+
+/* 对数线性的直方图, 与 HdrHistogram 类似: 每个 2 的幂次区间再等分为 LATENCY_SUB 个桶, 相对误差不超过 1/LATENCY_SUB .
+ * 以纳秒为单位记录, 小于 2^LATENCY_UNIT_BITS 纳秒的值落在最前面的桶中, 超出范围的值落在最后一个桶中. */
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_UNIT_BITS 6
+#define LATENCY_BUCKETS (32 * LATENCY_SUB)
+
+/* 一个耗时直方图, 只由一条线程(正在分发服务的工作线程)写入, 其它线程可以不加锁地读取近似值 */
+struct skynet_latency {
+	uint64_t count;                      /* 记录的次数 */
+	uint64_t sum;                        /* 总耗时 */
+	uint64_t max;                        /* 最大耗时 */
+	uint32_t bucket[LATENCY_BUCKETS];    /* 每个桶中的次数 */
+};
+
+void skynet_latency_reset(struct skynet_latency *h);
+void skynet_latency_record(struct skynet_latency *h, uint64_t ns);
+uint64_t skynet_latency_percentile(struct skynet_latency *h, double p);	// p in [0, 100], return the upper bound in ns
+
+#endif
@@ -28,7 +28,8 @@ optint(const char *key, int opt) {
 	return strtol(str, NULL, 10);
 }
 
-/*
+/* 从 skynet 中取出名为 key 的布尔型环境变量, 如果不存在则设置其为默认值, 并返回此默认值.
+ * 参数 opt 为默认值 */
 static int
 optboolean(const char *key, int opt) {
 	const char * str = skynet_getenv(key);
@@ -38,7 +39,6 @@ optboolean(const char *key, int opt) {
 	}
 	return strcmp(str,"true")==0;
 }
-*/
 
 /* 从 skynet 中获取名为 key 的字符串环境变量, 如果不存在则设置其位默认值, 并返回此默认值.
  * 参数 opt 是默认值, 为 NULL 时将不设置默认值. */
@@ -145,12 +145,24 @@ main(int argc, char *argv[]) {
 	_init_env(L);
 
 	config.thread =  optint("thread",8);
+	config.exclusive = optint("exclusive",0);
 	config.module_path = optstring("cpath","./cservice/?.so");
 	config.harbor = optint("harbor", 1);
 	config.bootstrap = optstring("bootstrap","snlua bootstrap");
 	config.daemon = optstring("daemon", NULL);
 	config.logger = optstring("logger", NULL);
 	config.logservice = optstring("logservice", "logger");
+	config.dispatch = optstring("dispatch", "static");
+	config.cpu_worker = optstring("cpu_worker", NULL);
+	config.cpu_socket = optstring("cpu_socket", NULL);
+	config.cpu_timer = optstring("cpu_timer", NULL);
+	config.cpu_monitor = optstring("cpu_monitor", NULL);
+	config.numa = optboolean("numa", 0);
+	config.trace = optint("trace", 4096);
+	config.namecache = optint("namecache", 0);
+	config.timer_tick = optint("timer_tick", 10);
+	config.timer_coalesce = optboolean("timer_coalesce", 0);
+	config.socket_thread = optint("socket_thread", 1);
 
 	lua_close(L);
 
@@ -2,16 +2,21 @@
 #include "skynet_mq.h"
 #include "skynet_handle.h"
 #include "spinlock.h"
+#include "atomic.h"
+#include "skynet_affinity.h"
+#include "skynet_park.h"
+#include "skynet_timer.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 /* 默认队列大小为2的倍数, 对长度取模更加高效 */
 #define DEFAULT_QUEUE_SIZE 64
-#define MAX_GLOBAL_MQ 0x10000
 
 // 0 means mq is not in global mq.
 // 1 means mq is in global mq , or the message is dispatching.
@@ -19,6 +24,10 @@
 #define MQ_IN_GLOBAL 1
 #define MQ_OVERLOAD 1024
 
+/* 默认使用无锁的多生产者单消费者队列, 定义 USE_RING_MQ 时退回到以自旋锁保护的可扩容数组环绕表 */
+
+#ifdef USE_RING_MQ
+
 /* 单个服务拥有的消息队列, 在系统中作为全局队列的元素, 实现为数组环绕表 */
 struct message_queue {
 	struct spinlock lock;             /* 队列锁, 在多线程下消息入队和出队时同步使用 */
@@ -30,24 +39,86 @@ struct message_queue {
 	int in_global;                    /* 是否在全局队列中 */
 	int overload;                     /* 当过载时显示过载量 */
 	int overload_threshold;           /* 消息过载阈值 */
+	int limit;                        /* 受上限约束的消息推入时队列长度的上限, 0 表示不限制 */
+	int policy;                       /* 超出上限时的策略, 参见 MQ_LIMIT_* */
 	struct skynet_message *queue;     /* 此队列拥有的二级消息队列, 内存是预先分配的 */
 	struct message_queue *next;       /* 此队列在全局队列中的下一个元素, 若没有为 NULL */
+	int exclusive;                    /* 独占的专用工作线程的运行队列编号, 没有时为 -1 */
+};
+
+#else
+
+/* 消息队列中的节点, 无锁模式下每条消息占据一个节点, 节点以单向链表的形式串起来.
+ * 由 skynet_mq_alloc 分配的消息内容在末尾自带一个节点, 入列时不需要再分配内存; 其它消息的节点取自节点池. */
+struct message_node {
+	struct message_node * volatile next;  /* 链表中的下一个节点, 由生产者在入列完成时设置 */
+	struct skynet_message message;        /* 节点携带的消息 */
+	int inplace;                          /* 节点是否位于消息内容的内存块中, 是则随消息内容一起释放, 否则出列时回收 */
 };
 
-/* 系统的全局队列, 整个系统只有一条, 实现为单向链表 */
+/* 消息内容中节点的偏移, 内容之后保留一个字节用于字符串结尾的 \0 , 再按指针大小对齐 */
+#define MQ_INPLACE_OFFSET(sz) (((sz) + sizeof(void *)) & ~(sizeof(void *) - 1))
+
+/* 节点池在线程缓存与全局仓库之间每次转移的节点数量 */
+#define NODE_BATCH 64
+/* 全局仓库最多保存的批数, 再多的空闲节点直接释放 */
+#define NODE_DEPOT 64
+
+/* mq_take 的返回值 */
+#define MQ_TAKE_OK 0         /* 取到了一条消息 */
+#define MQ_TAKE_EMPTY 1      /* 队列为空 */
+#define MQ_TAKE_PENDING 2    /* 有生产者已经交换了 tail 但还没有完成链接, 它的消息暂时取不到 */
+
+/* 单个服务拥有的消息队列, 在系统中作为全局队列的元素. 实现为多生产者单消费者的无锁侵入式链表队列,
+ * 队列取空时由内嵌的哑节点 stub 保持链表非空. 生产者仅以原子交换 tail 的方式入列, 彼此之间以及与消费者之间
+ * 都不会自旋等待; 消费者只有正在分发此队列的那条工作线程, 因而 head 不需要同步. 出列的节点不再被队列引用,
+ * 所以位于消息内容中的节点可以随消息一起交给服务. */
+struct message_queue {
+	struct message_node *head;        /* 队列的首节点, 仅由消费者访问, 可能是哑节点 */
+	uint32_t handle;                  /* 当前队列所属的服务的 handle */
+	int release;                      /* 是否被标记为需要销毁 */
+	int in_global;                    /* 是否在全局队列中, 以原子比较交换的方式修改 */
+	int length;                       /* 队列的长度, 以原子方式增减, 生产者先增加计数再入列 */
+	int overload;                     /* 当过载时显示过载量 */
+	int overload_threshold;           /* 消息过载阈值 */
+	int limit;                        /* 受上限约束的消息推入时队列长度的上限, 0 表示不限制 */
+	int policy;                       /* 超出上限时的策略, 参见 MQ_LIMIT_* */
+	struct message_queue *next;       /* 此队列在全局队列中的下一个元素, 若没有为 NULL */
+	int exclusive;                    /* 独占的专用工作线程的运行队列编号, 没有时为 -1 */
+	struct message_node * volatile tail; /* 队列的尾节点, 生产者以原子交换的方式竞争 */
+	struct message_node stub;         /* 哑节点 */
+};
+
+#endif
+
+/* 系统的全局队列被拆分为每条工作线程一个的运行队列, 每个运行队列实现为单向链表.
+ * 工作线程优先处理自己的运行队列, 为空时再随机地从别的运行队列中窃取.
+ * 排在共享工作线程之后的是专用工作线程的运行队列, 其中只有独占此线程的那个服务的队列, 不会被窃取. */
 struct global_queue {
 	struct message_queue *head;       /* 头结点, 初始时为 NULL */
 	struct message_queue *tail;       /* 尾节点, 初始时为 NULL */
-	struct spinlock lock;             /* 全局队列锁, 当服务的消息队列入列和出列时同步使用 */
+	struct spinlock lock;             /* 运行队列锁, 当服务的消息队列入列和出列时同步使用 */
+	int length;                       /* 运行队列的近似长度, 窃取时不加锁读取以跳过空队列 */
+	uint32_t seed;                    /* 选择窃取目标的随机数种子, 仅由所属的工作线程修改 */
 };
 
-static struct global_queue *Q = NULL;
-
-/* 将二级队列入列到全局队列中, 此函数是线程安全的 */
-void 
-skynet_globalmq_push(struct message_queue * queue) {
-	struct global_queue *q= Q;
+/* 每条运行队列独占一个内存页, 既避免相邻的运行队列处于同一缓存行, 也便于迁移到工作线程所在的 numa 节点 */
+static struct global_queue **Q = NULL;
+static int QN = 0;                    /* 共享工作线程的运行队列的数量, 与共享工作线程数量相同 */
+static int QX = 0;                    /* 专用工作线程的数量, 其运行队列的编号从 QN 开始 */
+static struct message_queue * volatile * QOWNER = NULL;	/* 每条专用工作线程被哪个服务的队列独占, 空闲时为 NULL */
+static int QRR = 0;                   /* 非工作线程推入时轮流选择运行队列的计数器 */
+static pthread_key_t Q_KEY;           /* 保存当前工作线程所属运行队列编号(加 1)的线程特定数据键 */
+
+/* 获取当前线程所绑定的运行队列编号, 非工作线程返回 -1 */
+static inline int
+local_id() {
+	return (int)(intptr_t)pthread_getspecific(Q_KEY) - 1;
+}
 
+/* 将二级队列推入到一条运行队列的尾部 */
+static void
+queue_push(struct global_queue *q, struct message_queue * queue) {
 	/* 在加自旋锁的情况下进行入列, 如果原先没有元素, 则头尾节点指向同一节点 */
 	SPIN_LOCK(q)
 	assert(queue->next == NULL);
@@ -57,16 +128,16 @@ skynet_globalmq_push(struct message_queue * queue) {
 	} else {
 		q->head = q->tail = queue;
 	}
+	++q->length;
 	SPIN_UNLOCK(q)
 }
 
-/* 将二级队列从全局队列中出队, 如果没有元素了就返回 NULL, 否则返回第一个元素,
- * 出列之后并未改变元素的 in_global 字段, 之所以这样做的原因参见 skynet_mq_pop 函数.
- * 此函数是线程安全的 */
-struct message_queue * 
-skynet_globalmq_pop() {
-	struct global_queue *q = Q;
-
+/* 从一条运行队列的头部取出二级队列, 为空时返回 NULL */
+static struct message_queue *
+queue_pop(struct global_queue *q) {
+	if (q->length == 0) {
+		return NULL;
+	}
 	/* 在自旋锁的情况下进行出列, 处理最后一个元素是将 head 和 tail 都重置为 NULL */
 	SPIN_LOCK(q)
 	struct message_queue *mq = q->head;
@@ -77,12 +148,153 @@ skynet_globalmq_pop() {
 			q->tail = NULL;
 		}
 		mq->next = NULL;
+		--q->length;
 	}
 	SPIN_UNLOCK(q)
 
 	return mq;
 }
 
+/* 将二级队列入列到全局队列中并唤醒一条停放的工作线程, 此函数是线程安全的. 独占专用线程的队列推入专用线程的运行队列,
+ * 并且只唤醒那条线程. 共享工作线程推入自己的运行队列, 使得刚变为非空的队列仍由当前线程处理以保持缓存亲和;
+ * 其它线程(socket, 定时器, 专用线程等)则轮流推入各个共享的运行队列. */
+void 
+skynet_globalmq_push(struct message_queue * queue) {
+	int exclusive = queue->exclusive;
+	if (exclusive >= 0) {
+		queue_push(Q[exclusive], queue);
+		skynet_unpark_thread(exclusive);
+		return;
+	}
+	int id = local_id();
+	struct global_queue *q;
+	if (id >= 0 && id < QN) {
+		q = Q[id];
+	} else {
+		q = Q[(unsigned)ATOM_FINC(&QRR) % QN];
+	}
+	queue_push(q, queue);
+	skynet_unpark();
+}
+
+/* 工作线程把正在分发的队列推回全局队列. 队列可以由当前线程继续持有时推入它自己的运行队列, 它稍后会自己取回,
+ * 所以不唤醒停放的线程, 也省去了唤醒之前的内存屏障. 否则(队列独占了别的专用线程)与 skynet_globalmq_push 相同. */
+void
+skynet_globalmq_requeue(struct message_queue * queue) {
+	int id = local_id();
+	if (id >= 0 && skynet_globalmq_owned(queue)) {
+		queue_push(Q[id], queue);
+		return;
+	}
+	skynet_globalmq_push(queue);
+}
+
+/* 将二级队列从全局队列中出队, 如果没有元素了就返回 NULL, 否则返回第一个元素,
+ * 出列之后并未改变元素的 in_global 字段, 之所以这样做的原因参见 skynet_mq_pop 函数.
+ * 先从当前工作线程的运行队列中取, 为空时从随机位置开始依次尝试窃取其它共享的运行队列.
+ * 专用工作线程只从自己的运行队列中取. 此函数是线程安全的 */
+struct message_queue * 
+skynet_globalmq_pop() {
+	int id = local_id();
+	struct global_queue *q = NULL;
+	struct message_queue *mq;
+	int start = 0;
+	if (id >= QN) {
+		return queue_pop(Q[id]);
+	}
+	if (id >= 0) {
+		q = Q[id];
+		mq = queue_pop(q);
+		if (mq) {
+			return mq;
+		}
+		q->seed = q->seed * 1103515245 + 12345;
+		start = (q->seed >> 16) % QN;
+	}
+	int i;
+	for (i=0;i<QN;i++) {
+		struct global_queue *victim = Q[(start + i) % QN];
+		if (victim != q) {
+			mq = queue_pop(victim);
+			if (mq) {
+				return mq;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* 获取当前所有共享的运行队列中等待分发的二级队列的近似总数, 读取时不加锁. */
+int
+skynet_globalmq_length() {
+	int i;
+	int length = 0;
+	for (i=0;i<QN;i++) {
+		length += Q[i]->length;
+	}
+	return length;
+}
+
+/* 编号为 id 的工作线程是否有待分发的队列, 供停放之前检查. 共享工作线程检查所有共享的运行队列,
+ * 专用工作线程只检查自己的运行队列. 读取时不加锁. */
+int
+skynet_globalmq_ready(int id) {
+	if (id >= QN) {
+		return Q[id]->length > 0;
+	}
+	return skynet_globalmq_length() > 0;
+}
+
+/* 当前工作线程在分发完 queue 之后能否继续持有它. 独占专用线程的队列只能由那条专用线程持有,
+ * 其它队列只能由共享工作线程持有. 不能持有时需要推回全局队列, 由 skynet_globalmq_push 转交给正确的线程. */
+int
+skynet_globalmq_owned(struct message_queue *queue) {
+	int id = local_id();
+	if (queue->exclusive >= 0) {
+		return queue->exclusive == id;
+	}
+	return id < QN;
+}
+
+/* 让 queue 独占一条空闲的专用工作线程, 已经独占时直接返回原来的编号. 此后队列只推入那条线程的运行队列,
+ * 若队列此时正在共享的运行队列中或者正在被共享工作线程分发, 将在下一次分发结束时转交过去. 此函数是线程安全的.
+ * 返回专用线程的编号(从 0 开始), 没有空闲的专用线程时返回 -1 . */
+int
+skynet_mq_exclusive(struct message_queue *queue) {
+	if (queue->exclusive >= 0) {
+		return queue->exclusive - QN;
+	}
+	int i;
+	for (i=0;i<QX;i++) {
+		if (QOWNER[i] == NULL && ATOM_CAS_POINTER(&QOWNER[i], NULL, queue)) {
+			queue->exclusive = QN + i;
+			__sync_synchronize();
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* 队列销毁时释放它独占的专用工作线程, 使之可以分配给别的服务 */
+static inline void
+mq_unbind(struct message_queue *queue) {
+	if (queue->exclusive >= 0) {
+		QOWNER[queue->exclusive - QN] = NULL;
+	}
+}
+
+/* 将当前线程绑定为编号 id 的工作线程, 此后由它推入的队列将进入它自己的运行队列. 编号不小于共享工作线程数量的是专用工作线程.
+ * 若 node 不为 -1 , 运行队列所在的内存页将迁移到 numa 节点 node 上. 此函数应该在工作线程启动时调用. */
+void
+skynet_globalmq_bind(int id, int node) {
+	assert(id >= 0 && id < QN + QX);
+	skynet_affinity_migrate(Q[id], sizeof(struct global_queue), node);
+	Q[id]->seed = (uint32_t)id * 2654435761u + 1;
+	pthread_setspecific(Q_KEY, (void *)(intptr_t)(id+1));
+}
+
+#ifdef USE_RING_MQ
+
 /* 为一个服务创建消息队列, 队列创建时其 in_global 字段是 MQ_IN_GLOBAL 的,
  * 其原因在于队列创建的时期是服务刚创建出来而此时还没有初始化, 这样可以暂时不处理此时到来的消息 */
 struct message_queue * 
@@ -100,8 +312,11 @@ skynet_mq_create(uint32_t handle) {
 	q->release = 0;
 	q->overload = 0;
 	q->overload_threshold = MQ_OVERLOAD;
+	q->limit = 0;
+	q->policy = MQ_LIMIT_REJECT;
 	q->queue = skynet_malloc(sizeof(struct skynet_message) * q->cap);
 	q->next = NULL;
+	q->exclusive = -1;
 
 	return q;
 }
@@ -110,17 +325,12 @@ skynet_mq_create(uint32_t handle) {
 static void 
 _release(struct message_queue *q) {
 	assert(q->next == NULL);
+	mq_unbind(q);
 	SPIN_DESTROY(q)
 	skynet_free(q->queue);
 	skynet_free(q);
 }
 
-/* 获取此消息队列所属服务的 id */
-uint32_t 
-skynet_mq_handle(struct message_queue *q) {
-	return q->handle;
-}
-
 /* 获取当前时刻消息队列的长度. 此函数是线程安全的. */
 int
 skynet_mq_length(struct message_queue *q) {
@@ -138,17 +348,6 @@ skynet_mq_length(struct message_queue *q) {
 	return tail + cap - head;
 }
 
-/* 检查并重置队列的负载. 返回非负值表示当前负载, 返回 0 表示未超过负载. */
-int
-skynet_mq_overload(struct message_queue *q) {
-	if (q->overload) {
-		int overload = q->overload;
-		q->overload = 0;
-		return overload;
-	} 
-	return 0;
-}
-
 /* 从消息队列中取出一条消息。返回 0 时表示获取成功，并且消息被复制到 message 中,
  * 返回 1 时表示队列已经为空了, message 保持不变. 此函数是线程安全的. 有两点值得说明一下:
  * 第一是当超过负载阈值时将在此设置负载值, 当队列为空时负载阈值重新设置为默认阈值.
@@ -193,6 +392,44 @@ skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
 	return ret;
 }
 
+/* 从消息队列中一次取出至多 max 条消息复制到 message 数组中, 整个过程只加一次锁. 返回取出的消息数量,
+ * 返回 0 表示队列已经为空了, 此时与 skynet_mq_pop 一样会设置 in_global 为 0 . 负载的检查使用取出第一条消息后的长度,
+ * 与逐条取出时的结果相同. 此函数是线程安全的. */
+int
+skynet_mq_pop_batch(struct message_queue *q, struct skynet_message *message, int max) {
+	int n = 0;
+	SPIN_LOCK(q)
+
+	int length = q->tail - q->head;
+	if (length < 0) {
+		length += q->cap;
+	}
+	if (length == 0) {
+		// reset overload_threshold when queue is empty
+		q->overload_threshold = MQ_OVERLOAD;
+		q->in_global = 0;
+	} else {
+		n = length < max ? length : max;
+		int i;
+		for (i=0;i<n;i++) {
+			message[i] = q->queue[q->head];
+			if (++ q->head >= q->cap) {
+				q->head = 0;
+			}
+		}
+		/* 检查负载并且重新设置负载阈值 */
+		-- length;
+		while (length > q->overload_threshold) {
+			q->overload = length;
+			q->overload_threshold *= 2;
+		}
+	}
+
+	SPIN_UNLOCK(q)
+
+	return n;
+}
+
 /* 队列扩容, 扩展之后原先的元素被移动到数组的头部 */
 static void
 expand_queue(struct message_queue *q) {
@@ -217,6 +454,9 @@ skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
 	SPIN_LOCK(q)
 
 	q->queue[q->tail] = *message;
+#ifdef MESSAGE_LATENCY
+	q->queue[q->tail].stamp = skynet_hpc();
+#endif
 	
 	/* 自增 tail , 在超过容量大小时回绕, 如果又与 head 重叠将进行扩容 */
 	if (++ q->tail >= q->cap) {
@@ -227,23 +467,31 @@ skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
 		expand_queue(q);
 	}
 
+	int push = 0;
 	if (q->in_global == 0) {
 		q->in_global = MQ_IN_GLOBAL;
-		skynet_globalmq_push(q);
+		push = 1;
 	}
 	
 	SPIN_UNLOCK(q)
+
+	/* 队列进入全局队列, 同时会唤醒一条停放的工作线程来处理. in_global 已经设置, 不会有别的线程重复推入,
+	   所以可以在解锁之后进行, 避免持有队列锁时唤醒线程. */
+	if (push) {
+		skynet_globalmq_push(q);
+	}
 }
 
-/* 初始化全局队列,
- * 此函数只能在系统启动时调用一次. 私下觉得 skynet_globalmq_init 更合适 */
-void 
-skynet_mq_init() {
-	struct global_queue *q = skynet_malloc(sizeof(*q));
-	/* 初始化 head 和 tail 为 NULL, 并且初始化锁为未加锁状态. */
-	memset(q,0,sizeof(*q));
-	SPIN_INIT(q);
-	Q=q;
+/* 分配可以容纳 sz 字节消息内容的内存, 之后还保留一个字节. 环绕表的消息直接存放在数组中, 不需要节点. */
+void *
+skynet_mq_alloc(size_t sz) {
+	return skynet_malloc(sz + 1);
+}
+
+/* 向服务的消息队列中推入内容由 skynet_mq_alloc 分配的消息, 与 skynet_mq_push 相同 */
+void
+skynet_mq_push_inplace(struct message_queue *q, struct skynet_message *message) {
+	skynet_mq_push(q, message);
 }
 
 /* 标记消息队列为即将销毁, 每个队列只能调用此函数一次, 此函数是线程安全的.
@@ -253,10 +501,15 @@ skynet_mq_mark_release(struct message_queue *q) {
 	SPIN_LOCK(q)
 	assert(q->release == 0);
 	q->release = 1;
+	int push = 0;
 	if (q->in_global != MQ_IN_GLOBAL) {
-		skynet_globalmq_push(q);
+		q->in_global = MQ_IN_GLOBAL;
+		push = 1;
 	}
 	SPIN_UNLOCK(q)
+	if (push) {
+		skynet_globalmq_push(q);
+	}
 }
 
 /* 真正执行销毁队列, 先将队列中的所有消息以 drop_func 函数方式清理, 再回收队列的内存 */
@@ -281,7 +534,441 @@ skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
 		SPIN_UNLOCK(q)
 		_drop_queue(q, drop_func, ud);
 	} else {
-		skynet_globalmq_push(q);
 		SPIN_UNLOCK(q)
+		skynet_globalmq_push(q);
+	}
+}
+
+#else
+
+/* 为一个服务创建消息队列, 队列创建时其 in_global 字段是 MQ_IN_GLOBAL 的,
+ * 其原因在于队列创建的时期是服务刚创建出来而此时还没有初始化, 这样可以暂时不处理此时到来的消息 */
+struct message_queue * 
+skynet_mq_create(uint32_t handle) {
+	struct message_queue *q = skynet_malloc(sizeof(*q));
+	q->stub.next = NULL;
+	q->stub.inplace = 0;
+	q->handle = handle;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+	// When the queue is create (always between service create and service init) ,
+	// set in_global flag to avoid push it to global queue .
+	// If the service init success, skynet_context_new will call skynet_mq_push to push it to global queue.
+	q->in_global = MQ_IN_GLOBAL;
+	q->release = 0;
+	q->length = 0;
+	q->overload = 0;
+	q->overload_threshold = MQ_OVERLOAD;
+	q->limit = 0;
+	q->policy = MQ_LIMIT_REJECT;
+	q->next = NULL;
+	q->exclusive = -1;
+
+	return q;
+}
+
+/* 不在消息内容中的节点的池. 每条线程有一个节点缓存, 入列时从中取出节点, 出列时把节点放回消费者自己的缓存.
+ * 生产多于消费的线程(例如定时线程)缓存取空时从全局仓库取一批, 消费多于生产的线程缓存过多时存一批进去, 每批只加一次锁.
+ * 仓库满了之后多余的节点直接释放, 因而池中保留的空闲节点是有上限的. */
+struct node_cache {
+	struct message_node *head;        /* 缓存的空闲节点, 以 next 相连 */
+	int n;                            /* 缓存的节点数量 */
+};
+
+/* 全局仓库, 以 NODE_BATCH 个节点为一批存取. 每批节点以 next 相连, 批与批之间以首节点的 message.data 相连 */
+static struct {
+	struct spinlock lock;
+	struct message_node *batch;       /* 第一批的首节点 */
+	int count;                        /* 批数 */
+} DEPOT;
+
+static pthread_key_t NODE_KEY;        /* 保存当前线程的节点缓存的线程特定数据键 */
+
+/* 释放一串以 next 相连的节点 */
+static void
+node_release(struct message_node *node) {
+	while (node) {
+		struct message_node *next = node->next;
+		skynet_free(node);
+		node = next;
+	}
+}
+
+/* 线程退出时释放它的节点缓存 */
+static void
+node_cache_release(void *ud) {
+	struct node_cache *c = ud;
+	node_release(c->head);
+	skynet_free(c);
+}
+
+/* 获取当前线程的节点缓存, 第一次使用时创建 */
+static inline struct node_cache *
+node_cache() {
+	struct node_cache *c = pthread_getspecific(NODE_KEY);
+	if (c == NULL) {
+		c = skynet_malloc(sizeof(*c));
+		c->head = NULL;
+		c->n = 0;
+		pthread_setspecific(NODE_KEY, c);
+	}
+	return c;
+}
+
+/* 从当前线程的节点缓存中取出一个节点, 缓存为空时从全局仓库取一批, 仓库也为空时才分配内存 */
+static struct message_node *
+node_alloc() {
+	struct node_cache *c = node_cache();
+	struct message_node *node = c->head;
+	if (node == NULL) {
+		SPIN_LOCK(&DEPOT)
+		node = DEPOT.batch;
+		if (node) {
+			DEPOT.batch = node->message.data;
+			--DEPOT.count;
+		}
+		SPIN_UNLOCK(&DEPOT)
+		if (node == NULL) {
+			return skynet_malloc(sizeof(*node));
+		}
+		c->n = NODE_BATCH;
+	}
+	c->head = node->next;
+	--c->n;
+	return node;
+}
+
+/* 将出列的节点放回当前线程的节点缓存, 缓存超过两批时把一批存入全局仓库, 仓库满了则释放这一批 */
+static void
+node_free(struct message_node *node) {
+	struct node_cache *c = node_cache();
+	node->next = c->head;
+	c->head = node;
+	if (++c->n < NODE_BATCH * 2) {
+		return;
+	}
+	struct message_node *batch = c->head;
+	struct message_node *tail = batch;
+	int i;
+	for (i=1;i<NODE_BATCH;i++) {
+		tail = tail->next;
+	}
+	c->head = tail->next;
+	c->n -= NODE_BATCH;
+	tail->next = NULL;
+
+	SPIN_LOCK(&DEPOT)
+	if (DEPOT.count < NODE_DEPOT) {
+		batch->message.data = DEPOT.batch;
+		DEPOT.batch = batch;
+		++DEPOT.count;
+		batch = NULL;
+	}
+	SPIN_UNLOCK(&DEPOT)
+	node_release(batch);
+}
+
+/* 初始化节点池, 由 skynet_mq_init 调用 */
+static void
+node_init() {
+	SPIN_INIT(&DEPOT)
+	DEPOT.batch = NULL;
+	DEPOT.count = 0;
+	if (pthread_key_create(&NODE_KEY, node_cache_release)) {
+		fprintf(stderr, "pthread_key_create failed");
+		exit(1);
+	}
+}
+
+/* 销毁队列, 回收队列的内存, 此时队列中只剩下哑节点 */
+static void 
+_release(struct message_queue *q) {
+	assert(q->next == NULL);
+	assert(q->head == &q->stub && q->stub.next == NULL);
+	mq_unbind(q);
+	skynet_free(q);
+}
+
+/* 获取当前时刻消息队列的长度. 此函数是线程安全的. */
+int
+skynet_mq_length(struct message_queue *q) {
+	int length = q->length;
+	return length < 0 ? 0 : length;
+}
+
+/* 将节点链接到队列尾部, 可由任意线程并发调用 */
+static inline void
+mq_enqueue(struct message_queue *q, struct message_node *node) {
+	node->next = NULL;
+	/* 原子交换同时是内存屏障, 保证节点内容先于链接对消费者可见 */
+	struct message_node *prev = ATOM_XCHG(&q->tail, node);
+	prev->next = node;
+}
+
+/* 从队列头部取下一个节点, 节点取下之后不再被队列引用. 当首节点是最后一个节点时先将哑节点入列, 再将其取下.
+ * 当生产者还没有完成链接时当作空队列处理, 返回 NULL . 仅能由消费者调用. */
+static struct message_node *
+mq_dequeue(struct message_queue *q) {
+	struct message_node *head = q->head;
+	struct message_node *next = head->next;
+	if (head == &q->stub) {
+		if (next == NULL) {
+			return NULL;
+		}
+		q->head = head = next;
+		next = next->next;
+	}
+	if (next == NULL) {
+		if (head != q->tail) {
+			return NULL;
+		}
+		mq_enqueue(q, &q->stub);
+		next = head->next;
+		if (next == NULL) {
+			return NULL;
+		}
+	}
+	q->head = next;
+	return head;
+}
+
+/* 取下一个节点并把消息复制到 message 中, 不在消息内容中的节点在此放回节点池. 返回 MQ_TAKE_OK 表示取到了消息;
+ * 没有取到时, 只有 head 和 tail 都是哑节点才返回 MQ_TAKE_EMPTY , 否则是生产者还没有完成链接, 返回 MQ_TAKE_PENDING . */
+static inline int
+mq_take(struct message_queue *q, struct skynet_message *message) {
+	struct message_node *node = mq_dequeue(q);
+	if (node == NULL) {
+		if (q->head == &q->stub && q->stub.next == NULL && ATOM_LOAD(&q->tail) == &q->stub) {
+			return MQ_TAKE_EMPTY;
+		}
+		return MQ_TAKE_PENDING;
+	}
+	*message = node->message;
+	if (!node->inplace) {
+		node_free(node);
+	}
+	return MQ_TAKE_OK;
+}
+
+/* 从消息队列中取出一条消息。返回 0 时表示获取成功，并且消息被复制到 message 中,
+ * 返回 1 时表示队列已经为空了, message 保持不变. 此函数只能由正在分发此队列的工作线程调用.
+ * 当队列为空时先将 in_global 置 0 再检查一次队列, 若此间有生产者入列, 那么要么由生产者
+ * 将队列推入全局队列, 要么由消费者重新抢回 in_global 继续处理, 二者只会有一个成功.
+ * in_global 置 0 之后别的工作线程可能已经开始分发并释放节点, 所以再次检查时只读取生产者原子交换的 tail ,
+ * 不读取 head 也不访问任何节点. 队列取空时 head 和 tail 都是哑节点, tail 不再是哑节点说明有生产者入列.
+ * 若生产者交换了 tail 但还没有完成链接, 不放弃 in_global 反复抢回等待它, 而是把队列推回全局队列稍后再分发, 同样返回 1 . */
+int
+skynet_mq_pop(struct message_queue *q, struct skynet_message *message) {
+	int ret;
+	while ((ret = mq_take(q, message)) != MQ_TAKE_OK) {
+		if (ret == MQ_TAKE_PENDING) {
+			/* 仍然持有 in_global , 生产者完成链接之后不会重复推入 */
+			skynet_globalmq_requeue(q);
+			return 1;
+		}
+		// reset overload_threshold when queue is empty
+		q->overload_threshold = MQ_OVERLOAD;
+		q->in_global = 0;
+		__sync_synchronize();
+		/* 有生产者入列才需要抢回 */
+		if (ATOM_LOAD(&q->tail) == &q->stub || !ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL)) {
+			return 1;
+		}
+	}
+
+	/* 检查负载并且重新设置负载阈值 */
+	int length = ATOM_DEC(&q->length);
+	while (length > q->overload_threshold) {
+		q->overload = length;
+		q->overload_threshold *= 2;
+	}
+
+	return 0;
+}
+
+/* 从消息队列中一次取出至多 max 条消息复制到 message 数组中, 长度计数只做一次原子减法. 返回取出的消息数量,
+ * 返回 0 表示队列已经为空了, 此时 in_global 的处理与 skynet_mq_pop 相同. 负载的检查使用取出第一条消息后的长度,
+ * 与逐条取出时的结果相同. 此函数只能由正在分发此队列的工作线程调用. */
+int
+skynet_mq_pop_batch(struct message_queue *q, struct skynet_message *message, int max) {
+	int n = 0;
+	while (n < max && mq_take(q, &message[n]) == MQ_TAKE_OK) {
+		++ n;
+	}
+	if (n == 0) {
+		return skynet_mq_pop(q, message) ? 0 : 1;
+	}
+
+	/* 检查负载并且重新设置负载阈值 */
+	int length = ATOM_SUB(&q->length, n) + n - 1;
+	while (length > q->overload_threshold) {
+		q->overload = length;
+		q->overload_threshold *= 2;
+	}
+
+	return n;
+}
+
+/* 将节点入列, 如果当前消息队列的 in_global 字段为 0 时, 将会被推入到全局队列中 */
+static inline void
+mq_push_node(struct message_queue *q, struct message_node *node) {
+#ifdef MESSAGE_LATENCY
+	node->message.stamp = skynet_hpc();
+#endif
+	ATOM_INC(&q->length);
+	mq_enqueue(q, node);
+
+	/* 队列进入全局队列, 同时会唤醒一条停放的工作线程来处理 */
+	if (ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL)) {
+		skynet_globalmq_push(q);
+	}
+}
+
+/* 向服务的消息队列中推入消息, 从节点池中为消息取一个节点. 此函数是线程安全的, 只在节点池的线程缓存为空时才会加锁. */
+void 
+skynet_mq_push(struct message_queue *q, struct skynet_message *message) {
+	assert(message);
+	struct message_node *node = node_alloc();
+	node->message = *message;
+	node->inplace = 0;
+	mq_push_node(q, node);
+}
+
+/* 分配可以容纳 sz 字节消息内容的内存, 之后还保留一个字节和一个队列节点. 内存块的起始地址即是消息内容,
+ * 与普通的堆内存一样以 skynet_free 释放. */
+void *
+skynet_mq_alloc(size_t sz) {
+	return skynet_malloc(MQ_INPLACE_OFFSET(sz) + sizeof(struct message_node));
+}
+
+/* 向服务的消息队列中推入内容由 skynet_mq_alloc 分配的消息, 使用内容末尾自带的节点, 不再分配内存.
+ * 消息中的大小必须与分配时的大小相同. 此函数是线程安全的, 并且不会加锁. */
+void
+skynet_mq_push_inplace(struct message_queue *q, struct skynet_message *message) {
+	assert(message && message->data);
+	struct message_node *node = (struct message_node *)((char *)message->data + MQ_INPLACE_OFFSET(message->sz & MESSAGE_TYPE_MASK));
+	node->message = *message;
+	node->inplace = 1;
+	mq_push_node(q, node);
+}
+
+/* 标记消息队列为即将销毁, 每个队列只能调用此函数一次, 此函数是线程安全的.
+ * 之所以存在此函数的原因是队列需要在服务对象销毁之后才能销毁, 队列会在下一次分发时实际删除. */
+void 
+skynet_mq_mark_release(struct message_queue *q) {
+	assert(q->release == 0);
+	q->release = 1;
+	if (ATOM_CAS(&q->in_global, 0, MQ_IN_GLOBAL)) {
+		skynet_globalmq_push(q);
+	}
+}
+
+/* 真正执行销毁队列, 先将队列中的所有消息以 drop_func 函数方式清理, 再回收队列的内存.
+ * 服务已经销毁, 不会再有生产者, 所以不必像 skynet_mq_pop 那样处理还没有完成的链接, 直接等待它完成. */
+static void
+_drop_queue(struct message_queue *q, message_drop drop_func, void *ud) {
+	struct skynet_message msg;
+	int ret;
+	while ((ret = mq_take(q, &msg)) != MQ_TAKE_EMPTY) {
+		if (ret == MQ_TAKE_OK) {
+			drop_func(&msg, ud);
+		}
+	}
+	_release(q);
+}
+
+/* 实际销毁队列, 需要先标记为销毁才会实际销毁, 否则将重新入队, 暗含的假设就是调用此函数时队列必须
+ * 已经从全局队列中取出. 此函数是线程安全的. */
+void 
+skynet_mq_release(struct message_queue *q, message_drop drop_func, void *ud) {
+	__sync_synchronize();
+	if (q->release) {
+		_drop_queue(q, drop_func, ud);
+	} else {
+		skynet_globalmq_push(q);
+	}
+}
+
+#endif
+
+/* 获取此消息队列所属服务的 id */
+uint32_t 
+skynet_mq_handle(struct message_queue *q) {
+	return q->handle;
+}
+
+/* 检查并重置队列的负载. 返回非负值表示当前负载, 返回 0 表示未超过负载. */
+int
+skynet_mq_overload(struct message_queue *q) {
+	if (q->overload) {
+		int overload = q->overload;
+		q->overload = 0;
+		return overload;
+	} 
+	return 0;
+}
+
+/* 设置队列长度的上限及超出上限时的策略, limit 为 0 表示不限制. 此函数是线程安全的, 发送者可能稍后才看到新的设置. */
+void
+skynet_mq_limit(struct message_queue *q, int limit, int policy) {
+	q->policy = policy;
+	q->limit = limit < 0 ? 0 : limit;
+}
+
+/* 由发送者在推入一条受上限约束的消息之前调用, 检查队列能否接受它. 队列长度是近似值, 多个发送者并发时队列可能略微超出上限.
+ * 返回 MQ_ACCEPT 表示可以推入, MQ_REJECT 表示应该拒绝, MQ_SIGNAL 表示可以推入但需要通知发送者, 长度达到上限之后每推入 limit 条
+ * 消息通知一次. 丢弃策略由消费者在分发时丢弃最旧的消息(参见 skynet_mq_droplimit ), 但消费者停滞时无法丢弃,
+ * 所以队列长度达到 MQ_DROP_CAP 倍上限之后同样拒绝新的消息. */
+int
+skynet_mq_admit(struct message_queue *q) {
+	int limit = q->limit;
+	if (limit == 0) {
+		return MQ_ACCEPT;
+	}
+	int length = skynet_mq_length(q);
+	if (length < limit) {
+		return MQ_ACCEPT;
+	}
+	switch (q->policy) {
+	case MQ_LIMIT_REJECT:
+		return MQ_REJECT;
+	case MQ_LIMIT_DROP:
+		return length - limit < limit * (MQ_DROP_CAP - 1) ? MQ_ACCEPT : MQ_REJECT;
+	}
+	return (length - limit) % limit == 0 ? MQ_SIGNAL : MQ_ACCEPT;
+}
+
+/* 获取丢弃策略下队列长度的上限, 分发时超出上限的最旧的消息将被丢弃. 其它策略或者不限制时返回 0 . */
+int
+skynet_mq_droplimit(struct message_queue *q) {
+	return q->policy == MQ_LIMIT_DROP ? q->limit : 0;
+}
+
+/* 初始化全局队列, 参数 thread 为共享工作线程的数量, exclusive 为专用工作线程的数量, 每条工作线程拥有一条运行队列.
+ * 此函数只能在系统启动时调用一次. 私下觉得 skynet_globalmq_init 更合适 */
+void 
+skynet_mq_init(int thread, int exclusive) {
+	int i;
+	QN = thread > 0 ? thread : 1;
+	QX = exclusive > 0 ? exclusive : 0;
+	Q = skynet_malloc((QN + QX) * sizeof(struct global_queue *));
+	QOWNER = skynet_malloc((QX + 1) * sizeof(struct message_queue *));
+	memset((void *)QOWNER, 0, (QX + 1) * sizeof(struct message_queue *));
+	for (i=0;i<QN+QX;i++) {
+		/* 匿名映射的内存已经清零, 即 head 和 tail 为 NULL. 再初始化锁为未加锁状态. */
+		struct global_queue *q = mmap(NULL, sizeof(*q), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (q == MAP_FAILED) {
+			fprintf(stderr, "mmap run queue failed");
+			exit(1);
+		}
+		SPIN_INIT(q);
+		Q[i] = q;
+	}
+	if (pthread_key_create(&Q_KEY, NULL)) {
+		fprintf(stderr, "pthread_key_create failed");
+		exit(1);
 	}
+#ifndef USE_RING_MQ
+	node_init();
+#endif
 }
@@ -11,6 +11,9 @@ struct skynet_message {
 	                        请求消息的会话号一样, 用于 skynet 查找相应处理逻辑 */
 	void * data;         /* 消息内容指针, 通常是发送方分配内存, 接收函数销毁内存 */
 	size_t sz;           /* 高8位保存了消息类型, 剩下的低位保存了消息内容大小 */
+#ifdef MESSAGE_LATENCY
+	uint64_t stamp;      /* 入列的时间, 单位纳秒, 由 skynet_mq 在入列时设置, 用于统计排队等待时间 */
+#endif
 };
 
 // type is encoding in skynet_message.sz high 8bit
@@ -21,9 +24,15 @@ struct skynet_message {
 struct message_queue;
 
 void skynet_globalmq_push(struct message_queue * queue);
+void skynet_globalmq_requeue(struct message_queue * queue);	// push back a queue the current worker is dispatching
 struct message_queue * skynet_globalmq_pop(void);
+void skynet_globalmq_bind(int id, int node);
+int skynet_globalmq_length(void);
+int skynet_globalmq_ready(int id);	// worker id has something to dispatch
+int skynet_globalmq_owned(struct message_queue *queue);	// current worker may keep dispatching queue
 
 struct message_queue * skynet_mq_create(uint32_t handle);
+int skynet_mq_exclusive(struct message_queue *q);	// bind q to a dedicated worker, return its id or -1
 void skynet_mq_mark_release(struct message_queue *q);
 
 /* 销毁消息的函数类型声明, 第二个参数为自定义的参数 */
@@ -34,12 +43,37 @@ uint32_t skynet_mq_handle(struct message_queue *);
 
 // 0 for success
 int skynet_mq_pop(struct message_queue *q, struct skynet_message *message);
+// return the number of messages popped (at most max), 0 for empty
+int skynet_mq_pop_batch(struct message_queue *q, struct skynet_message *message, int max);
 void skynet_mq_push(struct message_queue *q, struct skynet_message *message);
 
+// allocate a payload of sz bytes (plus a trailing byte) that carries its own queue node, free it with skynet_free
+void * skynet_mq_alloc(size_t sz);
+// push a message whose data comes from skynet_mq_alloc with the same size, without allocating a node
+void skynet_mq_push_inplace(struct message_queue *q, struct skynet_message *message);
+
 // return the length of message queue, for debug
 int skynet_mq_length(struct message_queue *q);
 int skynet_mq_overload(struct message_queue *q);
 
-void skynet_mq_init();
+/* 队列长度超出上限时的策略: 拒绝新的消息, 丢弃最旧的消息, 或者接受消息并以 PTYPE_OVERLOAD 通知发送者 */
+#define MQ_LIMIT_REJECT 0
+#define MQ_LIMIT_DROP 1
+#define MQ_LIMIT_SIGNAL 2
+
+/* 丢弃策略下队列长度的硬上限是上限的倍数, 达到之后拒绝新的消息 */
+#define MQ_DROP_CAP 2
+
+/* skynet_mq_admit 的返回值 */
+#define MQ_ACCEPT 0
+#define MQ_REJECT 1
+#define MQ_SIGNAL 2
+
+// limit 0 for unbounded
+void skynet_mq_limit(struct message_queue *q, int limit, int policy);
+int skynet_mq_admit(struct message_queue *q);
+int skynet_mq_droplimit(struct message_queue *q);
+
+void skynet_mq_init(int thread, int exclusive);
 
 #endif
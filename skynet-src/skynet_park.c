@@ -0,0 +1,181 @@
+#include "skynet.h"
+#include "skynet_park.h"
+#include "skynet_mq.h"
+#include "atomic.h"
+
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+
+/* skynet_park 模块负责空闲工作线程的停放与唤醒. 工作线程没有消息队列可处理时先自旋一小段时间,
+ * 若仍没有新的工作就在自己专属的等待对象(linux 下为 futex , 其它平台为条件变量)上睡眠.
+ * 当有消息队列被推入全局队列时, 由推入者唤醒恰好一条停放的工作线程. */
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __asm__ __volatile__("pause")
+#elif defined(__aarch64__) || defined(__arm__)
+#define CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define CPU_RELAX() __sync_synchronize()
+#endif
+
+/* 自旋次数的上下限, 每条线程的自旋次数在此范围内自适应调整 */
+#define SPIN_MIN 64
+#define SPIN_MAX 8192
+
+#define PARK_RUNNING 0
+#define PARK_PARKED 1
+#define PARK_NOTIFIED 2
+
+/* 每条工作线程的停放状态, 独占一条缓存线以免线程间的伪共享 */
+struct parker {
+	volatile int state;               /* PARK_RUNNING 运行中, PARK_PARKED 已停放, PARK_NOTIFIED 已被唤醒但还未醒来 */
+	int spin;                         /* 当前的自旋次数, 自旋期间等到工作时加倍, 等不到时减半 */
+#if !defined(__linux__)
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif
+} __attribute__((aligned(64)));
+
+struct park {
+	int count;                        /* 共享工作线程的数量, 其后是专用工作线程 */
+	int total;                        /* 所有工作线程的数量 */
+	int spin;                         /* 是否自旋, 单核机器上自旋没有意义 */
+	volatile int parked;              /* 停放的工作线程数量, 为 0 时唤醒操作只需一次读取 */
+	volatile int quit;                /* 退出标记, 设置之后工作线程不再停放 */
+	unsigned int next;                /* 下一次唤醒时开始查找的位置, 使唤醒在工作线程间轮转 */
+	struct parker *p;
+};
+
+static struct park P;
+
+static inline void
+sleep_parker(struct parker *w) {
+#if defined(__linux__)
+	while (w->state == PARK_PARKED) {
+		syscall(SYS_futex, &w->state, FUTEX_WAIT_PRIVATE, PARK_PARKED, NULL, NULL, 0);
+	}
+#else
+	pthread_mutex_lock(&w->mutex);
+	while (w->state == PARK_PARKED) {
+		pthread_cond_wait(&w->cond, &w->mutex);
+	}
+	pthread_mutex_unlock(&w->mutex);
+#endif
+}
+
+/* 尝试唤醒一条停放的工作线程, 成功返回 1 , 它已经不在停放状态时返回 0 */
+static inline int
+wake_parker(struct parker *w) {
+	if (w->state != PARK_PARKED || !ATOM_CAS(&w->state, PARK_PARKED, PARK_NOTIFIED)) {
+		return 0;
+	}
+#if defined(__linux__)
+	syscall(SYS_futex, &w->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&w->mutex);
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+#endif
+	return 1;
+}
+
+/* 初始化 thread 条共享工作线程和 exclusive 条专用工作线程的停放状态 */
+void
+skynet_park_init(int thread, int exclusive) {
+	memset(&P, 0, sizeof(P));
+	P.count = thread;
+	P.total = thread + exclusive;
+	P.spin = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+	P.p = skynet_malloc(P.total * sizeof(struct parker));
+	memset(P.p, 0, P.total * sizeof(struct parker));
+	int i;
+	for (i=0;i<P.total;i++) {
+		P.p[i].spin = SPIN_MIN;
+#if !defined(__linux__)
+		pthread_mutex_init(&P.p[i].mutex, NULL);
+		pthread_cond_init(&P.p[i].cond, NULL);
+#endif
+	}
+}
+
+/* 停放编号为 id 的工作线程, 在它可以分发的运行队列中出现消息队列或者退出时返回. 先自旋等待, 再声明停放并且重新检查全局队列,
+ * 与 skynet_unpark 先推入全局队列再检查停放数量的顺序相对, 二者之间都有完整的内存屏障, 所以不会丢失唤醒. */
+void
+skynet_park(int id) {
+	struct parker *w = &P.p[id];
+	if (P.spin) {
+		int i;
+		for (i=0;i<w->spin;i++) {
+			if (skynet_globalmq_ready(id) || P.quit) {
+				if (w->spin < SPIN_MAX) {
+					w->spin *= 2;
+				}
+				return;
+			}
+			CPU_RELAX();
+		}
+		if (w->spin > SPIN_MIN) {
+			w->spin /= 2;
+		}
+	}
+
+	/* 只统计共享工作线程的停放数量, 专用工作线程由 skynet_unpark_thread 直接唤醒 */
+	int shared = id < P.count;
+	w->state = PARK_PARKED;
+	if (shared) {
+		ATOM_INC(&P.parked);
+	} else {
+		__sync_synchronize();
+	}
+	if (P.quit || skynet_globalmq_ready(id)) {
+		/* 已经有了新的工作, 若撤销停放失败说明已被别人唤醒, 同样直接返回即可 */
+		ATOM_CAS(&w->state, PARK_PARKED, PARK_RUNNING);
+	} else {
+		sleep_parker(w);
+	}
+	w->state = PARK_RUNNING;
+	if (shared) {
+		ATOM_DEC(&P.parked);
+	}
+}
+
+/* 唤醒恰好一条停放的共享工作线程, 没有停放的线程时只需一次读取. 在消息队列推入全局队列之后调用. */
+void
+skynet_unpark(void) {
+	__sync_synchronize();
+	if (P.parked == 0) {
+		return;
+	}
+	int n = P.count;
+	unsigned int start = ATOM_FINC(&P.next);
+	int i;
+	for (i=0;i<n;i++) {
+		if (wake_parker(&P.p[(start + i) % n])) {
+			return;
+		}
+	}
+}
+
+/* 唤醒编号为 id 的工作线程, 用于专用工作线程, 它只处理独占它的那个服务 */
+void
+skynet_unpark_thread(int id) {
+	__sync_synchronize();
+	wake_parker(&P.p[id]);
+}
+
+/* 设置退出标记并唤醒所有停放的工作线程 */
+void
+skynet_park_exit(void) {
+	P.quit = 1;
+	__sync_synchronize();
+	int i;
+	for (i=0;i<P.total;i++) {
+		wake_parker(&P.p[i]);
+	}
+}
@@ -0,0 +1,10 @@
+#ifndef SKYNET_PARK_H
+#define SKYNET_PARK_H
+
+void skynet_park_init(int thread, int exclusive);
+void skynet_park(int id);	// spin, then sleep until there is work or exit
+void skynet_unpark(void);	// wake exactly one parked shared worker, if any
+void skynet_unpark_thread(int id);	// wake the worker id if it is parked
+void skynet_park_exit(void);	// wake all workers, they will never park again
+
+#endif
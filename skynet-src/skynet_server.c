@@ -10,6 +10,8 @@
 #include "skynet_monitor.h"
 #include "skynet_imp.h"
 #include "skynet_log.h"
+#include "skynet_latency.h"
+#include "skynet_trace.h"
 #include "spinlock.h"
 #include "atomic.h"
 
@@ -21,6 +23,12 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+/* 自适应分发时一次分发的时间预算, 单位纳秒, 由所有等待分发的队列平分 */
+#define DISPATCH_SLICE 1000000
+
+/* 分发时一次从消息队列中批量取出的最大消息数量 */
+#define MESSAGE_BATCH 32
+
 #ifdef CALLING_CHECK
 
 /* 被 BEGIN 和 END 保护的代码段的执行是不并发的. 一旦发生并发会导致第二次加锁失败,
@@ -56,6 +64,19 @@ struct skynet_context {
 	int ref;                        /* 引用计数器 */
 	bool init;                      /* 初始化完毕的标记 */
 	bool endless;                   /* 是否陷入无限循环的标记 */
+	uint64_t message_count;         /* 已经分发的消息数量 */
+	uint64_t cost;                  /* 自适应分发时每条消息处理耗时的移动平均值, 单位纳秒 */
+	uint32_t slice_count;           /* 消息队列被分发的次数, 每次分发处理若干条消息 */
+	uint32_t drain_count;           /* 自适应分发时决定一次处理完整个队列的次数 */
+	uint32_t budget_count;          /* 自适应分发时因为时间预算而只处理部分消息的次数 */
+	int batch;                      /* 最近一次分发决定处理的消息数量 */
+	uint32_t reject_count;          /* 因为消息队列超出上限而被拒绝的消息数量, 由发送者以原子方式增加 */
+	uint32_t drop_count;            /* 因为消息队列超出上限而在分发时被丢弃的消息数量 */
+	struct skynet_latency service;  /* 每条消息的处理耗时的直方图 */
+	struct handle_namecache *namecache; /* 以 .name 发送消息时使用的名字缓存, 第一次使用时创建, 没有开启时为 NULL */
+#ifdef MESSAGE_LATENCY
+	struct skynet_latency wait;     /* 每条消息从入列到开始处理的等待时间的直方图 */
+#endif
 
 	CHECKCALLING_DECL               /* 当需要对服务的消息处理和初始化校验是否线程封闭时, 定义的锁 */
 };
@@ -160,6 +181,19 @@ skynet_context_new(const char * name, const char *param) {
 
 	ctx->init = false;
 	ctx->endless = false;
+	ctx->message_count = 0;
+	ctx->cost = 0;
+	ctx->slice_count = 0;
+	ctx->drain_count = 0;
+	ctx->budget_count = 0;
+	ctx->batch = 0;
+	ctx->reject_count = 0;
+	ctx->drop_count = 0;
+	skynet_latency_reset(&ctx->service);
+#ifdef MESSAGE_LATENCY
+	skynet_latency_reset(&ctx->wait);
+#endif
+	ctx->namecache = NULL;
 	// Should set to 0 first to avoid skynet_handle_retireall get an uninitialized handle
 	ctx->handle = 0;
 	/* 一旦注册了服务就存在被别的线程调用 skynet_handle_retire 或者
@@ -216,6 +250,20 @@ skynet_context_grab(struct skynet_context *ctx) {
 	ATOM_INC(&ctx->ref);
 }
 
+/* 仅当服务的引用计数不为 0 时将其加 1 并返回 1 . 引用计数为 0 说明服务正在被销毁, 此时返回 0 .
+ * 供 skynet_handle_grab 无锁查找服务时使用. */
+int
+skynet_context_trygrab(struct skynet_context *ctx) {
+	int ref = ctx->ref;
+	while (ref > 0) {
+		if (ATOM_CAS(&ctx->ref, ref, ref + 1)) {
+			return 1;
+		}
+		ref = ctx->ref;
+	}
+	return 0;
+}
+
 /* 保留一个服务, 被保留的服务保证当调用 skynet_handle_retire 并不真正退出服务.
  * 而是最后手动调用释放掉服务. 需要说明的是被保留的服务不会记录在 GNODE.total 中,
  * 因而不会阻止工作线程的退出. 参数 ctx 是需要被保留的服务. 此函数的用意在于一些地方
@@ -237,8 +285,10 @@ delete_context(struct skynet_context *ctx) {
 	}
 	skynet_module_instance_release(ctx->mod, ctx->instance);
 	skynet_mq_mark_release(ctx->queue);
+	skynet_handle_namecache_delete(ctx->namecache);
 	CHECKCALLING_DESTROY(ctx)
-	skynet_free(ctx);
+	/* skynet_handle_grab 是无锁的, 可能还有线程刚刚读到此服务对象, 因而推迟释放 */
+	skynet_handle_defer(ctx);
 	context_dec();
 }
 
@@ -268,6 +318,84 @@ skynet_context_push(uint32_t handle, struct skynet_message *message) {
 	return 0;
 }
 
+/* 与 skynet_context_push 相同, 但消息内容必须由 skynet_mq_alloc 分配, 入列时使用内容自带的节点而不再分配内存. */
+int
+skynet_context_push_inplace(uint32_t handle, struct skynet_message *message) {
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL) {
+		return -1;
+	}
+	skynet_mq_push_inplace(ctx->queue, message);
+	skynet_context_release(ctx);
+
+	return 0;
+}
+
+/* 消息类型是否受消息队列长度上限的约束. 回应、定时、错误、socket、系统、harbor 以及过载通知消息被拒绝或者丢弃
+ * 会破坏会话或者数据流, 因而总是被接受. */
+static inline int
+bounded_type(int type) {
+	switch (type) {
+	case PTYPE_RESPONSE:
+	case PTYPE_ERROR:
+	case PTYPE_SOCKET:
+	case PTYPE_SYSTEM:
+	case PTYPE_HARBOR:
+	case PTYPE_OVERLOAD:
+	case PTYPE_TIMER:
+		return 0;
+	}
+	return 1;
+}
+
+/* 将 skynet_send 发出的本地消息推入服务 handle 的消息队列, 并执行目标队列的长度上限策略(参见 cmd_limit ).
+ * 策略为 signal 且队列超出上限时, 消息依然入列, 但会给消息的来源服务发送一条 PTYPE_OVERLOAD 消息, 内容为当前的队列长度.
+ * inplace 为 1 时消息内容由 skynet_mq_alloc 分配.
+ * 返回: 0 表示成功, -1 表示服务不存在, -2 表示目标队列已满而被拒绝. 失败时消息内容不会被释放. */
+static int
+context_send(uint32_t handle, struct skynet_message *message, int inplace) {
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL) {
+		return -1;
+	}
+	int admit = MQ_ACCEPT;
+	if (bounded_type(message->sz >> MESSAGE_TYPE_SHIFT)) {
+		admit = skynet_mq_admit(ctx->queue);
+		if (admit == MQ_REJECT) {
+			ATOM_INC(&ctx->reject_count);
+			skynet_context_release(ctx);
+			return -2;
+		}
+	}
+	if (inplace) {
+		skynet_mq_push_inplace(ctx->queue, message);
+	} else {
+		skynet_mq_push(ctx->queue, message);
+	}
+	int length = 0;
+	if (admit == MQ_SIGNAL) {
+		length = skynet_mq_length(ctx->queue);
+	}
+	skynet_context_release(ctx);
+
+	if (admit == MQ_SIGNAL) {
+		char tmp[16];
+		int n = sprintf(tmp, "%d", length);
+		skynet_send(NULL, handle, message->source, PTYPE_OVERLOAD, 0, tmp, n);
+	}
+	return 0;
+}
+
+/* 丢弃一条超出消息队列上限的最旧的消息. 如果它是一个请求, 向发送者回应错误, 使其调用失败而不是一直等待. */
+static void
+drop_oldest(struct skynet_context *ctx, struct skynet_message *msg) {
+	skynet_free(msg->data);
+	++ ctx->drop_count;
+	if (msg->session != 0) {
+		skynet_send(NULL, ctx->handle, msg->source, PTYPE_ERROR, msg->session, NULL, 0);
+	}
+}
+
 /* 标记服务为无限循环. 此函数是非线程安全的, 因而只能非并发调用. */
 void 
 skynet_context_endless(uint32_t handle) {
@@ -323,8 +451,54 @@ skynet_context_dispatchall(struct skynet_context * ctx) {
 	}
 }
 
+/* 自适应地决定本次分发处理的消息数量. 当没有其它队列在等待或者还不知道处理耗时时, 一次处理完整个队列以获得吞吐量;
+ * 否则将时间预算 DISPATCH_SLICE 由所有等待中的队列平分, 依据此服务每条消息的平均耗时计算能处理的数量, 以保证公平性.
+ *
+ * 参数: ctx 为正在分发的服务, length 为当前队列中(包括已经取出的一条)的消息数量
+ * 返回: 本次分发处理的消息数量, 至少为 1 */
+static int
+adaptive_batch(struct skynet_context *ctx, int length) {
+	int n = length;
+	int waiting = skynet_globalmq_length();
+	if (waiting > 0 && ctx->cost > 0) {
+		uint64_t affordable = DISPATCH_SLICE / waiting / ctx->cost;
+		if (affordable < (uint64_t)length) {
+			n = affordable > 0 ? (int)affordable : 1;
+		}
+	}
+	if (n < length) {
+		++ctx->budget_count;
+	} else {
+		++ctx->drain_count;
+	}
+	ctx->batch = n;
+	return n;
+}
+
+/* 在一次分发结束时更新服务的统计信息. 自适应分发时还会以 1/8 的权重将本次每条消息的平均耗时计入移动平均值.
+ * 参数: ctx 为分发的服务, weight 为分发权重, start 为分发开始的时间戳, count 为本次处理的消息数量 */
+static void
+dispatch_stat(struct skynet_context *ctx, int weight, uint64_t start, int count) {
+	if (count == 0) {
+		return;
+	}
+	++ctx->slice_count;
+	ctx->message_count += count;
+	if (weight == WEIGHT_ADAPTIVE) {
+		uint64_t cost = (skynet_hpc() - start) / count;
+		if (ctx->cost == 0) {
+			ctx->cost = cost > 0 ? cost : 1;
+		} else {
+			ctx->cost = (ctx->cost * 7 + cost) / 8 + 1;
+		}
+	} else {
+		ctx->batch = count;
+	}
+}
+
 /* 工作线程分发消息的函数, 此函数依据权重 weight 的值处理一条消息队列中的消息. 如果 weight >= 0
- * 处理的消息数量是消息队列的长度除以 2 的 weight 次方, 如果 weight < 0 , 将只处理一条.
+ * 处理的消息数量是消息队列的长度除以 2 的 weight 次方, 如果 weight 为 WEIGHT_ADAPTIVE 则由 adaptive_batch 决定,
+ * 其它的负值将只处理一条.
  * 同时, 如果消息队列的服务已经退出了, 消息队列将销毁. 整个消息分发过程会利用 sm 监控是否陷入无限循环,
  * 并且还会检查消息队列是否过载. 如果传入的消息队列 q 非 NULL 值, 将处理此消息队列, 否则将先从全局队列中
  * 取得一条消息队列来处理, 若全局队列已经空了将不执行消息分发返回 NULL, 否则将执行消息分发并返回下一条
@@ -353,44 +527,83 @@ skynet_context_message_dispatch(struct skynet_monitor *sm, struct message_queue
 		return skynet_globalmq_pop();
 	}
 
-	int i,n=1;
-	struct skynet_message msg;
+	int i,n;
+	/* 每条消息处理结束时读取一次时钟, 与上一次的时间之差即是这条消息的处理耗时 */
+	uint64_t start = skynet_hpc();
+	uint64_t now = start;
+	struct skynet_message batch[MESSAGE_BATCH];
+	struct skynet_trace *trace = skynet_trace_local();
+
+	/* 先依据权重和队列长度决定本次处理的消息数量, 至少为 1 . 与逐条取出时在取出第一条消息之后才计算的数量相同,
+	 * 所以这里使用的是队列长度减 1 . */
+	int length = skynet_mq_length(q);
+	int limit = skynet_mq_droplimit(q);
+	if (weight >= 0) {
+		n = (length - 1) >> weight;
+	} else if (weight == WEIGHT_ADAPTIVE) {
+		n = length > 0 ? adaptive_batch(ctx, length) : 1;
+	} else {
+		n = 1;
+	}
+	if (n < 1) {
+		n = 1;
+	}
 
-	/* 依据权重从消息队列中取得消息并处理, 如果消息队列被处理空了, 消息队列不会再次
-	 * 推入全局队列并从全局消息队列中取得下一条消息队列并返回. */
-	for (i=0;i<n;i++) {
-		if (skynet_mq_pop(q,&msg)) {
+	/* 每次从消息队列中批量取出至多 MESSAGE_BATCH 条消息放到栈上的缓冲区中依次处理, 如果消息队列被处理空了,
+	 * 消息队列不会再次推入全局队列并从全局消息队列中取得下一条消息队列并返回. */
+	for (i=0;i<n;) {
+		int count = skynet_mq_pop_batch(q, batch, n - i < MESSAGE_BATCH ? n - i : MESSAGE_BATCH);
+		if (count == 0) {
+			dispatch_stat(ctx, weight, start, i);
 			skynet_context_release(ctx);
 			return skynet_globalmq_pop();
-		} else if (i==0 && weight >= 0) {
-			n = skynet_mq_length(q);
-			n >>= weight;
 		}
 		int overload = skynet_mq_overload(q);
 		if (overload) {
 			skynet_error(ctx, "May overload, message queue length = %d", overload);
 		}
 
-		skynet_monitor_trigger(sm, msg.source , handle);
+		int j;
+		for (j=0;j<count;j++) {
+			struct skynet_message *msg = &batch[j];
+			/* 丢弃策略下, 队列中剩余的消息加上批量缓冲区中还没有处理的消息超出上限时, 丢弃最旧的这一条 */
+			if (limit > 0 && bounded_type(msg->sz >> MESSAGE_TYPE_SHIFT) && skynet_mq_length(q) + count - j > limit) {
+				drop_oldest(ctx, msg);
+				continue;
+			}
+			skynet_monitor_trigger(sm, msg->source , handle);
+#ifdef MESSAGE_LATENCY
+			skynet_latency_record(&ctx->wait, now > msg->stamp ? now - msg->stamp : 0);
+#endif
 
-		/* 如果服务没有回调函数将直接释放消息中的内存, 说明 data 应该是堆内存. */
-		if (ctx->cb == NULL) {
-			skynet_free(msg.data);
-		} else {
-			dispatch_message(ctx, &msg);
-		}
+			/* 如果服务没有回调函数将直接释放消息中的内存, 说明 data 应该是堆内存. */
+			if (ctx->cb == NULL) {
+				skynet_free(msg->data);
+			} else {
+				dispatch_message(ctx, msg);
+			}
 
-		skynet_monitor_trigger(sm, 0,0);
+			skynet_monitor_trigger(sm, 0,0);
+			uint64_t end = skynet_hpc();
+			skynet_latency_record(&ctx->service, end - now);
+			if (trace) {
+				skynet_trace_record(trace, now, end - now, msg->source, handle, msg->sz >> MESSAGE_TYPE_SHIFT, msg->session);
+			}
+			now = end;
+		}
+		i += count;
 	}
+	dispatch_stat(ctx, weight, start, i);
 
 	/* 如果全局队列不为空, 将当前消息队列推入全局消息队列并取得下一条消息队列返回,
-	 * 否则返回当前消息队列. */
+	 * 否则返回当前消息队列. 若当前消息队列刚刚独占了一条专用工作线程(或者已经不属于当前线程),
+	 * 即使全局队列为空也要推回去, 由 skynet_globalmq_push 转交给它所属的线程. */
 	assert(q == ctx->queue);
 	struct message_queue *nq = skynet_globalmq_pop();
-	if (nq) {
+	if (nq || !skynet_globalmq_owned(q)) {
 		// If global mq is not empty , push q back, and return next queue (nq)
 		// Else (global mq is empty or block, don't push q back, and return q again (for next dispatch)
-		skynet_globalmq_push(q);
+		skynet_globalmq_requeue(q);
 		q = nq;
 	} 
 	skynet_context_release(ctx);
@@ -413,6 +626,21 @@ copy_name(char name[GLOBALNAME_LENGTH], const char * addr) {
 	}
 }
 
+/* 以服务 context 的名字缓存查找名字 name (不含点号)所表示的服务地址, context 为 NULL 或者没有开启名字缓存时直接查找. */
+static uint32_t
+context_findname(struct skynet_context * context, const char * name) {
+	if (context == NULL) {
+		return skynet_handle_findname(name);
+	}
+	if (context->namecache == NULL) {
+		context->namecache = skynet_handle_namecache_new();
+		if (context->namecache == NULL) {
+			return skynet_handle_findname(name);
+		}
+	}
+	return skynet_handle_findname_cache(context->namecache, name);
+}
+
 /* 查询名字 name 所表示的服务的地址. 如果 name 以冒号开始表示一个数字型服务名, 如果 name 以点号开头
  * 表示一个命名的服务名, 将从 handle 模块中查找服务的地址. 不支持其它形式的名字.
  *
@@ -424,7 +652,7 @@ skynet_queryname(struct skynet_context * context, const char * name) {
 	case ':':
 		return strtoul(name+1,NULL,16);
 	case '.':
-		return skynet_handle_findname(name + 1);
+		return context_findname(context, name + 1);
 	}
 	skynet_error(context, "Don't support query global name %s",name);
 	return 0;
@@ -469,6 +697,28 @@ cmd_timeout(struct skynet_context * context, const char * param) {
 	return context->result;
 }
 
+/* 与 TIMEOUT 命令相同, 但 param 的单位为毫秒. 定时器的精度由配置 timer_tick 决定, 默认精度下向上取整为厘秒. */
+static const char *
+cmd_timeoutms(struct skynet_context * context, const char * param) {
+	int ti = strtol(param, NULL, 10);
+	int session = skynet_context_newsession(context);
+	skynet_timeout_ms(context->handle, ti, session);
+	sprintf(context->result, "%d", session);
+	return context->result;
+}
+
+/* 取消服务 context 以会话号 param 注册的定时器. 取消成功时返回会话号, 定时器不存在(已经到期)时返回 NULL ,
+ * 此时定时器的消息可能已经在消息队列中. */
+static const char *
+cmd_cancel(struct skynet_context * context, const char * param) {
+	int session = strtol(param, NULL, 10);
+	if (skynet_timeout_cancel(context->handle, session)) {
+		return NULL;
+	}
+	sprintf(context->result, "%d", session);
+	return context->result;
+}
+
 /* 为 context 服务注册并返回服务的名字, 如果 param 为 NULL 或者空字符串则返回冒号打头 16 进制的服务地址,
  * 如果 param 以点号打头, 则将点号之后的 param 字符串注册为服务名字并返回. 其它形式将返回 NULL.
  *
@@ -693,6 +943,188 @@ cmd_mqlen(struct skynet_context * context, const char * param) {
 	return context->result;
 }
 
+/* 获取 context 服务的消息分发统计信息. param 为统计项的名字, 可以是 mqlen(消息队列长度), message(已分发的消息数),
+ * slice(被分发的次数), batch(最近一次分发的消息数), cost(每条消息的平均耗时, 纳秒, 仅在自适应分发时统计),
+ * drain(自适应分发时一次处理完整个队列的次数), budget(自适应分发时受时间预算限制的次数),
+ * reject(超出队列上限而被拒绝的消息数), drop(超出队列上限而被丢弃的消息数).
+ *
+ * 参数: context 待获取统计信息的服务, param 为统计项的名字
+ * 返回: 统计值, 不认识的统计项返回 NULL */
+static const char *
+cmd_stat(struct skynet_context * context, const char * param) {
+	if (param == NULL) {
+		return NULL;
+	}
+	if (strcmp(param, "mqlen") == 0) {
+		sprintf(context->result, "%d", skynet_mq_length(context->queue));
+	} else if (strcmp(param, "message") == 0) {
+		sprintf(context->result, "%llu", (unsigned long long)context->message_count);
+	} else if (strcmp(param, "slice") == 0) {
+		sprintf(context->result, "%u", context->slice_count);
+	} else if (strcmp(param, "batch") == 0) {
+		sprintf(context->result, "%d", context->batch);
+	} else if (strcmp(param, "cost") == 0) {
+		sprintf(context->result, "%llu", (unsigned long long)context->cost);
+	} else if (strcmp(param, "drain") == 0) {
+		sprintf(context->result, "%u", context->drain_count);
+	} else if (strcmp(param, "budget") == 0) {
+		sprintf(context->result, "%u", context->budget_count);
+	} else if (strcmp(param, "reject") == 0) {
+		sprintf(context->result, "%u", context->reject_count);
+	} else if (strcmp(param, "drop") == 0) {
+		sprintf(context->result, "%u", context->drop_count);
+	} else {
+		return NULL;
+	}
+	return context->result;
+}
+
+/* 获取服务的消息耗时统计. param 形如 "[address] kind stat" , address 是可选的冒号打头的 16 进制服务地址或者点号打头的服务名,
+ * 缺省时为 context 自身. kind 为 service(处理耗时) 或 wait(排队等待时间, 需要以 -DMESSAGE_LATENCY 编译),
+ * stat 为 count(次数), mean(平均值), max(最大值) 或者 0 到 100 之间的百分位数如 50 、 99 、 99.9 , 时间的单位为纳秒.
+ * kind 为 reset 时清空服务的统计, 没有返回值. 统计是由工作线程不加锁记录的, 读到的是近似值.
+ *
+ * 参数: context 为发起并执行命令的服务, param 为服务地址、统计的类别和统计项, 以空格分割
+ * 返回: 统计值, 服务不存在或者参数不正确时返回 NULL */
+static const char *
+cmd_latency(struct skynet_context * context, const char * param) {
+	if (param == NULL) {
+		return NULL;
+	}
+	char addr[64];
+	char kind[16];
+	char stat[16];
+	int n = sscanf(param, "%63s %15s %15s", addr, kind, stat);
+	uint32_t handle = context->handle;
+	if (n >= 1 && (addr[0] == ':' || addr[0] == '.')) {
+		handle = tohandle(context, addr);
+		if (handle == 0) {
+			return NULL;
+		}
+		-- n;
+	} else {
+		n = sscanf(param, "%15s %15s", kind, stat);
+	}
+	if (n < 1) {
+		return NULL;
+	}
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL) {
+		return NULL;
+	}
+	const char * ret = NULL;
+	struct skynet_latency * h = NULL;
+	if (strcmp(kind, "reset") == 0) {
+		skynet_latency_reset(&ctx->service);
+#ifdef MESSAGE_LATENCY
+		skynet_latency_reset(&ctx->wait);
+#endif
+	} else if (strcmp(kind, "service") == 0) {
+		h = &ctx->service;
+#ifdef MESSAGE_LATENCY
+	} else if (strcmp(kind, "wait") == 0) {
+		h = &ctx->wait;
+#endif
+	}
+	if (h && n >= 2) {
+		ret = context->result;
+		if (strcmp(stat, "count") == 0) {
+			sprintf(context->result, "%llu", (unsigned long long)h->count);
+		} else if (strcmp(stat, "mean") == 0) {
+			uint64_t count = h->count;
+			sprintf(context->result, "%llu", (unsigned long long)(count ? h->sum / count : 0));
+		} else if (strcmp(stat, "max") == 0) {
+			sprintf(context->result, "%llu", (unsigned long long)h->max);
+		} else {
+			char * end;
+			double p = strtod(stat, &end);
+			if (*end == '\0' && end != stat && p >= 0 && p <= 100) {
+				sprintf(context->result, "%llu", (unsigned long long)skynet_latency_percentile(h, p));
+			} else {
+				ret = NULL;
+			}
+		}
+	}
+	skynet_context_release(ctx);
+	return ret;
+}
+
+/* 将所有工作线程最近分发的消息记录导出为 Chrome/Perfetto 可以打开的 trace JSON 文件(参见 skynet_trace 模块).
+ *
+ * 参数: context 为发起并执行命令的服务, param 为导出的文件名
+ * 返回: 导出的事件数量, 无法写入文件时返回 NULL */
+static const char *
+cmd_trace(struct skynet_context * context, const char * param) {
+	if (param == NULL || param[0] == '\0') {
+		return NULL;
+	}
+	int n = skynet_trace_dump(param);
+	if (n < 0) {
+		skynet_error(context, "Can't write trace file %s", param);
+		return NULL;
+	}
+	sprintf(context->result, "%d", n);
+	return context->result;
+}
+
+/* 设置 context 服务的消息队列长度上限以及超出上限时的策略. param 形如 "1000 drop" , 上限为 0 表示不限制.
+ * 策略可以是 reject(拒绝新的消息, 发送者的 skynet_send 返回 -2, 缺省值), drop(分发时丢弃最旧的消息,
+ * 请求的发送者会收到错误回应; 消费者停滞时队列长度达到 MQ_DROP_CAP 倍上限之后拒绝新的消息) 或者 signal(接受消息, 并以 PTYPE_OVERLOAD 消息通知发送者).
+ * 只有请求类的消息受上限约束, 回应、错误、socket 等消息总是被接受.
+ *
+ * 参数: context 为发起并执行命令的服务, param 为上限和可选的策略, 以空格分割
+ * 返回: NULL 表示无返回值 */
+static const char *
+cmd_limit(struct skynet_context * context, const char * param) {
+	if (param == NULL || param[0] == '\0') {
+		return NULL;
+	}
+	char * policy = NULL;
+	int limit = strtol(param, &policy, 10);
+	while (*policy == ' ') {
+		++ policy;
+	}
+	int p;
+	if (*policy == '\0' || strcmp(policy, "reject") == 0) {
+		p = MQ_LIMIT_REJECT;
+	} else if (strcmp(policy, "drop") == 0) {
+		p = MQ_LIMIT_DROP;
+	} else if (strcmp(policy, "signal") == 0) {
+		p = MQ_LIMIT_SIGNAL;
+	} else {
+		skynet_error(context, "Invalid queue limit policy : %s", policy);
+		return NULL;
+	}
+	skynet_mq_limit(context->queue, limit, p);
+	return NULL;
+}
+
+/* 让 param 所表示的服务独占一条专用工作线程(见配置项 exclusive ), 此后它的消息只由这条线程处理,
+ * 直到服务退出时才释放. param 可以是冒号打头的 16 进制服务地址或者点号打头的服务名, 为空时表示 context 自身.
+ *
+ * 参数: context 为发起并执行命令的服务, param 是服务地址或服务名
+ * 返回: 专用线程的编号(从 0 开始), 没有空闲的专用线程或者服务不存在时返回 NULL */
+static const char *
+cmd_exclusive(struct skynet_context * context, const char * param) {
+	uint32_t handle;
+	if (param == NULL || param[0] == '\0') {
+		handle = context->handle;
+	} else {
+		handle = tohandle(context, param);
+	}
+	if (handle == 0)
+		return NULL;
+	struct skynet_context * ctx = skynet_handle_grab(handle);
+	if (ctx == NULL)
+		return NULL;
+	int id = skynet_mq_exclusive(ctx->queue);
+	skynet_context_release(ctx);
+	if (id < 0)
+		return NULL;
+	sprintf(context->result, "%d", id);
+	return context->result;
+}
+
 /* 给 param 所表示的服务开启调试日志, 日志内容是每一次的消息处理过程. param 可以是
  * 冒号打头的 16 进制服务地址或者点号打头的服务名. 当且仅当该服务之前没有开启调试日志时
  * 才会为其开启日志.
@@ -778,6 +1210,8 @@ cmd_signal(struct skynet_context * context, const char * param) {
 /* 命令函数结构数组, 以所有字段为 NULL 的空结构表示结束 */
 static struct command_func cmd_funcs[] = {
 	{ "TIMEOUT", cmd_timeout },
+	{ "TIMEOUTMS", cmd_timeoutms },
+	{ "CANCEL", cmd_cancel },
 	{ "REG", cmd_reg },
 	{ "QUERY", cmd_query },
 	{ "NAME", cmd_name },
@@ -791,6 +1225,11 @@ static struct command_func cmd_funcs[] = {
 	{ "ABORT", cmd_abort },
 	{ "MONITOR", cmd_monitor },
 	{ "MQLEN", cmd_mqlen },
+	{ "STAT", cmd_stat },
+	{ "EXCLUSIVE", cmd_exclusive },
+	{ "LIMIT", cmd_limit },
+	{ "LATENCY", cmd_latency },
+	{ "TRACE", cmd_trace },
 	{ "LOGON", cmd_logon },
 	{ "LOGOFF", cmd_logoff },
 	{ "SIGNAL", cmd_signal },
@@ -838,8 +1277,9 @@ _filter_args(struct skynet_context * context, int type, int *session, void ** da
 	}
 
 	if (needcopy && *data) {
-		/* 添加多一个 \0 的原因在于字符串形式的data 的 sz 可能是不包含 \0 在内的 */
-		char * msg = skynet_malloc(*sz+1);
+		/* 添加多一个 \0 的原因在于字符串形式的data 的 sz 可能是不包含 \0 在内的.
+		 * 复制的内存末尾自带队列节点, 推入本地服务的消息队列时不需要再分配内存. */
+		char * msg = skynet_mq_alloc(*sz);
 		memcpy(msg, *data, *sz);
 		msg[*sz] = '\0';
 		*data = msg;
@@ -861,7 +1301,7 @@ _filter_args(struct skynet_context * context, int type, int *session, void ** da
  * session 为消息的会话号, 为 0 时要求 type 包含 PTYPE_TAG_DONTCOPY 标记并进行会话号分配. *data 为消息内容, 注意点在上面描述.
  * sz 为消息内容大小, 不要超过 MESSAGE_TYPE_MASK .
  * 
- * 返回: 发送成功时返回会话号, 失败时返回 -1 . */
+ * 返回: 发送成功时返回会话号, 失败时返回 -1 , 目标服务的消息队列超出上限而拒绝时返回 -2 (参见 cmd_limit ). */
 int
 skynet_send(struct skynet_context * context, uint32_t source, uint32_t destination , int type, int session, void * data, size_t sz) {
 	if ((sz & MESSAGE_TYPE_MASK) != sz) {
@@ -872,6 +1312,8 @@ skynet_send(struct skynet_context * context, uint32_t source, uint32_t destinati
 		}
 		return -1;
 	}
+	/* 复制的消息内容由 skynet_mq_alloc 分配, 可以使用内容自带的节点入列 */
+	int inplace = !(type & PTYPE_TAG_DONTCOPY) && data;
 	_filter_args(context, type, &session, (void **)&data, &sz);
 
 	if (source == 0) {
@@ -898,12 +1340,13 @@ skynet_send(struct skynet_context * context, uint32_t source, uint32_t destinati
 		smsg.data = data;
 		smsg.sz = sz;
 		
-		if (skynet_context_push(destination, &smsg)) {
+		int err = context_send(destination, &smsg, inplace);
+		if (err) {
 			/* 当发送失败时, type 没有 PTYPE_TAG_DONTCOPY 标记则释放的就是复制后的内存,
 			 * 不然就是原始的 data 内存, 因而必须是堆内存. 从而得到结论如果需要复制消息,
 			 * 原始 data 将有调用者进行内存管理, 而不用复制时内存由 skynet 底层统一管理. */
 			skynet_free(data);
-			return -1;
+			return err;
 		}
 	}
 	return session;
@@ -924,7 +1367,7 @@ skynet_send(struct skynet_context * context, uint32_t source, uint32_t destinati
  * session 为消息的会话号, 为 0 时要求 type 包含 PTYPE_TAG_DONTCOPY 标记并进行会话号分配. *data 为消息内容, 注意点在上面描述.
  * sz 为消息内容大小, 不要超过 MESSAGE_TYPE_MASK .
  * 
- * 返回: 发送成功时返回会话号, 失败时返回 -1 . */
+ * 返回: 发送成功时返回会话号, 失败时返回 -1 , 被目标服务拒绝时返回 -2 . */
 int
 skynet_sendname(struct skynet_context * context, uint32_t source, const char * addr , int type, int session, void * data, size_t sz) {
 	if (source == 0) {
@@ -934,7 +1377,7 @@ skynet_sendname(struct skynet_context * context, uint32_t source, const char * a
 	if (addr[0] == ':') {
 		des = strtoul(addr+1, NULL, 16);
 	} else if (addr[0] == '.') {
-		des = skynet_handle_findname(addr + 1);
+		des = context_findname(context, addr + 1);
 		/* 如果服务不存在将失败 */
 		if (des == 0) {
 			/* 如果 type 带有 PTYPE_TAG_DONTCOPY 则 data 必须是堆内存, 才可以安全释放 */
@@ -13,13 +13,19 @@
 
 static struct socket_server * SOCKET_SERVER = NULL;
 
-/* 初始化套接字模块, 创建单例套接字服务器 */
+/* 初始化套接字模块, 创建单例套接字服务器, thread 为 socket 线程的数量 */
 void 
-skynet_socket_init() {
-	SOCKET_SERVER = socket_server_create();
+skynet_socket_init(int thread) {
+	SOCKET_SERVER = socket_server_create(thread);
 }
 
-/* 向套接字服务器发送退出命令, 这将导致主循环函数 skynet_socket_poll 返回 0 , 从而令 socket 线程退出,
+/* 返回 socket 线程的数量, 可能因为超出上限而少于配置的数量 */
+int
+skynet_socket_thread() {
+	return socket_server_thread(SOCKET_SERVER);
+}
+
+/* 向套接字服务器发送退出命令, 这将导致每条 socket 线程的主循环函数 skynet_socket_poll 返回 0 , 从而令 socket 线程退出,
  * 整个过程是一个异步的过程. 需要注意的是, 退出函数并没有销毁套接字服务器的内存. */
 void
 skynet_socket_exit() {
@@ -33,6 +39,18 @@ skynet_socket_free() {
 	SOCKET_SERVER = NULL;
 }
 
+/* 归还 SKYNET_SOCKET_TYPE_DATA 消息中的数据内容 buffer , sz 为消息中的 ud . 数据内容来自 socket 线程的接收缓冲池,
+ * 归还之后 socket 线程可以再次使用它而不必重新分配; 以 skynet_free 释放同样正确, 只是不会被再次使用.
+ * 其它类型的消息以及转交给其它模块的数据仍然应当以 skynet_free 释放. */
+void
+skynet_socket_free_buffer(void *buffer, int sz) {
+	if (SOCKET_SERVER == NULL) {
+		skynet_free(buffer);
+		return;
+	}
+	socket_server_free_buffer(SOCKET_SERVER, buffer, sz);
+}
+
 // mainloop thread
 /* 将套接字信息发送到对应的服务区, 消息内容及服务句柄都在 result 参数中. 消息内容分为填充的以及非填充的,
  * 可填充的信息内容是不需要释放的内存, 内容为字符串, 且其大小不应该超过 128 个字节; 不可填充的信息内容是需要释放的内存,
@@ -54,7 +72,7 @@ forward_message(int type, bool padding, struct socket_message * result) {
 			result->data = "";
 		}
 	}
-	sm = (struct skynet_socket_message *)skynet_malloc(sz);
+	sm = (struct skynet_socket_message *)skynet_mq_alloc(sz);
 	sm->type = type;
 	sm->id = result->id;
 	sm->ud = result->ud;
@@ -71,27 +89,31 @@ forward_message(int type, bool padding, struct socket_message * result) {
 	message.data = sm;
 	message.sz = sz | ((size_t)PTYPE_SOCKET << MESSAGE_TYPE_SHIFT);
 	
-	if (skynet_context_push((uint32_t)result->opaque, &message)) {
+	if (skynet_context_push_inplace((uint32_t)result->opaque, &message)) {
 		// todo: report somewhere to close socket
 		// don't call skynet_socket_close here (It will block mainloop)
-		skynet_free(sm->buffer);
+		if (type == SKYNET_SOCKET_TYPE_DATA) {
+			socket_server_free_buffer(SOCKET_SERVER, sm->buffer, sm->ud);
+		} else {
+			skynet_free(sm->buffer);
+		}
 		skynet_free(sm);
 	}
 }
 
-/* 套接字模块的主函数, 不断处理各种套接字命令和套接字 I/O 事件, 将处理的结果发送给对应的服务.
+/* 套接字模块的主函数, 编号为 thread 的 socket 线程不断以此处理属于它的套接字命令和套接字 I/O 事件, 将处理的结果发送给对应的服务.
  * 函数返回 0 表示需要退出套接字模块线程, 返回 -1 表示套接字模块处于忙碌状态, 返回 1 表示空闲的状态.
  * 检测是否忙碌是通过查看是否还有未执行完的套接字命令或者套接字 I/O 事件.
  *
- * 函数无参数
+ * 参数: thread 是 socket 线程的编号
  * 返回: 0 表示需要退出套接字模块线程; 1 表示空闲的状态; -1 表示套接字模块处于忙碌状态, 不应该打断; */
 int 
-skynet_socket_poll() {
+skynet_socket_poll(int thread) {
 	struct socket_server *ss = SOCKET_SERVER;
 	assert(ss);
 	struct socket_message result;
 	int more = 1;
-	int type = socket_server_poll(ss, &result, &more);
+	int type = socket_server_poll(ss, thread, &result, &more);
 	switch (type) {
 	case SOCKET_EXIT:
 		return 0;
@@ -21,10 +21,12 @@ struct skynet_socket_message {
 	char * buffer;      /* 当为 DATA 时表示数据内容, 其它情况下或者为 NULL 或者为错误信息等 */
 };
 
-void skynet_socket_init();
+void skynet_socket_init(int thread);
+int skynet_socket_thread();
 void skynet_socket_exit();
 void skynet_socket_free();
-int skynet_socket_poll();
+void skynet_socket_free_buffer(void *buffer, int sz);
+int skynet_socket_poll(int thread);
 
 int skynet_socket_send(struct skynet_context *ctx, int id, void *buffer, int sz);
 void skynet_socket_send_lowpriority(struct skynet_context *ctx, int id, void *buffer, int sz);
@@ -9,6 +9,9 @@
 #include "skynet_socket.h"
 #include "skynet_daemon.h"
 #include "skynet_harbor.h"
+#include "skynet_affinity.h"
+#include "skynet_park.h"
+#include "skynet_trace.h"
 
 #include <pthread.h>
 #include <unistd.h>
@@ -22,9 +25,6 @@
 struct monitor {
 	int count;                        /* 工作线程的数量 */
 	struct skynet_monitor ** m;       /* 所有工作线程的死循环监控对象指针数组 */
-	pthread_cond_t cond;              /* 唤醒工作线程的条件变量 */
-	pthread_mutex_t mutex;            /* 与条件变量相关联的互斥锁 */
-	int sleep;                        /* 睡眠的工作线程数量 */
 	int quit;                         /* 是否退出工作线程的标记, 0 为不退出, 1 为退出 */
 };
 
@@ -57,37 +57,25 @@ create_thread(pthread_t *thread, void *(*start_routine) (void *), void *arg) {
 	}
 }
 
-/* 以 busy 为活跃线程的下限(至少为 busy+1), 唤醒任意一条工作线程. */
-static void
-wakeup(struct monitor *m, int busy) {
-	if (m->sleep >= m->count - busy) {
-		// signal sleep worker, "spurious wakeup" is harmless
-		pthread_cond_signal(&m->cond);
-	}
-}
-
 /* socket 线程函数, 在初始化之后以阻塞方式等待 socket 事件(包括对 socket 模块发送命令), 直到有明确退出信号或者
- * 所有服务都已经退出. 此函数会保证至少有一条工作线程来处理到达的 socket 事件.
+ * 所有服务都已经退出. 到达的 socket 事件推入服务的消息队列时会唤醒停放的工作线程. 参数 p 指向线程的编号,
+ * 每条 socket 线程只处理属于自己的那部分套接字.
  * 必须说明的是, 虽然 socket 线程以阻塞方式等待 socket 事件, 但 socket 连接上的读写都是非阻塞的. */
 static void *
 thread_socket(void *p) {
-	struct monitor * m = p;
+	int id = *(int *)p;
+	skynet_affinity_bind(THREAD_SOCKET, id);
 	skynet_initthread(THREAD_SOCKET);
 	for (;;) {
 		/* 阻塞等待 socket 事件, 如果没有 socket 事件线程将一直阻塞,
 		   当返回值为 0 将退出此线程. 当返回值小于 0 表示信息不完整将检查服务状态,
-		   当服务都退出时退出此线程, 否则继续轮询. 当返回大于 0 时, 确保至少
-		   有一条工作线程来处理此消息. */
-		int r = skynet_socket_poll();
+		   当服务都退出时退出此线程, 否则继续轮询. */
+		int r = skynet_socket_poll(id);
 		if (r==0)
 			break;
 		if (r<0) {
 			CHECK_ABORT
-			/* [ck]为何此处需要 continue, 从而跳过 wakeup?
-			 * 当有大量连接时, 如果去唤醒工作线程, 将导致性能下降[/ck] */
-			continue;
 		}
-		wakeup(m,0);
 	}
 	return NULL;
 }
@@ -102,8 +90,6 @@ free_monitor(struct monitor *m) {
 	for (i=0;i<n;i++) {
 		skynet_monitor_delete(m->m[i]);
 	}
-	pthread_mutex_destroy(&m->mutex);
-	pthread_cond_destroy(&m->cond);
 	skynet_free(m->m);
 	skynet_free(m);
 }
@@ -114,6 +100,7 @@ thread_monitor(void *p) {
 	struct monitor * m = p;
 	int i;
 	int n = m->count;
+	skynet_affinity_bind(THREAD_MONITOR, 0);
 	skynet_initthread(THREAD_MONITOR);
 	for (;;) {
 		/* 此处检查所有服务是否退出的原因是当内层循环由于 break 退出时会运行到此处. */
@@ -145,18 +132,18 @@ signal_hup() {
 	}
 }
 
-/* 定时线程的函数, 在初始化之后以 2.5 毫秒的时间间隔更新定时器、触发定时事件、唤醒任意睡眠的工作线程
+/* 定时线程的函数, 在初始化之后睡眠到下一个定时器到期的时刻(最长 100 毫秒), 醒来后更新定时器、触发定时事件
  * 并且检查退出条件. 当退出时将通知 socket 线程和工作线程退出. */
 static void *
 thread_timer(void *p) {
 	struct monitor * m = p;
+	skynet_affinity_bind(THREAD_TIMER, 0);
 	skynet_initthread(THREAD_TIMER);
 	for (;;) {
-		/* 每运行四次将会更新一次时间, 因为时间单位是厘秒, 而运行间隔是 2.5 毫秒 */
+		/* 没有定时器到期时不会醒来, 注册了更早到期的定时器时会被提前唤醒 */
 		skynet_updatetime();
 		CHECK_ABORT
-		wakeup(m,m->count-1);
-		usleep(2500);
+		skynet_timer_wait();
 		if (SIG) {
 			signal_hup();
 			SIG = 0;
@@ -165,21 +152,16 @@ thread_timer(void *p) {
 	/* socket 线程有可能在阻塞等待 socket 事件而无法检查退出条件, 故需要唤醒 */
 	// wakeup socket thread
 	skynet_socket_exit();
-	/* 工作线程有可能因为等待条件变量而阻塞, 故需要全部唤醒. */
+	/* 工作线程有可能处于停放状态, 故需要全部唤醒. 先设置退出标记, 醒来的工作线程才会退出循环. */
 	// wakeup all worker thread
-	pthread_mutex_lock(&m->mutex);
-	/* 之所以将设置工作线程退出标记以及唤醒所有工作线程的工作放在同步块中执行,
-	   是为了防止与工作线程的条件等待产生竞争. 若不如此, 有可能唤醒消息发出之后那瞬间工作线程刚好处于
-	   条件等待之前, 这样工作线程就会错过唤醒消息而用于处于条件等待状态. */
 	m->quit = 1;
-	pthread_cond_broadcast(&m->cond);
-	pthread_mutex_unlock(&m->mutex);
+	skynet_park_exit();
 	return NULL;
 }
 
 /* 工作线程函数, 在初始化之后此函数在一个循环中每次依照自身的权重处理一条消息队列中的若干消息,
- * 并返回下一条消息队列供下一次循环处理. 当没有消息队列需要处理时就增加睡眠工作线程数量
- * 并以阻塞方式等待再次有需要处理的消息队列(实现为等待条件变量). 循环的退出条件是总监视对象的退出标记. */
+ * 并返回下一条消息队列供下一次循环处理. 当没有消息队列需要处理时就停放当前线程, 等待有消息队列推入全局队列时
+ * 被唤醒(参见 skynet_park 模块). 循环的退出条件是总监视对象的退出标记. */
 static void *
 thread_worker(void *p) {
 	struct worker_parm *wp = p;
@@ -187,63 +169,57 @@ thread_worker(void *p) {
 	int weight = wp->weight;
 	struct monitor *m = wp->m;
 	struct skynet_monitor *sm = m->m[id];
+	/* 先绑定 cpu 再绑定运行队列, 使运行队列迁移到工作线程所在的 numa 节点 */
+	int node = skynet_affinity_bind(THREAD_WORKER, id);
 	skynet_initthread(THREAD_WORKER);
+	skynet_globalmq_bind(id, node);
+	skynet_trace_bind(id);
+	skynet_timer_bind(id);
 	struct message_queue * q = NULL;
 	while (!m->quit) {
 		/* 处理 q 中的若干消息, 并返回下一条消息队列, 若没有了消息队列返回 NULL,
 		   调用分发函数同时会触发相应的无限循环监视. */
 		q = skynet_context_message_dispatch(sm, q, weight);
 		if (q == NULL) {
-			if (pthread_mutex_lock(&m->mutex) == 0) {
-				++ m->sleep;
-				/* 此处必须检查退出标记, 若不检查, 一旦进入阻塞等待状态将永远无法被唤醒.
-				   因为定时线程在设置完退出标记就退出了. */
-				// "spurious wakeup" is harmless,
-				// because skynet_context_message_dispatch() can be call at any time.
-				if (!m->quit)
-					pthread_cond_wait(&m->cond, &m->mutex);
-				-- m->sleep;
-				if (pthread_mutex_unlock(&m->mutex)) {
-					fprintf(stderr, "unlock mutex error");
-					exit(1);
-				}
-			}
+			/* 先自旋再睡眠, 全局队列中出现消息队列或者退出时返回.
+			   "spurious wakeup" is harmless, because skynet_context_message_dispatch() can be call at any time. */
+			skynet_park(id);
 		}
 	}
 	return NULL;
 }
 
 /* 当 skynet 的初始化完毕时, 调用此函数启动监视线程、定时线程、socket 线程和工作线程开始处理消息.
- * 只有当所有线程都停止工作之后, start 函数才会返回. 传入的参数为工作线程的数量. */
+ * 只有当所有线程都停止工作之后, start 函数才会返回. 参数 thread 为工作线程的数量,
+ * exclusive 为专用工作线程的数量, 它们的编号排在普通工作线程之后,
+ * adaptive 为 1 时所有工作线程都使用自适应的分发权重, 为 0 时使用静态的权重表. */
 static void
-start(int thread) {
-	pthread_t pid[thread+3];
+start(int thread, int exclusive, int adaptive) {
+	int total = thread + exclusive;
+	int nsocket = skynet_socket_thread();
+	pthread_t pid[total+2+nsocket];
+	int sid[nsocket];
 
 	/* 初始化总监控对象 */
 	struct monitor *m = skynet_malloc(sizeof(*m));
 	memset(m, 0, sizeof(*m));
-	m->count = thread;
-	m->sleep = 0;
+	m->count = total;
 
-	/* 为每条工作线程分配一个监控对象, 并初始化互斥锁和条件变量 */
-	m->m = skynet_malloc(thread * sizeof(struct skynet_monitor *));
+	/* 为每条工作线程(包括专用工作线程)分配一个监控对象, 并初始化停放状态 */
+	m->m = skynet_malloc(total * sizeof(struct skynet_monitor *));
 	int i;
-	for (i=0;i<thread;i++) {
+	for (i=0;i<total;i++) {
 		m->m[i] = skynet_monitor_new();
 	}
-	if (pthread_mutex_init(&m->mutex, NULL)) {
-		fprintf(stderr, "Init mutex error");
-		exit(1);
-	}
-	if (pthread_cond_init(&m->cond, NULL)) {
-		fprintf(stderr, "Init cond error");
-		exit(1);
-	}
+	skynet_park_init(thread, exclusive);
 
 	/* 创建所有线程, 创建的先后顺序影响不大. */
 	create_thread(&pid[0], thread_monitor, m);
 	create_thread(&pid[1], thread_timer, m);
-	create_thread(&pid[2], thread_socket, m);
+	for (i=0;i<nsocket;i++) {
+		sid[i] = i;
+		create_thread(&pid[total+2+i], thread_socket, &sid[i]);
+	}
 
     /* 权重值为负数每次处理消息队列中一条消息就转到下一条消息队列,
        为 0 会将当前消息队列中所有消息处理掉, 1 则相应减半, 2 则为 1/4, 3 为 1/8.
@@ -255,21 +231,30 @@ start(int thread) {
 		1, 1, 1, 1, 1, 1, 1, 1,
 		2, 2, 2, 2, 2, 2, 2, 2,
 		3, 3, 3, 3, 3, 3, 3, 3, };
-	struct worker_parm wp[thread];
+	struct worker_parm wp[total];
 	for (i=0;i<thread;i++) {
 		wp[i].m = m;
 		wp[i].id = i;
 		/* 确保当 thread 多于 weight 数组长度时不会溢出 */
-		if (i < sizeof(weight)/sizeof(weight[0])) {
+		if (adaptive) {
+			wp[i].weight = WEIGHT_ADAPTIVE;
+		} else if (i < sizeof(weight)/sizeof(weight[0])) {
 			wp[i].weight= weight[i];
 		} else {
 			wp[i].weight = 0;
 		}
-		create_thread(&pid[i+3], thread_worker, &wp[i]);
+		create_thread(&pid[i+2], thread_worker, &wp[i]);
+	}
+	/* 专用工作线程只处理独占它的服务, 总是一次处理完队列中的所有消息 */
+	for (;i<total;i++) {
+		wp[i].m = m;
+		wp[i].id = i;
+		wp[i].weight = 0;
+		create_thread(&pid[i+2], thread_worker, &wp[i]);
 	}
 
 	/* 等待上面所创建的线程退出, 也意味着整个系统退出. */
-	for (i=0;i<thread+3;i++) {
+	for (i=0;i<total+2+nsocket;i++) {
 		pthread_join(pid[i], NULL);
 	}
 
@@ -306,6 +291,18 @@ skynet_start(struct skynet_config * config) {
 	sigfillset(&sa.sa_mask);
 	sigaction(SIGHUP, &sa, NULL);
 
+	/* 在启动任何服务之前检查分发策略和 cpu 绑定的配置 */
+	int adaptive = 0;
+	if (strcmp(config->dispatch, "adaptive") == 0) {
+		adaptive = 1;
+	} else if (strcmp(config->dispatch, "static") != 0) {
+		fprintf(stderr, "Invalid dispatch policy %s\n", config->dispatch);
+		exit(1);
+	}
+	if (skynet_affinity_init(config)) {
+		exit(1);
+	}
+
 	if (config->daemon) {
 		if (daemon_init(config->daemon)) {
 			exit(1);
@@ -314,11 +311,12 @@ skynet_start(struct skynet_config * config) {
 
 	/* 初始化各个组件单例对象 */
 	skynet_harbor_init(config->harbor);
-	skynet_handle_init(config->harbor);
-	skynet_mq_init();
+	skynet_handle_init(config->harbor, config->namecache);
+	skynet_mq_init(config->thread, config->exclusive);
+	skynet_trace_init(config->thread + config->exclusive, config->trace);
 	skynet_module_init(config->module_path);
-	skynet_timer_init();
-	skynet_socket_init();
+	skynet_timer_init(config->thread + config->exclusive, config->timer_tick, config->timer_coalesce);
+	skynet_socket_init(config->socket_thread);
 
 	struct skynet_context *ctx = skynet_context_new(config->logservice, config->logger);
 	if (ctx == NULL) {
@@ -330,7 +328,7 @@ skynet_start(struct skynet_config * config) {
 	bootstrap(ctx, config->bootstrap);
 
 	/* 启动线程来处理 socket 事件、定时任务和服务间发送的消息 */
-	start(config->thread);
+	start(config->thread, config->exclusive, adaptive);
 
 	/* [ck]虽然此时 socket 线程已经退出, 也不会再等待 socket 事件了,[/ck]
 	   但是 struct socket_server 对象还没有被销毁, 依然可以给它发消息, 一旦此对象销毁了
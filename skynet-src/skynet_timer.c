@@ -5,12 +5,16 @@
 #include "skynet_server.h"
 #include "skynet_handle.h"
 #include "spinlock.h"
+#include "atomic.h"
 
 #include <time.h>
+#include <pthread.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
 
 #if defined(__APPLE__)
 #include <sys/time.h>
@@ -26,16 +30,123 @@ typedef void (*timer_execute_func)(void *ud,void *arg);
 #define TIME_NEAR_MASK (TIME_NEAR-1)
 #define TIME_LEVEL_MASK (TIME_LEVEL-1)
 
+/* 定时线程最长的睡眠时间, 单位毫秒. 即便没有任何定时器, 定时线程也会以此间隔醒来检查退出条件和信号,
+ * 并作为唤醒工作线程的保底手段. */
+#define TIME_IDLE_WAIT 100
+
+/* 定时器的精度, 即时间轮每一格(以下称为一个滴答)的毫秒数, 可选 1 毫秒或者 10 毫秒(默认) */
+#define TIME_TICK_MS 1
+#define TIME_TICK_CS 10
+
+/* 定时器距离现在的最大滴答数. 触发时间与当前时间之差以 32 位有符号数比较, 更远的定时器截断为此值 */
+#define TIME_MAX_TICK 0x7fffffff
+
+/* 缓存行大小, 用于隔开各个收件箱 */
+#define CACHE_LINE_SIZE 64
+
+/* 取消表的分片数量, 为 2 的幂 */
+#define CANCEL_SHARD 64
+/* 取消表每个分片的起始桶数量 */
+#define CANCEL_BUCKET 64
+
+/* 节点池中一个页的大小, 不大于系统的内存页. 页从以 mmap 申请的 chunk 中切分, 因而页的地址以此对齐 */
+#define TIMER_SLAB_SIZE 4096
+/* 每个 chunk 的页数, 第一页存放 chunk 的头部, 其余的页交给节点池 */
+#define TIMER_CHUNK_PAGES 64
+#define TIMER_CHUNK_SIZE (TIMER_CHUNK_PAGES * TIMER_SLAB_SIZE)
+
+/* 合并分发时暂存到期事件的数组的起始容量 */
+#define EXPIRED_INIT 64
+
+/* 定时触发节点的状态. 注册定时器的线程在压入收件箱之前将其置为 TIMER_QUEUED , 经由收件箱的原子比较交换发布给定时线程,
+ * 此后只由定时线程读写 */
+#define TIMER_QUEUED 0      /* 还在收件箱中 */
+#define TIMER_LINKED 1      /* 在某条触发列表中 */
+#define TIMER_DETACHED 2    /* 已经到期并从触发列表中取出, 但因为已被取消而没有分发, 等待处理取消请求时释放 */
+#define TIMER_DEAD 3        /* 还在收件箱中就处理了取消请求, 取出时直接释放 */
+
 /* 待触发的定时器事件, 将被放在 struct timer_node 毗邻的后面 */
 struct timer_event {
 	uint32_t handle;    /* 定时器通知的服务句柄 */
 	int session;        /* 定时器通知的服务中的唯一消息标识 */
 };
 
+/* 合并分发时暂存的一个到期定时事件 */
+struct timer_expired {
+	uint32_t handle;    /* 定时器通知的服务句柄 */
+	int session;        /* 定时器的会话号 */
+	int seq;            /* 在触发列表中的次序, 排序后同一服务的会话号仍然保持到期的先后顺序 */
+};
+
+struct link_list;
+
 /* 定时触发节点结构体, 在结构体毗邻处紧接着定时事件结构 */
 struct timer_node {
 	struct timer_node *next;     /* 处于列表中下一个触发节点指针, 如果没有时为 NULL */
-	uint32_t expire;             /* 触发时间, 单位是厘秒, 如果距离系统启动超过 0xffffffff (497 天)会发生回绕 */
+	struct timer_node *prev;     /* 处于列表中上一个触发节点指针, 用于取消时从列表中摘除 */
+	struct link_list *list;      /* 所在的触发列表 */
+	struct timer_node *link;     /* 在取消表中时为同一个桶的下一个节点, 被取消后为取消请求栈中的下一个节点 */
+	uint32_t expire;             /* 触发时间, 单位是滴答, 如果距离系统启动超过 0xffffffff 个滴答(厘秒精度下为 497 天)会发生回绕 */
+	int state;                   /* 节点的状态, 为 TIMER_QUEUED 等值之一, 是否已被取消则取决于节点是否还在取消表中 */
+	int owner;                   /* 节点所属节点池的收件箱编号, 为 0 时节点单独分配, 不属于任何节点池 */
+};
+
+/* 节点连同毗邻的定时事件的大小 */
+#define TIMER_NODE_SIZE (sizeof(struct timer_node) + sizeof(struct timer_event))
+
+/* 节点池向系统申请内存的单位, 以 mmap 直接申请, 不经过 skynet_malloc , 因而不计入任何服务的内存统计,
+ * 由 skynet_timer_memory 单独统计. 一个 chunk 切分为 TIMER_CHUNK_PAGES 个页, 所有节点池共用, 还有空闲页的 chunk
+ * 以双向链表相连. 所有的页都归还之后 chunk 归还给系统, 但至少保留一个有空闲页的 chunk . */
+struct timer_chunk {
+	struct timer_chunk *prev;    /* 上一个有空闲页的 chunk */
+	struct timer_chunk *next;    /* 下一个有空闲页的 chunk */
+	struct timer_slab *free;     /* 空闲的页, 以 next 相连 */
+	int used;                    /* 交给节点池的页数 */
+};
+
+/* 节点池中的一个页, 页首是页头, 其后排满节点. 还有空闲节点的页以双向链表挂在所属的收件箱上. */
+struct timer_slab {
+	struct timer_slab *prev;     /* 节点池中上一个有空闲节点的页 */
+	struct timer_slab *next;     /* 节点池中下一个有空闲节点的页, 空闲的页在 chunk 中以此相连 */
+	struct timer_chunk *chunk;   /* 页所在的 chunk */
+	struct timer_node *free;     /* 页中的空闲节点, 以 next 相连 */
+	int idle;                    /* 空闲节点的数量 */
+};
+
+/* 一个页中的节点数量 */
+#define TIMER_SLAB_NODES ((int)((TIMER_SLAB_SIZE - sizeof(struct timer_slab)) / TIMER_NODE_SIZE))
+
+/* 定时器收件箱, 是两个多生产者单消费者的无锁栈. 注册定时器的线程将节点压入 head 栈中, 取消定时器的线程将节点压入 cancel 栈中,
+ * 定时线程每次更新时间前取走所有收件箱中的节点并加入触发列表集, 然后处理取消请求.
+ * 每条工作线程有自己的收件箱, 其它线程共用一个收件箱.
+ *
+ * 工作线程的收件箱还带有一个节点池: 节点以页为单位从 chunk 中取得, 由所属的工作线程从 pool 中取用.
+ * 定时线程每次睡眠前把释放的节点直接放回各自的页中, 节点池正被工作线程使用时则压入 free 栈, 留给之后加锁成功的一方.
+ * 节点全部空闲的页归还给 chunk , 但每个节点池至少保留一个页, 直到所属的工作线程在定时线程的两次睡眠之间没有注册过定时器,
+ * 因而不再注册定时器的工作线程的页也会由定时线程归还.
+ * 共用的收件箱没有节点池, 节点直接由分配器分配和释放. */
+struct timer_inbox {
+	struct timer_node *head;     /* 新注册的节点的栈顶, 节点以 next 相连, 后压入的在前 */
+	struct timer_node *cancel;   /* 被取消的节点的栈顶, 节点以 link 相连 */
+	struct timer_node *free;     /* 定时线程未能直接放回的节点的栈顶, 节点以 next 相连 */
+	struct timer_slab *pool;     /* 有空闲节点的页, 受 lock 保护 */
+	struct spinlock lock;        /* 保护节点池, 几乎只由所属的工作线程获取, 定时线程只尝试加锁 */
+	int active;                  /* 定时线程上一次归还节点之后是否从节点池中取用过节点, 受 lock 保护 */
+	char padding[CACHE_LINE_SIZE - (4 * sizeof(struct timer_node *) + sizeof(struct spinlock) + sizeof(int)) % CACHE_LINE_SIZE];
+};
+
+/* 定时线程释放的节点先按所属的节点池暂存起来, 每次睡眠前整批归还, 每个节点池只需一次原子操作 */
+struct timer_reclaim {
+	struct timer_node *head;
+	struct timer_node *tail;
+};
+
+/* 取消表的一个分片, 以 (服务地址, 会话号) 为键索引所有尚未分发的定时器, 用于以会话号取消定时器 */
+struct cancel_shard {
+	struct spinlock lock;
+	int size;                    /* 桶的数量, 为 2 的幂 */
+	int count;                   /* 节点的数量 */
+	struct timer_node **bucket;  /* 桶数组, 节点以 link 相连 */
 };
 
 /* 定时触发列表结构体 */
@@ -44,7 +155,8 @@ struct link_list {
 	struct timer_node *tail;     /* 定时触发的尾部指针, 初始化是为 head 地址 */
 };
 
-/* 定时器管理器结构. near 为最近的触发列表集, 触发时间在距离现在 0 ~ 0xFF 厘秒之间, 每个节点相距 1 厘秒, 共 0x100 个节点
+/* 定时器管理器结构. 以下的时间单位都是滴答, 默认精度下一个滴答为 1 厘秒.
+ * near 为最近的触发列表集, 触发时间在距离现在 0 ~ 0xFF 厘秒之间, 每个节点相距 1 厘秒, 共 0x100 个节点
  * t 为 4 级依次变远的触发列表集, 第一级列表集的触发时间在 0x100 ~ 0x3FFF 厘秒之间, 每个节点相距 0x100 厘秒, 共 0x40 个节点.
  * 第二级列表集的触发时间在距离现在 0x4000 ~ 0xFFFFF 厘秒之间, 每个节点相距 0x4000 厘秒, 共 0x40 个节点.
  * 第三级列表集的触发时间在距离现在 0x100000 ~ 0x3FFFFFF 厘秒之间, 每个节点相距 0x100000 厘秒, 共 0x40 个节点.
@@ -53,14 +165,31 @@ struct link_list {
  * 具体需要参考 add_node 函数. */
 struct timer {
 	struct link_list near[TIME_NEAR];    /* 最近的触发列表集 */
-	struct link_list t[4][TIME_LEVEL];   /* 依次变远的层级触发列表集 */
-	struct spinlock lock;      /* 当前定时器的自旋锁, 在多线程情况下注册定时事件与触发定时事件是需要加锁 */
-	uint32_t time;             /* 当前时间, 单位厘秒, 是触发定时事件的依据, 与 current 的区别在于 time 的初始值是 0,
-	                              而 current 的初始值与墙上时钟有关, time 每次只增加 1 厘秒, 并且伴随着定时事件触发,
-	                              具体参见 timer_shift 函数 */
+	struct link_list t[4][TIME_LEVEL];   /* 依次变远的层级触发列表集, 与最近触发列表集一样只由定时线程访问 */
+	int inbox_count;           /* 收件箱的数量, 为工作线程数量加 1 */
+	int chunk_count;           /* 向系统申请的 chunk 的数量, 以原子方式增减 */
+	struct spinlock chunk_lock;	/* 保护 chunk 链表 */
+	struct timer_chunk *chunk; /* 有空闲页的 chunk 链表 */
+	struct timer_inbox *inbox; /* 收件箱数组, 第 0 个由非工作线程共用, 第 i + 1 个属于编号为 i 的工作线程 */
+	struct timer_reclaim *reclaim;	/* 每个收件箱一项, 定时线程暂存待归还的节点 */
+	pthread_key_t inbox_key;   /* 保存当前线程的收件箱编号的线程特定数据键 */
+	struct cancel_shard cancel[CANCEL_SHARD];	/* 取消表, 以服务地址和会话号的哈希值分片 */
+	int tick;                  /* 一个滴答的毫秒数, 为 TIME_TICK_MS 或者 TIME_TICK_CS */
+	int coalesce;              /* 是否合并分发, 开启时同一滴答内到期的属于同一服务的定时事件合并为一条 PTYPE_TIMER 消息 */
+	int expired_count;         /* 合并分发时暂存的到期事件数量 */
+	int expired_cap;           /* 暂存数组的容量 */
+	struct timer_expired *expired;	/* 暂存数组, 只由定时线程访问 */
+	uint32_t time;             /* 当前时间, 单位滴答, 是触发定时事件的依据, 初始值是 0, time 每次只增加 1 个滴答,
+	                              并且伴随着定时事件触发, 具体参见 timer_shift 函数 */
 	uint32_t starttime;        /* 系统启动时间点, 单位秒 */
-	uint64_t current;          /* 当前时间, 单位厘秒, 与 starttime 一起构成了墙上时钟 */
-	uint64_t current_point;    /* 当前时间的精确时间戳, 单位厘秒, 不会回绕, 用于计算系统运行时间 */
+	uint64_t origin;           /* 启动时 gettime 的时间戳减去启动时刻不足一秒的毫秒数, 单位毫秒.
+	                              gettime 与它的差值即是当前时间, 与 starttime 一起构成了墙上时钟 */
+	uint64_t current_point;    /* 当前时间的精确时间戳, 单位滴答, 不会回绕, 用于计算系统运行时间 */
+	uint32_t deadline;         /* 定时线程计划醒来的时间, 与 time 的单位及起点相同.
+	                              注册的定时器早于此时间时需要提前唤醒定时线程 */
+	int interrupt;             /* 是否有提前唤醒定时线程的请求, 受 mutex 保护 */
+	pthread_mutex_t mutex;     /* 与 cond 相关联的互斥锁 */
+	pthread_cond_t cond;       /* 定时线程睡眠等待的条件变量 */
 };
 
 static struct timer * TI = NULL;
@@ -80,11 +209,90 @@ link_clear(struct link_list *list) {
 /* 将一个定时触发节点添加到定时触发列表的尾部. 此函数是非线程安全的. */
 static inline void
 link(struct link_list *list,struct timer_node *node) {
+	node->prev = list->tail;
+	node->list = list;
 	list->tail->next = node;
 	list->tail = node;
 	node->next=0;
 }
 
+/* 将一个定时触发节点从它所在的触发列表中摘除. 此函数是非线程安全的. */
+static inline void
+unlink_node(struct timer_node *node) {
+	struct link_list *list = node->list;
+	node->prev->next = node->next;
+	if (node->next) {
+		node->next->prev = node->prev;
+	} else {
+		list->tail = node->prev;
+	}
+}
+
+/* 计算服务地址与会话号的哈希值, 低位用于选择取消表的分片, 高位用于选择分片中的桶 */
+static inline uint32_t
+cancel_hash(uint32_t handle, int session) {
+	uint32_t h = handle * 2654435761u ^ (uint32_t)session * 2246822519u;
+	return h ^ (h >> 15);
+}
+
+/* 将节点加入取消表, 桶的平均长度超过 2 时扩容 */
+static void
+cancel_insert(struct timer *T, struct timer_node *node) {
+	struct timer_event *event = (struct timer_event *)(node+1);
+	uint32_t h = cancel_hash(event->handle, event->session);
+	struct cancel_shard *shard = &T->cancel[h & (CANCEL_SHARD-1)];
+	h /= CANCEL_SHARD;
+	spinlock_lock(&shard->lock);
+	if (shard->count >= shard->size * 2) {
+		int size = shard->size * 2;
+		struct timer_node **bucket = skynet_malloc(size * sizeof(struct timer_node *));
+		memset(bucket, 0, size * sizeof(struct timer_node *));
+		int i;
+		for (i=0;i<shard->size;i++) {
+			struct timer_node *n = shard->bucket[i];
+			while (n) {
+				struct timer_node *next = n->link;
+				struct timer_event *e = (struct timer_event *)(n+1);
+				int b = (cancel_hash(e->handle, e->session) / CANCEL_SHARD) & (size-1);
+				n->link = bucket[b];
+				bucket[b] = n;
+				n = next;
+			}
+		}
+		skynet_free(shard->bucket);
+		shard->bucket = bucket;
+		shard->size = size;
+	}
+	struct timer_node **b = &shard->bucket[h & (shard->size-1)];
+	node->link = *b;
+	*b = node;
+	++shard->count;
+	spinlock_unlock(&shard->lock);
+}
+
+/* 从取消表中移除服务地址为 handle 且会话号为 session 的节点. target 不为 NULL 时只移除这个节点并返回它,
+ * 为 NULL 时移除匹配的任意一个节点. 找不到时返回 NULL . */
+static struct timer_node *
+cancel_remove(struct timer *T, uint32_t handle, int session, struct timer_node *target) {
+	uint32_t h = cancel_hash(handle, session);
+	struct cancel_shard *shard = &T->cancel[h & (CANCEL_SHARD-1)];
+	h /= CANCEL_SHARD;
+	spinlock_lock(&shard->lock);
+	struct timer_node **pp = &shard->bucket[h & (shard->size-1)];
+	struct timer_node *node;
+	while ((node = *pp) != NULL) {
+		struct timer_event *event = (struct timer_event *)(node+1);
+		if (target ? node == target : (event->handle == handle && event->session == session)) {
+			*pp = node->link;
+			--shard->count;
+			break;
+		}
+		pp = &node->link;
+	}
+	spinlock_unlock(&shard->lock);
+	return node;
+}
+
 /* 根据触发节点的触发时间距离现在的远近, 将其添加到定时器管理器的最近触发列表集或者层级触发列表集的某条触发列表中.
  * 参数 T 为定时器管理器, node 为触发节点.
  * 
@@ -125,21 +333,328 @@ add_node(struct timer *T,struct timer_node *node) {
 	}
 }
 
-/* 分配内存并构造一个定时触发节点, 并添加到定时器管理器中, 添加算法参见 add_node 函数.
+/* 由节点池中的节点找到它所在的页 */
+static inline struct timer_slab *
+slab_of(struct timer_node *node) {
+	return (struct timer_slab *)((uintptr_t)node & ~(uintptr_t)(TIMER_SLAB_SIZE - 1));
+}
+
+/* 将页挂到节点池的链表头部 */
+static inline void
+slab_link(struct timer_inbox *inbox, struct timer_slab *slab) {
+	slab->prev = NULL;
+	slab->next = inbox->pool;
+	if (inbox->pool) {
+		inbox->pool->prev = slab;
+	}
+	inbox->pool = slab;
+}
+
+/* 将页从节点池的链表中摘除 */
+static inline void
+slab_unlink(struct timer_inbox *inbox, struct timer_slab *slab) {
+	if (slab->prev) {
+		slab->prev->next = slab->next;
+	} else {
+		inbox->pool = slab->next;
+	}
+	if (slab->next) {
+		slab->next->prev = slab->prev;
+	}
+}
+
+/* 将 chunk 挂到有空闲页的链表头部. 调用者持有 chunk_lock . */
+static inline void
+chunk_link(struct timer *T, struct timer_chunk *chunk) {
+	chunk->prev = NULL;
+	chunk->next = T->chunk;
+	if (T->chunk) {
+		T->chunk->prev = chunk;
+	}
+	T->chunk = chunk;
+}
+
+/* 将 chunk 从有空闲页的链表中摘除. 调用者持有 chunk_lock . */
+static inline void
+chunk_unlink(struct timer *T, struct timer_chunk *chunk) {
+	if (chunk->prev) {
+		chunk->prev->next = chunk->next;
+	} else {
+		T->chunk = chunk->next;
+	}
+	if (chunk->next) {
+		chunk->next->prev = chunk->prev;
+	}
+}
+
+/* 从 chunk 中取一个空闲页, 没有时向系统申请一个新的 chunk . 将页中的节点全部串到页的空闲链表中, 节点属于编号为 owner 的节点池.
+ * 此函数是线程安全的. */
+static struct timer_slab *
+slab_new(struct timer *T, int owner) {
+	spinlock_lock(&T->chunk_lock);
+	struct timer_chunk *chunk = T->chunk;
+	if (chunk == NULL) {
+		chunk = mmap(NULL, TIMER_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (chunk == MAP_FAILED) {
+			fprintf(stderr, "mmap timer chunk failed");
+			exit(1);
+		}
+		ATOM_INC(&T->chunk_count);
+		chunk->free = NULL;
+		chunk->used = 0;
+		int i;
+		for (i=TIMER_CHUNK_PAGES-1;i>0;i--) {
+			struct timer_slab *s = (struct timer_slab *)((char *)chunk + i * TIMER_SLAB_SIZE);
+			s->chunk = chunk;
+			s->next = chunk->free;
+			chunk->free = s;
+		}
+		chunk_link(T, chunk);
+	}
+	struct timer_slab *slab = chunk->free;
+	chunk->free = slab->next;
+	if (++chunk->used == TIMER_CHUNK_PAGES - 1) {
+		chunk_unlink(T, chunk);
+	}
+	spinlock_unlock(&T->chunk_lock);
+
+	char *base = (char *)(slab + 1);
+	slab->free = NULL;
+	int i;
+	for (i=TIMER_SLAB_NODES-1;i>=0;i--) {
+		struct timer_node *n = (struct timer_node *)(base + i * TIMER_NODE_SIZE);
+		n->owner = owner;
+		n->next = slab->free;
+		slab->free = n;
+	}
+	slab->idle = TIMER_SLAB_NODES;
+	return slab;
+}
+
+/* 将一个全部空闲的页归还给所在的 chunk . chunk 的页全部归还之后归还给系统, 除非它是仅有的有空闲页的 chunk .
+ * 此函数是线程安全的. */
+static void
+slab_delete(struct timer *T, struct timer_slab *slab) {
+	struct timer_chunk *chunk = slab->chunk;
+	spinlock_lock(&T->chunk_lock);
+	if (chunk->used == TIMER_CHUNK_PAGES - 1) {
+		chunk_link(T, chunk);
+	}
+	slab->next = chunk->free;
+	chunk->free = slab;
+	if (--chunk->used == 0 && (chunk->prev || chunk->next)) {
+		chunk_unlink(T, chunk);
+		spinlock_unlock(&T->chunk_lock);
+		munmap(chunk, TIMER_CHUNK_SIZE);
+		ATOM_DEC(&T->chunk_count);
+		return;
+	}
+	spinlock_unlock(&T->chunk_lock);
+}
+
+/* 把以 next 相连的节点放回各自的页中. 节点全部空闲的页归还给 chunk , 除非它是节点池中仅有的页.
+ * 调用者持有收件箱的 lock . */
+static void
+slab_reclaim(struct timer *T, struct timer_inbox *inbox, struct timer_node *node) {
+	while (node) {
+		struct timer_node *next = node->next;
+		struct timer_slab *slab = slab_of(node);
+		if (slab->idle == 0) {
+			slab_link(inbox, slab);
+		}
+		node->next = slab->free;
+		slab->free = node;
+		if (++slab->idle == TIMER_SLAB_NODES && (slab->prev || slab->next)) {
+			slab_unlink(inbox, slab);
+			slab_delete(T, slab);
+		}
+		node = next;
+	}
+}
+
+/* 从编号为 owner 的收件箱的节点池中取出一个节点. 先取回 free 栈中的节点, 节点池中没有空闲节点时取一个新的页.
+ * 只能由收件箱所属的线程调用; 共用的收件箱直接分配. */
+static struct timer_node *
+node_alloc(struct timer *T, int owner) {
+	struct timer_node *node;
+	if (owner == 0) {
+		node = skynet_malloc(TIMER_NODE_SIZE);
+		node->owner = 0;
+		return node;
+	}
+	struct timer_inbox *inbox = &T->inbox[owner];
+	spinlock_lock(&inbox->lock);
+	if (ATOM_LOAD(&inbox->free)) {
+		slab_reclaim(T, inbox, ATOM_XCHG(&inbox->free, NULL));
+	}
+	struct timer_slab *slab = inbox->pool;
+	if (slab == NULL) {
+		slab = slab_new(T, owner);
+		slab_link(inbox, slab);
+	}
+	node = slab->free;
+	slab->free = node->next;
+	if (--slab->idle == 0) {
+		slab_unlink(inbox, slab);
+	}
+	inbox->active = 1;
+	spinlock_unlock(&inbox->lock);
+	return node;
+}
+
+/* 释放一个节点. 属于节点池的节点暂存到 reclaim 中, 由 timer_reclaim 归还. 只能在定时线程中调用. */
+static inline void
+node_free(struct timer *T, struct timer_node *node) {
+	if (node->owner == 0) {
+		skynet_free(node);
+		return;
+	}
+	struct timer_reclaim *r = &T->reclaim[node->owner];
+	node->next = r->head;
+	if (r->head == NULL) {
+		r->tail = node;
+	}
+	r->head = node;
+}
+
+/* 将暂存的节点整批归还给各自的节点池. 能够加锁时直接放回各自的页中, 并一同处理 free 栈, 这样不再注册定时器的工作线程
+ * 的空闲页也能归还; 节点池正被工作线程使用时压入 free 栈. 上一次归还之后没有取用过节点的节点池, 连最后一个空闲页也归还.
+ * 只能在定时线程中调用. */
+static void
+timer_reclaim(struct timer *T) {
+	int i;
+	for (i=1;i<T->inbox_count;i++) {
+		struct timer_reclaim *r = &T->reclaim[i];
+		struct timer_inbox *inbox = &T->inbox[i];
+		if (r->head == NULL && ATOM_LOAD(&inbox->free) == NULL && ATOM_LOAD(&inbox->pool) == NULL) {
+			continue;
+		}
+		if (spinlock_trylock(&inbox->lock)) {
+			slab_reclaim(T, inbox, r->head);
+			if (inbox->free) {
+				slab_reclaim(T, inbox, ATOM_XCHG(&inbox->free, NULL));
+			}
+			struct timer_slab *slab = inbox->pool;
+			if (!inbox->active && slab && slab->next == NULL && slab->idle == TIMER_SLAB_NODES) {
+				slab_unlink(inbox, slab);
+				slab_delete(T, slab);
+			}
+			inbox->active = 0;
+			spinlock_unlock(&inbox->lock);
+		} else if (r->head) {
+			struct timer_node *head;
+			do {
+				head = inbox->free;
+				r->tail->next = head;
+			} while (!ATOM_CAS_POINTER(&inbox->free, head, r->head));
+		}
+		r->head = NULL;
+		r->tail = NULL;
+	}
+}
+
+/* 从当前线程的节点池中取出一个定时触发节点, 加入取消表后压入当前线程的收件箱, 由定时线程在下一次更新时间前加入触发列表集.
+ * 压入收件箱不需要加锁, 各条工作线程之间以及与定时线程之间不会竞争; 取消表是分片加锁的, 只有恰好落在同一个分片时才会竞争.
  * 参数 T 为定时器管理器, arg 为定时器事件, sz 为定时器事件结构的大小, time 为触发时间距离现在的距离.
  * 此函数是线程安全的. */
 static void
 timer_add(struct timer *T,void *arg,size_t sz,int time) {
-	struct timer_node *node = (struct timer_node *)skynet_malloc(sizeof(*node)+sz);
+	assert(sz == sizeof(struct timer_event));
+	int owner = (int)(uintptr_t)pthread_getspecific(T->inbox_key);
+	struct timer_node *node = node_alloc(T, owner);
 	memcpy(node+1,arg,sz);
+	node->state = TIMER_QUEUED;
+	cancel_insert(T, node);
 
-	SPIN_LOCK(T);
+	/* 当前时间在节点加入触发列表集之前可能已经前进, 由 timer_drain 修正 */
+	node->expire=time+ATOM_LOAD(&T->time);
+	struct timer_inbox *inbox = &T->inbox[owner];
+	struct timer_node *head;
+	do {
+		head = inbox->head;
+		node->next = head;
+	} while (!ATOM_CAS_POINTER(&inbox->head, head, node));
 
-	/* 读取管理器中的当前时间和操作触发列表集都是非线程安全的, 因而需要在同步块中执行. */
-	node->expire=time+T->time;
-	add_node(T,node);
+	/* 触发时间早于定时线程计划醒来的时间, 需要提前唤醒它. 定时线程醒着的时候 deadline 不会晚于 time , 所以不会唤醒.
+	 * 压栈的原子操作是完整的内存屏障, 与 skynet_timer_wait 中先写 deadline 再检查收件箱相配合,
+	 * 保证定时线程要么在睡眠前看到这个节点, 要么此处读到它计划醒来的时间. */
+	int early = (int32_t)(node->expire - ATOM_LOAD(&T->deadline)) < 0;
+
+	if (early) {
+		pthread_mutex_lock(&T->mutex);
+		T->interrupt = 1;
+		pthread_cond_signal(&T->cond);
+		pthread_mutex_unlock(&T->mutex);
+	}
+}
 
-	SPIN_UNLOCK(T);
+/* 处理一个被取消的节点, 将其从触发列表中摘除并释放. 取消请求与注册请求可能在不同的收件箱中,
+ * 还没有取出的节点标记为 TIMER_DEAD , 取出时再释放. 只能在定时线程中调用. */
+static void
+timer_reap(struct timer *T, struct timer_node *node) {
+	switch (node->state) {
+	case TIMER_LINKED:
+		unlink_node(node);
+		node_free(T, node);
+		break;
+	case TIMER_DETACHED:
+		node_free(T, node);
+		break;
+	case TIMER_QUEUED:
+		node->state = TIMER_DEAD;
+		break;
+	}
+}
+
+/* 取走所有收件箱中的节点并加入触发列表集, 再处理所有取消请求, 返回取到的节点数量. 同一个收件箱中的节点按注册的顺序加入,
+ * 以保持同时到期的定时器的触发顺序. 触发时间已经过去的节点(注册之后当前时间前进了)当作此刻到期. 只能在定时线程中调用. */
+static int
+timer_drain(struct timer *T) {
+	int n = 0;
+	int i;
+	for (i=0;i<T->inbox_count;i++) {
+		struct timer_inbox *inbox = &T->inbox[i];
+		if (inbox->head == NULL) {
+			continue;
+		}
+		struct timer_node *node = ATOM_XCHG(&inbox->head, NULL);
+		/* 反转栈, 恢复注册的顺序 */
+		struct timer_node *list = NULL;
+		while (node) {
+			struct timer_node *next = node->next;
+			node->next = list;
+			list = node;
+			node = next;
+		}
+		while (list) {
+			struct timer_node *next = list->next;
+			if (list->state == TIMER_DEAD) {
+				node_free(T, list);
+			} else {
+				if ((int32_t)(list->expire - T->time) < 0) {
+					list->expire = T->time;
+				}
+				list->state = TIMER_LINKED;
+				add_node(T, list);
+			}
+			list = next;
+			++n;
+		}
+	}
+	/* 注册请求都已取出, 此时处理取消请求, 节点只可能是 TIMER_QUEUED 以外的状态, 除非它的注册请求在之后才压入收件箱 */
+	for (i=0;i<T->inbox_count;i++) {
+		struct timer_inbox *inbox = &T->inbox[i];
+		if (inbox->cancel == NULL) {
+			continue;
+		}
+		struct timer_node *node = ATOM_XCHG(&inbox->cancel, NULL);
+		while (node) {
+			struct timer_node *next = node->link;
+			timer_reap(T, node);
+			node = next;
+		}
+	}
+	return n;
 }
 
 /* 将层级列表集中的某个触发列表移动根据触发时间距今长短移动到较低层次的列表集
@@ -190,51 +705,124 @@ timer_shift(struct timer *T) {
 	}
 }
 
+/* 投递一条 PTYPE_RESPONSE 类型的定时消息到服务 handle , 会话号为 session . */
+static inline void
+timer_send(uint32_t handle, int session) {
+	struct skynet_message message;
+	message.source = 0;
+	message.session = session;
+	message.data = NULL;
+	message.sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
+
+	skynet_context_push(handle, &message);
+}
+
+/* 暂存一个到期的定时事件, 等待本次分发结束时按服务合并 */
+static inline void
+expired_push(struct timer *T, uint32_t handle, int session) {
+	if (T->expired_count >= T->expired_cap) {
+		T->expired_cap *= 2;
+		T->expired = skynet_realloc(T->expired, T->expired_cap * sizeof(struct timer_expired));
+	}
+	struct timer_expired *e = &T->expired[T->expired_count];
+	e->handle = handle;
+	e->session = session;
+	e->seq = T->expired_count++;
+}
+
+static int
+expired_compare(const void *a, const void *b) {
+	const struct timer_expired *ea = a;
+	const struct timer_expired *eb = b;
+	if (ea->handle != eb->handle) {
+		return ea->handle < eb->handle ? -1 : 1;
+	}
+	return ea->seq - eb->seq;
+}
+
+/* 将暂存的到期事件按服务分组, 每组投递一条消息. 只有一个事件的组仍然投递普通的 PTYPE_RESPONSE 消息,
+ * 多个事件的组投递一条 PTYPE_TIMER 消息, 会话号为 0 , 内容为按到期顺序排列的会话号数组. */
+static void
+dispatch_coalesced(struct timer *T) {
+	int n = T->expired_count;
+	T->expired_count = 0;
+	if (n > 1) {
+		qsort(T->expired, n, sizeof(struct timer_expired), expired_compare);
+	}
+	int i = 0;
+	while (i < n) {
+		uint32_t handle = T->expired[i].handle;
+		int j = i + 1;
+		while (j < n && T->expired[j].handle == handle) {
+			++j;
+		}
+		if (j - i == 1) {
+			timer_send(handle, T->expired[i].session);
+		} else {
+			int count = j - i;
+			int *session = skynet_malloc(count * sizeof(int));
+			int k;
+			for (k=0;k<count;k++) {
+				session[k] = T->expired[i+k].session;
+			}
+			struct skynet_message message;
+			message.source = 0;
+			message.session = 0;
+			message.data = session;
+			message.sz = (count * sizeof(int)) | ((size_t)PTYPE_TIMER << MESSAGE_TYPE_SHIFT);
+			if (skynet_context_push(handle, &message)) {
+				skynet_free(session);
+			}
+		}
+		i = j;
+	}
+}
+
 /* 分发整个定时触发列表中的定时事件, 此函数要求列表中至少有一个定时事件节点.
  * 投递的消息类型为 PTYPE_RESPONSE, session 为注册定时器时传入的值,
- * 到 handle 也为注册定时器时传入的值为地址的服务中去.
- * 此函数同时负责将回收为 struct timer_node 结构分配的内存. */
+ * 到 handle 也为注册定时器时传入的值为地址的服务中去. 开启合并分发时, 事件先暂存起来, 由 dispatch_coalesced 合并投递.
+ * 此函数同时负责释放 struct timer_node 节点, 节点池中的节点归还给所属的节点池. 已被取消的节点不分发, 留待处理取消请求时释放. */
 static inline void
-dispatch_list(struct timer_node *current) {
+dispatch_list(struct timer *T, struct timer_node *current) {
 	do {
 		struct timer_event * event = (struct timer_event *)(current+1);
-		struct skynet_message message;
-		message.source = 0;
-		message.session = event->session;
-		message.data = NULL;
-		message.sz = (size_t)PTYPE_RESPONSE << MESSAGE_TYPE_SHIFT;
-
-		skynet_context_push(event->handle, &message);
-		
 		struct timer_node * temp = current;
 		current=current->next;
-		skynet_free(temp);	
+		if (cancel_remove(T, event->handle, event->session, temp) == NULL) {
+			/* 不在取消表中说明已经被取消, 取消请求随后会处理 */
+			temp->state = TIMER_DETACHED;
+			continue;
+		}
+		if (T->coalesce) {
+			expired_push(T, event->handle, event->session);
+		} else {
+			timer_send(event->handle, event->session);
+		}
+		node_free(T, temp);
 	} while (current);
 }
 
-/* 分发此时到期的定时事件, 此函数会以线程安全的方式不断监测是否有新添加进来的当前时间就过期的定时事件.
- * 如果检查到就一并分发, 如果检查不到就会留至下一次分发时分发. */
+/* 分发此时到期的定时事件. */
 static inline void
 timer_execute(struct timer *T) {
 	int idx = T->time & TIME_NEAR_MASK;
 	
-	while (T->near[idx].head.next) {
+	if (T->near[idx].head.next) {
 		struct timer_node *current = link_clear(&T->near[idx]);
-		SPIN_UNLOCK(T);
-		// dispatch_list don't need lock T
-		dispatch_list(current);
-		SPIN_LOCK(T);
+		dispatch_list(T, current);
+	}
+	if (T->expired_count > 0) {
+		dispatch_coalesced(T);
 	}
 }
 
-/* 更新当前时间并分发所有已经到期的定时事件. 此函数是线程安全的. */
+/* 更新当前时间并分发所有已经到期的定时事件. 只能在定时线程中调用. */
 static void 
 timer_update(struct timer *T) {
-	SPIN_LOCK(T);
-
-	/* 第一件做的事情是分发当前时间未更新的情况下到期的定时事件, 这些事件
-	   是在上次分发运行中添加进来而未检查到的. 如果不这样做, 它们将永远丢失. */
+	/* 第一件做的事情是取走收件箱中的定时器, 并分发当前时间未更新的情况下到期的定时事件, 这些事件
+	   是在上次更新之后注册而当时就已经到期的. 如果不这样做, 它们将永远丢失. */
 	// try to dispatch timeout 0 (rare condition)
+	timer_drain(T);
 	timer_execute(T);
 
 	/* 然后才是更新当前时间, 重新安排层级列表集中的定时触发事件, 并分发此时到期的定时事件 */
@@ -242,14 +830,12 @@ timer_update(struct timer *T) {
 	timer_shift(T);
 
 	timer_execute(T);
-
-	SPIN_UNLOCK(T);
 }
 
-/* 构建定时器对象, 包括分配内存、初始化触发列表集、初始化锁并将当前时间 time 置为 0.
- * 此函数返回初始化好的定时器对象. */
+/* 构建定时器对象, 包括分配内存、初始化触发列表集、为 thread 条工作线程分配收件箱并将当前时间 time 置为 0.
+ * tick 为一个滴答的毫秒数, coalesce 为是否合并分发. 此函数返回初始化好的定时器对象. */
 static struct timer *
-timer_create_timer() {
+timer_create_timer(int thread, int tick, int coalesce) {
 	struct timer *r=(struct timer *)skynet_malloc(sizeof(struct timer));
 	/* 将 time 初始化为 0 */
 	memset(r,0,sizeof(*r));
@@ -268,21 +854,53 @@ timer_create_timer() {
 		}
 	}
 
-	SPIN_INIT(r)
+	r->tick = tick;
+	r->coalesce = coalesce;
+	if (coalesce) {
+		r->expired_cap = EXPIRED_INIT;
+		r->expired = skynet_malloc(EXPIRED_INIT * sizeof(struct timer_expired));
+	}
+	r->inbox_count = thread + 1;
+	r->inbox = skynet_malloc(r->inbox_count * sizeof(struct timer_inbox));
+	memset(r->inbox, 0, r->inbox_count * sizeof(struct timer_inbox));
+	for (i=0;i<r->inbox_count;i++) {
+		spinlock_init(&r->inbox[i].lock);
+	}
+	spinlock_init(&r->chunk_lock);
+	r->reclaim = skynet_malloc(r->inbox_count * sizeof(struct timer_reclaim));
+	memset(r->reclaim, 0, r->inbox_count * sizeof(struct timer_reclaim));
+	pthread_key_create(&r->inbox_key, NULL);
+	for (i=0;i<CANCEL_SHARD;i++) {
+		struct cancel_shard *shard = &r->cancel[i];
+		spinlock_init(&shard->lock);
+		shard->size = CANCEL_BUCKET;
+		shard->count = 0;
+		shard->bucket = skynet_malloc(CANCEL_BUCKET * sizeof(struct timer_node *));
+		memset(shard->bucket, 0, CANCEL_BUCKET * sizeof(struct timer_node *));
+	}
+
+	pthread_mutex_init(&r->mutex, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+#if !defined(__APPLE__)
+	/* 以单调时钟计算睡眠的截止时间, 与 gettime 保持一致 */
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+	pthread_cond_init(&r->cond, &attr);
+	pthread_condattr_destroy(&attr);
 
-	/* current 以及除了 time 以外的其它时间字段还会进一步初始化 */
-	r->current = 0;
+	/* 除了 time 以外的其它时间字段还会进一步初始化 */
 
 	return r;
 }
 
 /* 为一个服务的某次会话注册一个定时器事件. 如果传入的时间小于等于 0 将会立即发送
  * 类型为 PTYPE_RESPONSE 的消息给该服务会话, 否则将以线程安全的方式添加到触发列表集中.
- * 参数 handle 是服务地址, time 是距离现在的触发时间单位是厘秒, session 是服务中的会话.
+ * 参数 handle 是服务地址, tick 是距离现在的触发时间单位是滴答, session 是服务中的会话.
  * 此函数是线程安全的. */
-int
-skynet_timeout(uint32_t handle, int time, int session) {
-	if (time <= 0) {
+static int
+timeout_tick(uint32_t handle, int tick, int session) {
+	if (tick <= 0) {
 		struct skynet_message message;
 		message.source = 0;
 		message.session = session;
@@ -296,36 +914,75 @@ skynet_timeout(uint32_t handle, int time, int session) {
 		struct timer_event event;
 		event.handle = handle;
 		event.session = session;
-		timer_add(TI, &event, sizeof(event), time);
+		timer_add(TI, &event, sizeof(event), tick);
 	}
 
 	return session;
 }
 
-/* 获取操作系统墙上时间, 时间计算为从 1970 年 1 月 1 日 00:00 经过的秒数, 不足一秒的记录为厘秒数.
- * 返回的时间与时区无关, 传入参数 sec 用来接收秒数, cs 用来接收厘秒. */
-// centisecond: 1/100 second
+/* 为一个服务的某次会话注册一个定时器事件, time 的单位是厘秒, 其它参考 timeout_tick .
+ * 毫秒精度下换算为滴答时以 64 位整数计算, 超过 TIME_MAX_TICK 的截断. */
+int
+skynet_timeout(uint32_t handle, int time, int session) {
+	if (time > 0 && TI->tick == TIME_TICK_MS) {
+		int64_t tick = (int64_t)time * TIME_TICK_CS;
+		time = tick > TIME_MAX_TICK ? TIME_MAX_TICK : (int)tick;
+	}
+	return timeout_tick(handle, time, session);
+}
+
+/* 与 skynet_timeout 相同, 但 ms 的单位是毫秒. 在默认的厘秒精度下向上取整为厘秒. */
+int
+skynet_timeout_ms(uint32_t handle, int ms, int session) {
+	int tick = TI->tick;
+	if (ms > 0) {
+		ms = (int)(((int64_t)ms + tick - 1) / tick);
+	}
+	return timeout_tick(handle, ms, session);
+}
+
+/* 取消服务 handle 以会话号 session 注册的定时器, 被取消的定时器不会再分发消息, 节点由定时线程摘除并释放.
+ * 返回 0 表示取消成功; 返回 -1 表示没有这个定时器, 可能已经到期分发(或者正在分发), 也可能是立即到期的定时器.
+ * 此函数是线程安全的. */
+int
+skynet_timeout_cancel(uint32_t handle, int session) {
+	struct timer *T = TI;
+	struct timer_node *node = cancel_remove(T, handle, session, NULL);
+	if (node == NULL) {
+		return -1;
+	}
+	struct timer_inbox *inbox = &T->inbox[(uintptr_t)pthread_getspecific(T->inbox_key)];
+	struct timer_node *head;
+	do {
+		head = inbox->cancel;
+		node->link = head;
+	} while (!ATOM_CAS_POINTER(&inbox->cancel, head, node));
+	return 0;
+}
+
+/* 获取操作系统墙上时间, 时间计算为从 1970 年 1 月 1 日 00:00 经过的秒数, 不足一秒的记录为毫秒数.
+ * 返回的时间与时区无关, 传入参数 sec 用来接收秒数, ms 用来接收毫秒. */
 static void
-systime(uint32_t *sec, uint32_t *cs) {
+systime(uint32_t *sec, uint32_t *ms) {
 /* 在 OSX 中没有定义 clock_gettime 函数而只定义了 gettimeofday 函数,
    并且 struct timespec 包含秒和纳秒, 而 struct timeval 包含秒和微秒. */
 #if !defined(__APPLE__)
 	struct timespec ti;
 	clock_gettime(CLOCK_REALTIME, &ti);
 	*sec = (uint32_t)ti.tv_sec;
-	*cs = (uint32_t)(ti.tv_nsec / 10000000);
+	*ms = (uint32_t)(ti.tv_nsec / 1000000);
 #else
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
 	*sec = tv.tv_sec;
-	*cs = tv.tv_usec / 10000;
+	*ms = tv.tv_usec / 1000;
 #endif
 }
 
-/* 获取自某个确定时间点的时间戳, 单位是厘秒. 在非 OSX 的环境下获取的是自操作系统启动后的厘秒数,
+/* 获取自某个确定时间点的时间戳, 单位是毫秒. 在非 OSX 的环境下获取的是自操作系统启动后的毫秒数,
  * 此时时间是不受用户设置墙上时钟影响的. 由于 OSX 中没有类似函数, 获取的是
- * 自 1970 年 1 月 1 日 00:00 经过的厘秒数, 这个时间是会受到用户设置的影响的.
- * 返回值是距离某个确定时间点的厘秒数.
+ * 自 1970 年 1 月 1 日 00:00 经过的毫秒数, 这个时间是会受到用户设置的影响的.
+ * 返回值是距离某个确定时间点的毫秒数.
  * 此函数的用途在于通过比较两个时间戳的差值获取一个精确的时间流逝. */
 static uint64_t
 gettime() {
@@ -333,30 +990,28 @@ gettime() {
 #if !defined(__APPLE__)
 	struct timespec ti;
 	clock_gettime(CLOCK_MONOTONIC, &ti);
-	t = (uint64_t)ti.tv_sec * 100;
-	t += ti.tv_nsec / 10000000;
+	t = (uint64_t)ti.tv_sec * 1000;
+	t += ti.tv_nsec / 1000000;
 #else
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
-	t = (uint64_t)tv.tv_sec * 100;
-	t += tv.tv_usec / 10000;
+	t = (uint64_t)tv.tv_sec * 1000;
+	t += tv.tv_usec / 1000;
 #endif
 	return t;
 }
 
-/* 更新定时器中的时间并触发定时器. 若时间变化将先增加至 current 厘秒字段, 仅当其无法表示时才更新至 starttime 秒字段中.
- * 同时更新的还有表示当前时间点的 current_point 字段. */
+/* 更新定时器中的时间并触发定时器. 经过了几个滴答就前进几次, 同时更新表示当前时间点的 current_point 字段. */
 void
 skynet_updatetime(void) {
 	/* 获取到精确的距离某个时间点的时间戳, 用于确定时间流逝. */
-	uint64_t cp = gettime();
+	uint64_t cp = gettime() / TI->tick;
 	if(cp < TI->current_point) {
 		skynet_error(NULL, "time diff error: change from %lld to %lld", cp, TI->current_point);
 		TI->current_point = cp;
 	} else if (cp != TI->current_point) {
 		uint32_t diff = (uint32_t)(cp - TI->current_point);
 		TI->current_point = cp;
-		TI->current += diff;
 		int i;
 		for (i=0;i<diff;i++) {
 			timer_update(TI);
@@ -364,26 +1019,119 @@ skynet_updatetime(void) {
 	}
 }
 
+/* 计算距离下一次需要更新定时器的时间, 单位滴答, 最长不超过 limit . 最近触发列表集中当前区间内第一条非空的列表
+ * 即是最早到期的定时器; 层级列表集中的定时器要等到当前时间到达 TIME_NEAR 的整数倍时才会被重新安排,
+ * 因而最迟也要在那时醒来. 此函数不是线程安全的. */
+static uint32_t
+timer_next(struct timer *T, uint32_t limit) {
+	uint32_t i;
+	for (i=1;i<limit;i++) {
+		uint32_t t = T->time + i;
+		if ((t & TIME_NEAR_MASK) == 0 || T->near[t & TIME_NEAR_MASK].head.next) {
+			return i;
+		}
+	}
+	return limit;
+}
+
+/* 使定时线程睡眠到下一个定时器到期的时刻, 最长不超过 TIME_IDLE_WAIT 毫秒. 若睡眠期间注册了更早到期的定时器,
+ * 将被 timer_add 提前唤醒. 醒来之后由调用者执行 skynet_updatetime 更新时间并触发定时器. 只能在定时线程中调用. */
+void
+skynet_timer_wait(void) {
+	struct timer *T = TI;
+	uint32_t delta;
+	/* 先公布计划醒来的时间再检查收件箱, 检查之后注册的定时器会读到这个时间并在需要时唤醒定时线程 */
+	for (;;) {
+		delta = timer_next(T, TIME_IDLE_WAIT / T->tick);
+		ATOM_STORE(&T->deadline, T->time + delta);
+		__sync_synchronize();
+		if (timer_drain(T) == 0) {
+			break;
+		}
+		/* 在时间前进之前读取了当前时间的定时器此刻就已到期, 它们落在当前时间的列表中, 而这条列表在本滴答已经分发过了,
+		 * timer_next 也不会检查它. 这里立即分发, 否则它们要等到定时线程下一次醒来, 最长晚 TIME_IDLE_WAIT 毫秒 */
+		timer_execute(T);
+	}
+
+	/* 睡眠之前归还本轮释放的节点 */
+	timer_reclaim(T);
+
+	/* time 与 current_point 同步增长, 所以截止时间就是 current_point 之后 delta 个滴答, 与 gettime 的时钟相同 */
+	uint64_t wake = (T->current_point + delta) * T->tick;
+	struct timespec ts;
+	ts.tv_sec = wake / 1000;
+	ts.tv_nsec = (wake % 1000) * 1000000;
+
+	pthread_mutex_lock(&T->mutex);
+	if (!T->interrupt) {
+		pthread_cond_timedwait(&T->cond, &T->mutex, &ts);
+	}
+	T->interrupt = 0;
+	pthread_mutex_unlock(&T->mutex);
+
+	/* 醒着的时候不需要被唤醒 */
+	ATOM_STORE(&T->deadline, T->time);
+}
+
+/* 将当前线程绑定为编号 id 的工作线程, 此后它注册的定时器放入自己的收件箱 */
+void
+skynet_timer_bind(int id) {
+	struct timer *T = TI;
+	if (id >= 0 && id + 1 < T->inbox_count) {
+		pthread_setspecific(T->inbox_key, (void *)(uintptr_t)(id + 1));
+	}
+}
+
+/* 获取单调递增的高精度时间戳, 单位是纳秒. 此函数不涉及定时器对象, 可以在任意线程中调用,
+ * 用于度量消息处理等短时间间隔. */
+uint64_t
+skynet_hpc(void) {
+#if !defined(__APPLE__)
+	struct timespec ti;
+	clock_gettime(CLOCK_MONOTONIC, &ti);
+	return (uint64_t)ti.tv_sec * 1000000000 + ti.tv_nsec;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+/* 获取定时器节点池向系统申请的内存大小, 单位字节. 这部分内存不计入任何服务的内存统计. */
+size_t
+skynet_timer_memory(void) {
+	return (size_t)ATOM_LOAD(&TI->chunk_count) * TIMER_CHUNK_SIZE;
+}
+
 /* 获取启动时间, 时间计算为从 1970 年 1 月 1 日 00:00 经过的秒数. */
 uint32_t
 skynet_starttime(void) {
 	return TI->starttime;
 }
 
-/* 获取当前时间, 单位是厘秒, 与 skynet_starttime 之和构成墙上时钟. */
+/* 获取当前时间, 单位是厘秒, 与 skynet_starttime 之和构成墙上时钟. 直接读取时钟, 而不是定时线程上一次醒来时更新的时间,
+ * 定时线程空闲时最长睡眠 TIME_IDLE_WAIT 毫秒, 那样得到的时间可能落后这么久. 此函数可以在任意线程中调用. */
 uint64_t 
 skynet_now(void) {
-	return TI->current;
+	uint64_t t = gettime();
+	uint64_t origin = TI->origin;
+	return t > origin ? (t - origin) / 10 : 0;
 }
 
 /* 初始化定时器模块, 初始工作包括构建定时器对象, 初始化时间系统的当前时间、启动时间、
- * 启动时间戳和当前时间戳. */
+ * 启动时间戳和当前时间戳. thread 为工作线程(包括专用工作线程)的数量, 每条工作线程有一个定时器收件箱.
+ * tick 为定时器的精度, 单位毫秒, 只支持 1 和 10 , 其它值当作 10 . coalesce 不为 0 时,
+ * 同一滴答内到期的属于同一服务的多个定时事件合并为一条 PTYPE_TIMER 消息投递. */
 void 
-skynet_timer_init(void) {
-	TI = timer_create_timer();
+skynet_timer_init(int thread, int tick, int coalesce) {
+	if (tick != TIME_TICK_MS) {
+		tick = TIME_TICK_CS;
+	}
+	TI = timer_create_timer(thread, tick, coalesce);
 	uint32_t current = 0;
 	systime(&TI->starttime, &current);
-	TI->current = current;
-	TI->current_point = gettime();
+	uint64_t point = gettime();
+	TI->origin = point - current;
+	TI->current_point = point / tick;
 }
 
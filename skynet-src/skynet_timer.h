@@ -2,11 +2,17 @@
 #define SKYNET_TIMER_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 int skynet_timeout(uint32_t handle, int time, int session);
+int skynet_timeout_ms(uint32_t handle, int ms, int session);
+int skynet_timeout_cancel(uint32_t handle, int session);	// 0 if the timer will never fire
 void skynet_updatetime(void);
+void skynet_timer_wait(void);	// sleep until the next timer expires
+void skynet_timer_bind(int id);	// use the timer inbox of worker id in this thread
 uint32_t skynet_starttime(void);
+size_t skynet_timer_memory(void);	// bytes held by the timer node pools, not charged to any service
 
-void skynet_timer_init(void);
+void skynet_timer_init(int thread, int tick, int coalesce);
 
 #endif
@@ -0,0 +1,168 @@
+#include "skynet.h"
+#include "skynet_trace.h"
+#include "atomic.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+/* skynet_trace 模块为每条工作线程维护一个环形缓冲区, 记录最近分发的每条消息: 开始时间、耗时、来源、目的地、类型和会话号.
+ * 每个环形缓冲区只由所属的工作线程写入, 写入一条记录只是几次内存写和一次带释放语义的计数器更新, 因而可以一直开启.
+ * skynet_trace_dump 将所有环形缓冲区中的记录导出为 Chrome/Perfetto 可以打开的 trace JSON 文件. */
+
+/* 一条分发记录, 大小固定为 32 字节 */
+struct trace_record {
+	uint64_t start;                 /* 开始处理的时间, 单位纳秒, 来自 skynet_hpc */
+	uint32_t duration;              /* 处理耗时, 单位纳秒, 超过 4 秒时截断 */
+	uint32_t source;                /* 消息来源服务 */
+	uint32_t destination;           /* 处理消息的服务 */
+	int type;                       /* 消息类型 */
+	int session;                    /* 会话号 */
+	int padding;
+};
+
+/* 一条工作线程的环形缓冲区. 读者先后读取两次 head , 只保留复制期间不可能被覆盖的记录, 因而不需要加锁 */
+struct skynet_trace {
+	uint64_t head;                  /* 已经写入的记录总数, 下一条记录写在 head & mask 处 */
+	int mask;                       /* 容量减 1 , 容量是 2 的幂 */
+	int id;                         /* 所属工作线程的编号 */
+	struct trace_record *record;    /* 记录数组 */
+};
+
+struct trace_state {
+	int n;                          /* 工作线程的数量 */
+	struct skynet_trace **trace;    /* 每条工作线程一个环形缓冲区, 关闭跟踪时为 NULL */
+	pthread_key_t key;              /* 保存当前工作线程的环形缓冲区的线程特定数据键 */
+};
+
+static struct trace_state T;
+
+/* 初始化跟踪模块, thread 为工作线程(包括专用工作线程)的数量, size 为每条工作线程的记录数量, 向上取整为 2 的幂,
+ * 为 0 时关闭跟踪. 此函数只能在工作线程启动之前调用一次. */
+void
+skynet_trace_init(int thread, int size) {
+	pthread_key_create(&T.key, NULL);
+	T.n = thread;
+	T.trace = NULL;
+	if (size <= 0) {
+		return;
+	}
+	int cap = 1;
+	while (cap < size) {
+		cap *= 2;
+	}
+	T.trace = skynet_malloc(thread * sizeof(struct skynet_trace *));
+	int i;
+	for (i=0;i<thread;i++) {
+		struct skynet_trace *t = skynet_malloc(sizeof(*t));
+		t->head = 0;
+		t->mask = cap - 1;
+		t->id = i;
+		/* 记录数组在工作线程中首次写入, 内存页会落在它所在的 numa 节点上 */
+		t->record = skynet_malloc(cap * sizeof(struct trace_record));
+		T.trace[i] = t;
+	}
+}
+
+/* 将当前线程绑定为编号 id 的工作线程, 此后它分发的消息记录到第 id 个环形缓冲区中 */
+void
+skynet_trace_bind(int id) {
+	if (T.trace && id >= 0 && id < T.n) {
+		pthread_setspecific(T.key, T.trace[id]);
+	}
+}
+
+/* 获取当前工作线程的环形缓冲区, 关闭跟踪或者不是工作线程时返回 NULL */
+struct skynet_trace *
+skynet_trace_local(void) {
+	return pthread_getspecific(T.key);
+}
+
+/* 记录一条消息的分发, 只能由 t 所属的工作线程调用 */
+void
+skynet_trace_record(struct skynet_trace *t, uint64_t start, uint64_t duration, uint32_t source, uint32_t destination, int type, int session) {
+	uint64_t head = t->head;
+	struct trace_record *r = &t->record[head & t->mask];
+	r->start = start;
+	r->duration = duration > UINT32_MAX ? UINT32_MAX : (uint32_t)duration;
+	r->source = source;
+	r->destination = destination;
+	r->type = type;
+	r->session = session;
+	ATOM_STORE(&t->head, head + 1);
+}
+
+/* 消息类型的名字, 用作 trace 事件的类别 */
+static const char *
+type_name(int type) {
+	static const char * name[] = {
+		"text", "response", "multicast", "client", "system", "harbor", "socket", "error",
+		"queue", "debug", "lua", "snax", "overload", "timer",
+	};
+	if (type >= 0 && type < sizeof(name)/sizeof(name[0])) {
+		return name[type];
+	}
+	return "unknown";
+}
+
+/* 复制环形缓冲区 t 中的有效记录到 buf 中, 返回复制的数量. 复制之后再次读取 head ,
+ * 丢弃在复制期间可能已经被写者覆盖(或者正在覆盖)的记录. */
+static int
+trace_snapshot(struct skynet_trace *t, struct trace_record *buf) {
+	uint64_t cap = (uint64_t)t->mask + 1;
+	uint64_t head = ATOM_LOAD(&t->head);
+	uint64_t from = head > cap ? head - cap : 0;
+	uint64_t i;
+	for (i=from;i<head;i++) {
+		buf[i-from] = t->record[i & t->mask];
+	}
+	__sync_synchronize();
+	uint64_t now = ATOM_LOAD(&t->head);
+	uint64_t valid = now + 1 > cap ? now + 1 - cap : 0;
+	if (valid > head) {
+		return 0;
+	}
+	if (valid > from) {
+		memmove(buf, buf + (valid - from), (head - valid) * sizeof(*buf));
+		from = valid;
+	}
+	return (int)(head - from);
+}
+
+/* 将所有工作线程最近的分发记录以 Chrome trace JSON 格式写入文件 filename , 每条工作线程为一条轨道,
+ * 每条消息为一个完整事件, 名字是处理消息的服务地址, 类别是消息类型. 可以在任意线程中调用.
+ * 返回写入的事件数量, 关闭跟踪时返回 0 , 无法打开文件时返回 -1 . */
+int
+skynet_trace_dump(const char *filename) {
+	if (T.trace == NULL) {
+		return 0;
+	}
+	FILE *f = fopen(filename, "w");
+	if (f == NULL) {
+		return -1;
+	}
+	int cap = T.trace[0]->mask + 1;
+	struct trace_record *buf = skynet_malloc(cap * sizeof(*buf));
+	int total = 0;
+	int i;
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (i=0;i<T.n;i++) {
+		fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}",
+			i == 0 ? "" : ",\n", i, i);
+	}
+	for (i=0;i<T.n;i++) {
+		int n = trace_snapshot(T.trace[i], buf);
+		int j;
+		for (j=0;j<n;j++) {
+			struct trace_record *r = &buf[j];
+			fprintf(f, ",\n{\"name\":\":%08x\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,"
+				"\"args\":{\"source\":\":%08x\",\"session\":%d}}",
+				r->destination, type_name(r->type), r->start / 1000.0, r->duration / 1000.0, i, r->source, r->session);
+		}
+		total += n;
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	skynet_free(buf);
+	return total;
+}
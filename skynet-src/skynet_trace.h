@@ -0,0 +1,14 @@
+#ifndef SKYNET_TRACE_H
+#define SKYNET_TRACE_H
+
+#include <stdint.h>
+
+struct skynet_trace;
+
+void skynet_trace_init(int thread, int size);	// size records per worker thread, 0 to disable
+void skynet_trace_bind(int id);	// call in worker thread id
+struct skynet_trace * skynet_trace_local(void);	// NULL if tracing is disabled or not a worker thread
+void skynet_trace_record(struct skynet_trace *t, uint64_t start, uint64_t duration, uint32_t source, uint32_t destination, int type, int session);
+int skynet_trace_dump(const char *filename);	// write chrome trace json, return the number of events or -1
+
+#endif
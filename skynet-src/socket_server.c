@@ -1,13 +1,20 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE    /* recvmmsg sendmmsg */
+#endif
+
 #include "skynet.h"
 
 #include "socket_server.h"
 #include "socket_poll.h"
 #include "atomic.h"
+#include "spinlock.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
+#include <limits.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -15,12 +22,25 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
 
 #define MAX_INFO 128          /* 短消息的最大长度 */
 // MAX_SOCKET will be 2^MAX_SOCKET_P
 #define MAX_SOCKET_P 16
 #define MAX_EVENT 64          /* I/O 多路复用时一次性侦听的最大事件数量 */
+#define MAX_SOCKET_THREAD 64  /* socket 线程的最大数量 */
 #define MIN_READ_BUFFER 64    /* 从套接字中一次性最少读取的字节数 */
+#define READ_POOL_CLASS 11    /* 接收缓冲池的级别数量, 第 i 级的缓冲大小为 MIN_READ_BUFFER << i , 即 64 字节到 64K */
+#define READ_POOL_BYTES (256 * 1024)  /* 每一级的回收栈最多保存的字节数, 超出的缓冲直接释放 */
+#if defined(IOV_MAX)
+#define MAX_IOV IOV_MAX       /* 一次 writev 最多写入的写缓冲节点数量 */
+#elif defined(UIO_MAXIOV)
+#define MAX_IOV UIO_MAXIOV
+#else
+#define MAX_IOV 64
+#endif
 
 /* socket 的状态类型, 保存在 socket 结构对象中 */
 #define SOCKET_TYPE_INVALID 0      /* 套接字连接对象不可用或损坏, 同时也表示套接字对象未被使用 */
@@ -40,15 +60,18 @@
 #define PRIORITY_LOW 1
 
 #define HASH_ID(id) (((unsigned)id) % MAX_SOCKET)
+#define ID_TAG16(id) ((id>>MAX_SOCKET_P) & 0xffff)   /* 同一个插槽先后分配的 id 的区分标签 */
 
-/* 支持三种协议类型 TCP UDP UDPv6 */
+/* 支持三种协议类型 TCP UDP UDPv6 , 插槽刚预留还没有创建套接字时为 PROTOCOL_UNKNOWN */
 #define PROTOCOL_TCP 0
 #define PROTOCOL_UDP 1
 #define PROTOCOL_UDPv6 2
+#define PROTOCOL_UNKNOWN 255
 
 #define UDP_ADDRESS_SIZE 19	// ipv6 128bit + port 16bit + 1 byte type
 
 #define MAX_UDP_PACKAGE 65535
+#define UDP_BATCH 16          /* 一次系统调用最多接收或者发送的 udp 数据包数量 */
 
 // EAGAIN and EWOULDBLOCK may be not the same value.
 #if (EAGAIN != EWOULDBLOCK)
@@ -93,23 +116,51 @@ struct socket {
 		uint8_t udp_address[UDP_ADDRESS_SIZE];
 		                       /* 在 UDP UDPv6 协议下使用, 表示对端 ip 地址 */
 	} p;
+	uint32_t sending;          /* 高 16 位是 id 的标签, 低 16 位是还在命令队列中没有处理的 TCP 发送命令数量 */
+	struct spinlock dw_lock;   /* 直接写入锁, 工作线程直接写入时持有, socket 线程修改写缓冲或者关闭 TCP 套接字时也要持有 */
+	int dw_offset;             /* 直接写入时已经写入的字节数 */
+	const void * dw_buffer;    /* 直接写入时没有写完的发送数据, 由 socket 线程接着发送, 为 NULL 表示没有 */
+	int dw_size;               /* dw_buffer 的大小, 小于 0 时表示用户对象 */
 };
 
-/* 套接字服务器对象 */
-struct socket_server {
-	int recvctrl_fd;                         /* 接收命令的管道的文件描述符 */
-	int sendctrl_fd;                         /* 发送命令的管道的文件描述符 */
-	int checkctrl;                           /* 是否需要检查管道中的命令的标记 */
+/* 可重入的直接写入锁, 只在 socket 线程的一次命令或者事件处理中使用. 关闭套接字可能发生在发送写缓冲的过程中,
+ * 这时已经持有了锁, 以计数避免重复加锁. */
+struct socket_lock {
+	struct spinlock *lock;
+	int count;
+};
+
+/* 一条 socket 线程的状态. 插槽按编号分给各条 socket 线程, 第 i 个插槽属于第 i % shard_n 条线程, 即套接字以 id 的哈希值分配.
+ * 每条线程有自己的多路 I/O 事件对象和命令管道, 只处理属于自己的套接字的命令和 I/O 事件, 因而套接字的状态仍然只由一条线程修改. */
+struct socket_shard {
+	struct request_node *inbox;              /* 命令队列, 是多生产者单消费者的无锁栈, 节点以 next 相连, 后压入的在前 */
+	struct request_node *cmd;                /* socket 线程从命令队列取出的一批命令, 已经恢复为压入的顺序 */
+	int recvctrl_fd;                         /* 门铃的读端, 在 linux 下是一个 eventfd , 与 sendctrl_fd 相同, 其它平台是一个管道 */
+	int sendctrl_fd;                         /* 门铃的写端 */
+	int checkctrl;                           /* 是否需要检查命令队列的标记 */
 	poll_fd event_fd;                        /* 多路 I/O 事件的文件描述符 */
-	int alloc_id;                            /* 分配套接字对象唯一 id 的起点 */
 	int event_n;                             /* 本次接收到的 I/O 事件通知数量 */
 	int event_index;                         /* 此时处理到的 I/O 事件通知的索引, 值保存在 ev 字段中, 会随着处理而递增 */
-	struct socket_object_interface soi;      /* 自定义的提取写入缓存和销毁缓存函数接口 */
 	struct event ev[MAX_EVENT];              /* 接收多路 I/O 事件通知的事件对象, 具体参见 socket_poll.h 文件 */
-	struct socket slot[MAX_SOCKET];          /* 保存所有套接字对象的插槽 */
 	char buffer[MAX_INFO];                   /* 用于保存一些较短的信息, 这些信息绝多数是字符串形式的 ip 地址 */
-	uint8_t udpbuffer[MAX_UDP_PACKAGE];      /* 用于接收 udp 协议发送过来的消息内容 */
-	fd_set rfds;                             /* 接收命令的管道的 select 监控文件描述符集 */
+	struct udp_batch *udp;                   /* 批量接收 udp 数据包的缓冲, 第一次接收 udp 数据包时才分配 */
+	void *read_cache[READ_POOL_CLASS];       /* 每一级空闲的接收缓冲, 以缓冲的头部相连, 只由本线程访问 */
+};
+
+/* 接收缓冲的回收栈, 是多生产者的无锁栈. 服务以 socket_server_free_buffer 归还的缓冲压入其中, socket 线程缓存用完时一次取走整个栈 */
+struct read_pool {
+	void *head;                              /* 栈顶的缓冲, 缓冲的头部保存下一个缓冲的指针 */
+	int count;                               /* 栈中缓冲的大约数量, 用于限制栈的大小 */
+};
+
+/* 套接字服务器对象 */
+struct socket_server {
+	int alloc_id;                            /* 分配套接字对象唯一 id 的起点 */
+	int shard_n;                             /* socket 线程的数量 */
+	struct socket_shard *shard;              /* 每条 socket 线程一个 */
+	struct read_pool recycle[READ_POOL_CLASS];	/* 每一级接收缓冲的回收栈, 所有 socket 线程共用 */
+	struct socket_object_interface soi;      /* 自定义的提取写入缓存和销毁缓存函数接口 */
+	struct socket slot[MAX_SOCKET];          /* 保存所有套接字对象的插槽 */
 };
 
 /* 发起到一个 ip 和端口连接的请求体 */
@@ -126,6 +177,7 @@ struct request_send {
 	int id;                 /* 发送此消息的套接字 id */
 	int sz;                 /* 消息内容的大小 */
 	char * buffer;          /* 消息的数据内容 */
+	int ref;                /* 压入命令队列前是否增加了套接字的发送命令计数, 是则处理完之后需要减少 */
 };
 
 /* UDP 发送字节信息的请求体 */
@@ -200,14 +252,16 @@ struct request_udp {
 	T Set opt
 	U Create UDP socket
 	C set udp address
+	W Trigger write (the rest of a direct write)
  */
 
 /* socket_server 发送各种套接字的命令与实际的执行并不是在一条线程中, 发送套接字命令的线程可以是任意的,
- * 即便此时处理线程尚未开始工作或者已经关闭了也是可以发送命令的. 它们之间通过一个管道衔接起来, 从而构成一个
- * 异步的系统, 处理线程的主循环是 socket_server_poll 函数. */
+ * 即便此时处理线程尚未开始工作或者已经关闭了也是可以发送命令的. 它们之间通过内存中的命令队列衔接起来, 从而构成一个
+ * 异步的系统, 处理线程的主循环是 socket_server_poll 函数. 处理线程可以有多条, 每条有自己的命令队列,
+ * 命令发往所涉及的套接字所属的线程. 命令队列由空变为非空时才敲一次门铃(写 eventfd)唤醒处理线程,
+ * 处理线程每次 I/O 事件循环取走队列中所有的命令. */
 
 struct request_package {
-	uint8_t header[8];	// 6 bytes dummy     其第 7 和第 8 字节用来表示请求的类型和请求体大小
 	union {                                  /* 请求体所在位置, 大小有 256 个字节 */
 		char buffer[256];
 		struct request_open open;             /* 发起 TCP 连接 */
@@ -221,7 +275,13 @@ struct request_package {
 		struct request_udp udp;               /* 生成一个 UDP 套接字 */
 		struct request_setudp set_udp;        /* 给 UDP 套接字设置对端地址 */
 	} u;
-	uint8_t dummy[256];                      /* 更多的 256 个字节, 在上面不够时使用 */
+};
+
+/* 命令队列中的一条命令, 只分配请求体实际使用的大小 */
+struct request_node {
+	struct request_node *next;               /* 队列中的下一条命令 */
+	int type;                                /* 命令的类型, 即上面列出的字母 */
+	struct request_package request;          /* 请求体, 只有前 len 个字节是有效的 */
 };
 
 /* 各种类型的套接字地址 */
@@ -231,6 +291,17 @@ union sockaddr_all {
 	struct sockaddr_in6 v6;     /* ipv6 地址的结构定义 */
 };
 
+/* 一次批量接收到的 udp 数据包, 属于同一个套接字, 逐个交给服务 */
+struct udp_batch {
+	int id;                                       /* 这一批数据包所属的套接字 id */
+	int n;                                        /* 接收到的数据包数量 */
+	int index;                                    /* 下一个交给服务的数据包 */
+	int size[UDP_BATCH];                          /* 每个数据包的长度 */
+	socklen_t addrsz[UDP_BATCH];                  /* 每个数据包的对端地址长度 */
+	union sockaddr_all addr[UDP_BATCH];           /* 每个数据包的对端地址 */
+	uint8_t buffer[UDP_BATCH][MAX_UDP_PACKAGE];   /* 每个数据包的内容 */
+};
+
 /* 发送数据的结构, 内包含释放内存函数指针 */
 struct send_object {
 	void * buffer;                /* 数据缓存的起始指针 */
@@ -241,6 +312,82 @@ struct send_object {
 #define MALLOC skynet_malloc
 #define FREE skynet_free
 
+/* 套接字 id 所属的 socket 线程 */
+static inline struct socket_shard *
+shard_of(struct socket_server *ss, int id) {
+	return &ss->shard[HASH_ID(id) % ss->shard_n];
+}
+
+/* 初始化套接字 s 的可重入直接写入锁, 不加锁 */
+static inline void
+socket_lock_init(struct socket *s, struct socket_lock *sl) {
+	sl->lock = &s->dw_lock;
+	sl->count = 0;
+}
+
+static inline void
+socket_lock(struct socket_lock *sl) {
+	if (sl->count == 0) {
+		spinlock_lock(sl->lock);
+	}
+	++sl->count;
+}
+
+/* 尝试加锁, 返回是否加锁成功 */
+static inline int
+socket_trylock(struct socket_lock *sl) {
+	if (sl->count == 0) {
+		if (!spinlock_trylock(sl->lock))
+			return 0;	// lock failed
+	}
+	++sl->count;
+	return 1;
+}
+
+static inline void
+socket_unlock(struct socket_lock *sl) {
+	--sl->count;
+	if (sl->count <= 0) {
+		assert(sl->count == 0);
+		spinlock_unlock(sl->lock);
+	}
+}
+
+/* 发送命令压入命令队列之前增加套接字的发送命令计数, 计数不为 0 时工作线程不能直接写入, 否则会越过队列中的数据.
+ * 只计数 TCP 套接字, 插槽刚预留时协议还是 PROTOCOL_UNKNOWN , 标签不匹配说明插槽已经分配给了别的套接字, 这两种情况都不计数.
+ * 返回是否增加了计数, 随发送命令一起交给 socket 线程, 由它决定处理完之后是否减少. */
+static inline int
+inc_sending_ref(struct socket *s, int id) {
+	if (s->protocol != PROTOCOL_TCP)
+		return 0;
+	for (;;) {
+		uint32_t sending = s->sending;
+		if ((sending >> 16) == ID_TAG16(id)) {
+			if ((sending & 0xffff) == 0xffff) {
+				/* 计数即将溢出(极少发生), 忙等 socket 线程处理掉一些发送命令 */
+				continue;
+			}
+			// inc sending only matching the same socket id
+			if (ATOM_CAS(&s->sending, sending, sending + 1))
+				return 1;
+			// atom inc failed, retry
+		} else {
+			// socket id changed, just return
+			return 0;
+		}
+	}
+}
+
+/* socket 线程处理完一条增加了计数的发送命令之后减少发送命令计数. 插槽已经分配给了别的套接字时, 新套接字有自己的计数, 不需要减少 */
+static inline void
+dec_sending_ref(struct socket_server *ss, int id) {
+	struct socket * s = &ss->slot[HASH_ID(id)];
+	if (s->id == id && s->protocol == PROTOCOL_TCP) {
+		assert((s->sending & 0xffff) != 0);
+		ATOM_DEC(&s->sending);
+	}
+}
+
 /* 初始化发送对象, 当大小 sz 小于 0 时, 将调用 socket_server 中的 soi 函数接口从 object 中提取发送对象.
  * 否则直接 object 为发送缓存, sz 为缓存的大小.
  *
@@ -301,6 +448,10 @@ reserve_id(struct socket_server *ss) {
 		struct socket *s = &ss->slot[HASH_ID(id)];
 		if (s->type == SOCKET_TYPE_INVALID) {
 			if (ATOM_CAS(&s->type, SOCKET_TYPE_INVALID, SOCKET_TYPE_RESERVE)) {
+				/* 工作线程可能在 new_fd 之前就向这个 id 发送数据, 先清除上一个套接字的协议和发送命令计数, 再公布 id */
+				s->protocol = PROTOCOL_UNKNOWN;
+				s->sending = ID_TAG16(id) << 16 | 0;
+				__sync_synchronize();
 				s->id = id;
 				s->fd = -1;
 				return id;
@@ -320,56 +471,182 @@ clear_wb_list(struct wb_list *list) {
 	list->tail = NULL;
 }
 
-/* 在初始化 socket_server 模块时创建套接字服务器对象, 创建命令管道, 并将接收端添加到 I/O 事件通知列表中.
- * 返回: 成功时返回套接字服务器对象, 失败时返回 NULL. */
-struct socket_server * 
-socket_server_create() {
-	int i;
+/* 创建门铃, 读写两端都是非阻塞的. linux 下使用一个 eventfd , 读写两端是同一个文件描述符; 其它平台使用管道.
+ * 返回: 成功时返回 0 , 失败时返回 -1 . */
+static int
+doorbell_create(int fd[2]) {
+#if defined(__linux__)
+	int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0) {
+		return -1;
+	}
+	fd[0] = fd[1] = efd;
+#else
+	if (pipe(fd)) {
+		return -1;
+	}
+	sp_nonblocking(fd[0]);
+	sp_nonblocking(fd[1]);
+#endif
+	return 0;
+}
+
+/* 敲响 socket 线程 sh 的门铃. 门铃已经响着(计数不为 0 或者管道已满)时写入失败也无妨 */
+static void
+doorbell_ring(struct socket_shard *sh) {
+#if defined(__linux__)
+	uint64_t v = 1;
+#else
+	uint8_t v = 1;
+#endif
+	for (;;) {
+		if (write(sh->sendctrl_fd, &v, sizeof(v)) < 0 && errno == EINTR) {
+			continue;
+		}
+		return;
+	}
+}
+
+/* 清除门铃, 在 sp_wait 报告门铃可读之后调用 */
+static void
+doorbell_clear(struct socket_shard *sh) {
+	uint8_t buffer[64];
+	for (;;) {
+		int n = read(sh->recvctrl_fd, buffer, sizeof(buffer));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+#if defined(__linux__)
+		return;
+#else
+		if (n < sizeof(buffer))
+			return;
+#endif
+	}
+}
+
+/* 初始化一条 socket 线程的状态: 创建多路 I/O 事件对象和门铃, 并将门铃的读端添加到 I/O 事件通知列表中.
+ * 返回: 成功时返回 0 , 失败时返回 -1 . */
+static int
+shard_init(struct socket_shard *sh) {
 	int fd[2];
 	poll_fd efd = sp_create();
 	if (sp_invalid(efd)) {
 		fprintf(stderr, "socket-server: create event pool failed.\n");
-		return NULL;
+		return -1;
 	}
-	if (pipe(fd)) {
+	if (doorbell_create(fd)) {
 		sp_release(efd);
-		fprintf(stderr, "socket-server: create socket pair failed.\n");
-		return NULL;
+		fprintf(stderr, "socket-server: create doorbell failed.\n");
+		return -1;
 	}
-	/* 将接收命令端的文件描述符添加到 I/O 事件通知列表中, 当任何一步失败时都需要依次清理文件描述符,
-	 * 添加到 I/O 事件的原因在于可以不必时时检测管道中的命令, 而仅当 sp_wait 显示有事件时才去检测. */
+	/* 将门铃的读端添加到 I/O 事件通知列表中, 当任何一步失败时都需要依次清理文件描述符,
+	 * 添加到 I/O 事件的原因在于可以不必时时检测命令队列, 而仅当 sp_wait 显示有事件时才去检测. */
 	if (sp_add(efd, fd[0], NULL)) {
 		// add recvctrl_fd to event poll
 		fprintf(stderr, "socket-server: can't add server fd to event pool.\n");
 		close(fd[0]);
-		close(fd[1]);
+		if (fd[1] != fd[0]) {
+			close(fd[1]);
+		}
 		sp_release(efd);
-		return NULL;
+		return -1;
+	}
+	sh->inbox = NULL;
+	sh->cmd = NULL;
+	sh->udp = NULL;
+	memset(sh->read_cache, 0, sizeof(sh->read_cache));
+	sh->event_fd = efd;
+	sh->recvctrl_fd = fd[0];
+	sh->sendctrl_fd = fd[1];
+	sh->checkctrl = 1;
+	sh->event_n = 0;
+	sh->event_index = 0;
+	return 0;
+}
+
+/* 释放以缓冲的头部相连的接收缓冲链表 */
+static void
+read_list_free(void *buffer) {
+	while (buffer) {
+		void *next = *(void **)buffer;
+		FREE(buffer);
+		buffer = next;
+	}
+}
+
+/* 释放一条 socket 线程的门铃、多路 I/O 事件对象、还没有处理的命令以及空闲的接收缓冲 */
+static void
+shard_release(struct socket_shard *sh) {
+	struct request_node *list[2] = { sh->cmd, sh->inbox };
+	int i;
+	for (i=0;i<2;i++) {
+		struct request_node *node = list[i];
+		while (node) {
+			struct request_node *next = node->next;
+			FREE(node);
+			node = next;
+		}
+	}
+	FREE(sh->udp);
+	for (i=0;i<READ_POOL_CLASS;i++) {
+		read_list_free(sh->read_cache[i]);
+	}
+	if (sh->sendctrl_fd != sh->recvctrl_fd) {
+		close(sh->sendctrl_fd);
+	}
+	close(sh->recvctrl_fd);
+	sp_release(sh->event_fd);
+}
+
+/* 在初始化 socket_server 模块时创建套接字服务器对象, thread 为 socket 线程的数量, 每条线程有自己的命令管道和多路 I/O 事件对象.
+ * 返回: 成功时返回套接字服务器对象, 失败时返回 NULL. */
+struct socket_server * 
+socket_server_create(int thread) {
+	int i;
+	if (thread < 1) {
+		thread = 1;
+	} else if (thread > MAX_SOCKET_THREAD) {
+		thread = MAX_SOCKET_THREAD;
+	}
+	struct socket_shard *shard = MALLOC(thread * sizeof(struct socket_shard));
+	for (i=0;i<thread;i++) {
+		if (shard_init(&shard[i])) {
+			while (--i >= 0) {
+				shard_release(&shard[i]);
+			}
+			FREE(shard);
+			return NULL;
+		}
 	}
 
 	struct socket_server *ss = MALLOC(sizeof(*ss));
-	ss->event_fd = efd;
-	ss->recvctrl_fd = fd[0];
-	ss->sendctrl_fd = fd[1];
-	ss->checkctrl = 1;
+	ss->shard_n = thread;
+	ss->shard = shard;
 
-	/* 初始化套接字对象, 分配套接字起始点, 目前事件数量以及处理到的事件索引 */
+	/* 初始化套接字对象, 分配套接字起始点 */
 	for (i=0;i<MAX_SOCKET;i++) {
 		struct socket *s = &ss->slot[i];
 		s->type = SOCKET_TYPE_INVALID;
 		clear_wb_list(&s->high);
 		clear_wb_list(&s->low);
+		spinlock_init(&s->dw_lock);
 	}
 	ss->alloc_id = 0;
-	ss->event_n = 0;
-	ss->event_index = 0;
+	memset(ss->recycle, 0, sizeof(ss->recycle));
 	memset(&ss->soi, 0, sizeof(ss->soi));
-	FD_ZERO(&ss->rfds);
-	assert(ss->recvctrl_fd < FD_SETSIZE);
 
 	return ss;
 }
 
+/* 返回 socket 线程的数量 */
+int
+socket_server_thread(struct socket_server *ss) {
+	return ss->shard_n;
+}
+
 /* 释放掉整个写缓存队列, 并将队列重新置为原始状态 */
 static void
 free_wb_list(struct socket_server *ss, struct wb_list *list) {
@@ -383,11 +660,11 @@ free_wb_list(struct socket_server *ss, struct wb_list *list) {
 	list->tail = NULL;
 }
 
-/* 关闭套接字, 并释放其写入缓存队列的内存. 出参 result 会返回相应的套接字 id 和所属服务句柄.
- * 参数: ss 是套接字服务器; s 是目前需要关闭的套接字; result 为出参;
+/* 关闭套接字, 并释放其写入缓存队列以及直接写入剩余数据的内存. 出参 result 会返回相应的套接字 id 和所属服务句柄.
+ * 参数: ss 是套接字服务器; s 是目前需要关闭的套接字; l 是它的直接写入锁; result 为出参;
  * 返回: 此函数无返回值, 真正的返回值在出参中 */
 static void
-force_close(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+force_close(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message *result) {
 	result->id = s->id;
 	result->ud = 0;
 	result->data = NULL;
@@ -398,11 +675,19 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_message *r
 	}
 	/* 校验不是刚分配而没有实际使用的套接字 */
 	assert(s->type != SOCKET_TYPE_RESERVE);
+	/* 等待正在直接写入的工作线程写完再关闭文件描述符 */
+	socket_lock(l);
 	free_wb_list(ss,&s->high);
 	free_wb_list(ss,&s->low);
+	if (s->dw_buffer) {
+		struct send_object so;
+		send_object_init(ss, &so, (void *)s->dw_buffer, s->dw_size);
+		so.free_func((void *)s->dw_buffer);
+		s->dw_buffer = NULL;
+	}
 	/* 类型为 SOCKET_TYPE_PACCEPT 和 SOCKET_TYPE_PLISTEN 的套接字还没有加入 I/O 事件通知列表中 */
 	if (s->type != SOCKET_TYPE_PACCEPT && s->type != SOCKET_TYPE_PLISTEN) {
-		sp_del(ss->event_fd, s->fd);
+		sp_del(shard_of(ss, s->id)->event_fd, s->fd);
 	}
 	/* 类型为 SOCKET_TYPE_BIND 的套接字中的系统套接字描述符不是由此模块生成的, 因而不需要关闭 */
 	if (s->type != SOCKET_TYPE_BIND) {
@@ -411,6 +696,7 @@ force_close(struct socket_server *ss, struct socket *s, struct socket_message *r
 		}
 	}
 	s->type = SOCKET_TYPE_INVALID;
+	socket_unlock(l);
 }
 
 /* 关闭整个套接字服务器, 并且将释放所有的相关组件. */
@@ -421,12 +707,19 @@ socket_server_release(struct socket_server *ss) {
 	for (i=0;i<MAX_SOCKET;i++) {
 		struct socket *s = &ss->slot[i];
 		if (s->type != SOCKET_TYPE_RESERVE) {
-			force_close(ss, s , &dummy);
+			struct socket_lock l;
+			socket_lock_init(s, &l);
+			force_close(ss, s, &l, &dummy);
 		}
+		spinlock_destroy(&s->dw_lock);
+	}
+	for (i=0;i<ss->shard_n;i++) {
+		shard_release(&ss->shard[i]);
 	}
-	close(ss->sendctrl_fd);
-	close(ss->recvctrl_fd);
-	sp_release(ss->event_fd);
+	for (i=0;i<READ_POOL_CLASS;i++) {
+		read_list_free(ss->recycle[i].head);
+	}
+	FREE(ss->shard);
 	FREE(ss);
 }
 
@@ -450,7 +743,7 @@ new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque,
 	assert(s->type == SOCKET_TYPE_RESERVE);
 
 	if (add) {
-		if (sp_add(ss->event_fd, fd, s)) {
+		if (sp_add(shard_of(ss, id)->event_fd, fd, s)) {
 			s->type = SOCKET_TYPE_INVALID;
 			return NULL;
 		}
@@ -462,6 +755,9 @@ new_fd(struct socket_server *ss, int id, int fd, int protocol, uintptr_t opaque,
 	s->p.size = MIN_READ_BUFFER;
 	s->opaque = opaque;
 	s->wb_size = 0;
+	s->dw_buffer = NULL;
+	s->dw_size = 0;
+	s->dw_offset = 0;
 	check_wb_list(&s->high);
 	check_wb_list(&s->low);
 	return s;
@@ -533,8 +829,9 @@ open_socket(struct socket_server *ss, struct request_open * request, struct sock
 		/* 获取到对端的地址, 并且将其转化为字符串形式, 返回到 result 的 data 字段中 */
 		struct sockaddr * addr = ai_ptr->ai_addr;
 		void * sin_addr = (ai_ptr->ai_family == AF_INET) ? (void*)&((struct sockaddr_in *)addr)->sin_addr : (void*)&((struct sockaddr_in6 *)addr)->sin6_addr;
-		if (inet_ntop(ai_ptr->ai_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
-			result->data = ss->buffer;
+		struct socket_shard *sh = shard_of(ss, id);
+		if (inet_ntop(ai_ptr->ai_family, sin_addr, sh->buffer, sizeof(sh->buffer))) {
+			result->data = sh->buffer;
 		}
 		freeaddrinfo( ai_list );
 		return SOCKET_OPEN;
@@ -542,7 +839,7 @@ open_socket(struct socket_server *ss, struct request_open * request, struct sock
 		ns->type = SOCKET_TYPE_CONNECTING;
 		/* 对正在连接的套接字添加可写 I/O 事件侦听, 因为处于正在连接的状态下, 发送数据会被放到写入缓冲中去,
 		 * 添加写事件, 能够在第一时间发送缓冲中的数据, 同时更为重要的是连接成功时套接字会变为可写状态 */
-		sp_write(ss->event_fd, ns->fd, ns, true);
+		sp_write(shard_of(ss, id)->event_fd, ns->fd, ns, true);
 	}
 
 	freeaddrinfo( ai_list );
@@ -555,15 +852,24 @@ _failed:
 
 /* 发送 TCP 套接字中的写入缓冲数据, 当写入失败的情况下会关闭套接字 s , 关闭的结果填入出参 result, 函数返回 SOCKET_CLOSE.
  * 在写入成功的情况下返回值是 -1 , 但这并不表示队列中的内容全部都写完了, 当内核的写缓冲被写满的情况下也会返回 -1.
+ * 每次以 writev 将队列前面至多 MAX_IOV 个节点一起写入, 写完的节点被释放, 只写了一部分的节点留在队列头部.
  *
- * 参数: ss 是套接字服务器, s 是需要写数据的套接字, list 是写缓冲, 出参 result 仅当返回值为 SOCKET_CLOSE 的情况下会返回.
+ * 参数: ss 是套接字服务器, s 是需要写数据的套接字, list 是写缓冲, l 是直接写入锁, 出参 result 仅当返回值为 SOCKET_CLOSE 的情况下会返回.
  * 返回: -1 表示写入成功, SOCKET_CLOSE 表示写入失败并且套接字被关闭 */
 static int
-send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
+send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_lock *l, struct socket_message *result) {
+	struct iovec iov[MAX_IOV];
 	while (list->head) {
-		struct write_buffer * tmp = list->head;
+		int n = 0;
+		struct write_buffer * tmp;
+		for (tmp = list->head; tmp && n < MAX_IOV; tmp = tmp->next) {
+			iov[n].iov_base = tmp->ptr;
+			iov[n].iov_len = tmp->sz;
+			++n;
+		}
+		ssize_t sz;
 		for (;;) {
-			int sz = write(s->fd, tmp->ptr, tmp->sz);
+			sz = writev(s->fd, iov, n);
 			if (sz < 0) {
 				/* 只有在被信号中断的情况重新写入, 只有在内核写缓冲被写满的情况返回成功,
 				 * 其它 errno 均表示写入失败. */
@@ -573,20 +879,24 @@ send_list_tcp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 				case AGAIN_WOULDBLOCK:
 					return -1;
 				}
-				force_close(ss,s, result);
+				force_close(ss,s,l,result);
 				return SOCKET_CLOSE;
 			}
-			s->wb_size -= sz;
-			/* 写入的大小小于缓冲的大小, 说明内核写缓冲已经被写满了, 此时将不再发送数据 */
-			if (sz != tmp->sz) {
+			break;
+		}
+		s->wb_size -= sz;
+		/* 依次释放写完的节点. 写入的字节数不足以写完一个节点, 说明内核写缓冲已经被写满了, 此时将不再发送数据 */
+		while (n-- > 0) {
+			tmp = list->head;
+			if (sz < tmp->sz) {
 				tmp->ptr += sz;
 				tmp->sz -= sz;
 				return -1;
 			}
-			break;
+			sz -= tmp->sz;
+			list->head = tmp->next;
+			write_buffer_free(ss,tmp);
 		}
-		list->head = tmp->next;
-		write_buffer_free(ss,tmp);
 	}
 	list->tail = NULL;
 
@@ -623,17 +933,54 @@ udp_socket_address(struct socket *s, const uint8_t udp_address[UDP_ADDRESS_SIZE]
 	return 0;
 }
 
-/* 发送 UDP 套接字中的写入缓冲数据, 当写入失败的情况下不会关闭套接字, 此函数每次发送一个写缓冲节点, 并且不检查是否发送的字节数 .
+/* 以一次系统调用发送若干个 udp 数据包, linux 下使用 sendmmsg , 其它平台逐个调用 sendto .
+ * 返回: 发送成功的数据包数量, 第一个数据包就发送失败时返回 -1 并设置 errno . */
+static int
+udp_send_batch(int fd, struct write_buffer **wb, union sockaddr_all *sa, socklen_t *sasz, int n) {
+#if defined(__linux__)
+	struct mmsghdr msg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	int i;
+	for (i=0;i<n;i++) {
+		iov[i].iov_base = wb[i]->ptr;
+		iov[i].iov_len = wb[i]->sz;
+		memset(&msg[i].msg_hdr, 0, sizeof(msg[i].msg_hdr));
+		msg[i].msg_hdr.msg_name = &sa[i];
+		msg[i].msg_hdr.msg_namelen = sasz[i];
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
+	return sendmmsg(fd, msg, n, 0);
+#else
+	int i;
+	for (i=0;i<n;i++) {
+		if (sendto(fd, wb[i]->ptr, wb[i]->sz, 0, &sa[i].s, sasz[i]) < 0) {
+			return i == 0 ? -1 : i;
+		}
+	}
+	return n;
+#endif
+}
+
+/* 发送 UDP 套接字中的写入缓冲数据, 当写入失败的情况下不会关闭套接字, 此函数每次以一次系统调用发送至多 UDP_BATCH 个写缓冲节点,
+ * 并且不检查是否发送的字节数. 发送失败的节点留在队列头部, 等待下一次可写事件再发送.
  * 参数: ss 是套接字服务器; s 是写入缓冲所属的套接字; list 是写入缓冲队列; 出参 result 未使用;
  * 返回: 不论是成功还是失败, 此函数均返回 -1 . */
 static int
 send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
+	struct write_buffer * wb[UDP_BATCH];
+	union sockaddr_all sa[UDP_BATCH];
+	socklen_t sasz[UDP_BATCH];
 	while (list->head) {
-		struct write_buffer * tmp = list->head;
-		union sockaddr_all sa;
-		socklen_t sasz = udp_socket_address(s, tmp->udp_address, &sa);
-		int err = sendto(s->fd, tmp->ptr, tmp->sz, 0, &sa.s, sasz);
-		if (err < 0) {
+		int n = 0;
+		struct write_buffer * tmp;
+		for (tmp = list->head; tmp && n < UDP_BATCH; tmp = tmp->next) {
+			wb[n] = tmp;
+			sasz[n] = udp_socket_address(s, tmp->udp_address, &sa[n]);
+			++n;
+		}
+		int sent = udp_send_batch(s->fd, wb, sa, sasz, n);
+		if (sent < 0) {
 			switch(errno) {
 			case EINTR:
 			case AGAIN_WOULDBLOCK:
@@ -652,9 +999,13 @@ send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 */
 		}
 
-		s->wb_size -= tmp->sz;
-		list->head = tmp->next;
-		write_buffer_free(ss,tmp);
+		int i;
+		for (i=0;i<sent;i++) {
+			tmp = list->head;
+			s->wb_size -= tmp->sz;
+			list->head = tmp->next;
+			write_buffer_free(ss,tmp);
+		}
 	}
 	list->tail = NULL;
 
@@ -662,12 +1013,12 @@ send_list_udp(struct socket_server *ss, struct socket *s, struct wb_list *list,
 }
 
 /* 发送写缓冲中的所有数据, 此函数能够处理 TCP 和 UDP 两种协议的写缓冲. 在 TCP 协议下如果发送失败将导致套接字关闭.
- * 参数: ss 是套接字服务器; s 是发送数据的套接字; list 是写缓冲队列; 出参 result 接收套接字关闭结果;
+ * 参数: ss 是套接字服务器; s 是发送数据的套接字; list 是写缓冲队列; l 是直接写入锁; 出参 result 接收套接字关闭结果;
  * 返回: -1 表示成功发送, SOCKET_CLOSE 表示写入失败并且套接字被关闭  */
 static int
-send_list(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_message *result) {
+send_list(struct socket_server *ss, struct socket *s, struct wb_list *list, struct socket_lock *l, struct socket_message *result) {
 	if (s->protocol == PROTOCOL_TCP) {
-		return send_list_tcp(ss, s, list, result);
+		return send_list_tcp(ss, s, list, l, result);
 	} else {
 		return send_list_udp(ss, s, list, result);
 	}
@@ -702,54 +1053,6 @@ raise_uncomplete(struct socket * s) {
 	high->head = high->tail = tmp;
 }
 
-/*
- *  Each socket has two write buffer list, high priority and low priority.
-
-	1. send high list as far as possible.
-	2. If high list is empty, try to send low list.
-	3. If low list head is uncomplete (send a part before), move the head of low list to empty high list (call raise_uncomplete) .
-	4. If two lists are both empty, turn off the event. (call check_close)
- */
-
-/* 发送套接字中的写缓冲, 首先函数会发送高权限队列中数据, 当这个队列变为空的情况下将发送低权限缓冲队列中的数据.
- * 如果低权限写缓冲队列中的一个结点没有被完全发送出去, 将移动到空的高权限队列的头结点中去. 如果在未发送低权限写缓冲
- * 队列之前此队列已经是空的, 那么将关闭可写事件的侦听.
- *
- * 参数: ss 是套接字服务器; s 是需要发送数据的套接字; 出参 result 用于接收套接字关闭的结果;
- * 返回: -1 表示正确写入了, SOCKET_CLOSE 表示写入错误, 最终导致套接字关闭 */
-static int
-send_buffer(struct socket_server *ss, struct socket *s, struct socket_message *result) {
-	assert(!list_uncomplete(&s->low));
-	// step 1
-	if (send_list(ss,s,&s->high,result) == SOCKET_CLOSE) {
-		return SOCKET_CLOSE;
-	}
-	if (s->high.head == NULL) {
-		// step 2
-		if (s->low.head != NULL) {
-			if (send_list(ss,s,&s->low,result) == SOCKET_CLOSE) {
-				return SOCKET_CLOSE;
-			}
-			// step 3
-			if (list_uncomplete(&s->low)) {
-				raise_uncomplete(s);
-			}
-		} else {
-			// step 4
-			/* 在低权限写缓冲发送之前, 高低权限的写缓冲队列都是空的, 将可写事件的侦听关闭,
-			 * 并关闭处于半关闭状态的套接字 */
-			sp_write(ss->event_fd, s->fd, s, false);
-
-			if (s->type == SOCKET_TYPE_HALFCLOSE) {
-				force_close(ss, s, result);
-				return SOCKET_CLOSE;
-			}
-		}
-	}
-
-	return -1;
-}
-
 /* 将发送数据添加到缓冲队列中去, 函数将先构建一个写缓冲再添加到队列中去. request 中包含了发送数据,
  * 对于不同类型的发送数据用 size 表示不同写缓冲的大小, n 表示从原始发送数据中第几个字节开始是还没有发送的数据.
  *
@@ -814,9 +1117,88 @@ send_buffer_empty(struct socket *s) {
 	return (s->high.head == NULL && s->low.head == NULL);
 }
 
+/* 将工作线程直接写入时没有写完的数据放到高权限写缓冲队列中. 直接写入只发生在写缓冲为空的时候, 而之后 socket 线程
+ * 修改写缓冲之前总是先调用此函数, 因而此时写缓冲一定还是空的. 调用者需要持有直接写入锁.
+ * 返回: 是否有直接写入的剩余数据 */
+static int
+raise_direct_write(struct socket_server *ss, struct socket *s) {
+	if (s->dw_buffer == NULL)
+		return 0;
+	assert(send_buffer_empty(s));
+	struct request_send request;
+	request.id = s->id;
+	request.sz = s->dw_size;
+	request.buffer = (char *)s->dw_buffer;
+	append_sendbuffer(ss, s, &request, s->dw_offset);
+	s->dw_buffer = NULL;
+	return 1;
+}
+
+/*
+ *  Each socket has two write buffer list, high priority and low priority.
+
+	1. send high list as far as possible.
+	2. If high list is empty, try to send low list.
+	3. If low list head is uncomplete (send a part before), move the head of low list to empty high list (call raise_uncomplete) .
+	4. If two lists are both empty, turn off the event. (call check_close)
+
+	The rest of a direct write (see socket_server_send) is raised to high list before all of these.
+ */
+
+static int
+send_buffer_(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message *result) {
+	assert(!list_uncomplete(&s->low));
+	// step 1
+	if (send_list(ss,s,&s->high,l,result) == SOCKET_CLOSE) {
+		return SOCKET_CLOSE;
+	}
+	if (s->high.head == NULL) {
+		// step 2
+		if (s->low.head != NULL) {
+			if (send_list(ss,s,&s->low,l,result) == SOCKET_CLOSE) {
+				return SOCKET_CLOSE;
+			}
+			// step 3
+			if (list_uncomplete(&s->low)) {
+				raise_uncomplete(s);
+			}
+		} else {
+			// step 4
+			/* 在低权限写缓冲发送之前, 高低权限的写缓冲队列都是空的, 将可写事件的侦听关闭,
+			 * 并关闭处于半关闭状态的套接字 */
+			sp_write(shard_of(ss, s->id)->event_fd, s->fd, s, false);
+
+			if (s->type == SOCKET_TYPE_HALFCLOSE) {
+				force_close(ss, s, l, result);
+				return SOCKET_CLOSE;
+			}
+		}
+	}
+
+	return -1;
+}
+
+/* 发送套接字中的写缓冲, 首先函数会发送高权限队列中数据, 当这个队列变为空的情况下将发送低权限缓冲队列中的数据.
+ * 如果低权限写缓冲队列中的一个结点没有被完全发送出去, 将移动到空的高权限队列的头结点中去. 如果在未发送低权限写缓冲
+ * 队列之前此队列已经是空的, 那么将关闭可写事件的侦听. 工作线程正在直接写入时不发送, 等待下一次可写事件.
+ *
+ * 参数: ss 是套接字服务器; s 是需要发送数据的套接字; l 是直接写入锁; 出参 result 用于接收套接字关闭的结果;
+ * 返回: -1 表示正确写入了或者没有写入, SOCKET_CLOSE 表示写入错误, 最终导致套接字关闭 */
+static int
+send_buffer(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message *result) {
+	if (!socket_trylock(l))
+		return -1;	// blocked by direct write, send later.
+	raise_direct_write(ss, s);
+	int r = send_buffer_(ss,s,l,result);
+	socket_unlock(l);
+
+	return r;
+}
+
 /*
 	When send a package , we can assign the priority : PRIORITY_HIGH or PRIORITY_LOW
 
+	If a worker thread has written a part directly (see socket_server_send), raise the rest to the head of high list first.
 	If socket buffer is empty, write to fd directly.
 		If write a part, append the rest part to high list. (Even priority is PRIORITY_LOW)
 	Else append package to high (PRIORITY_HIGH) or low (PRIORITY_LOW) list.
@@ -831,7 +1213,7 @@ send_buffer_empty(struct socket *s) {
  *
  * 返回: 发送成功时将返回 -1 , 如果发送失败将关闭套接字并返回 SOCKET_CLOSE */
 static int
-send_socket(struct socket_server *ss, struct request_send * request, struct socket_message *result, int priority, const uint8_t *udp_address) {
+send_socket_(struct socket_server *ss, struct request_send * request, struct socket_lock *l, struct socket_message *result, int priority, const uint8_t *udp_address) {
 	int id = request->id;
 	struct socket * s = &ss->slot[HASH_ID(id)];
 
@@ -865,7 +1247,7 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 					break;
 				default:
 					fprintf(stderr, "socket-server: write to %d (fd=%d) error :%s.\n",id,s->fd,strerror(errno));
-					force_close(ss,s,result);
+					force_close(ss,s,l,result);
 					so.free_func(request->buffer);
 					return SOCKET_CLOSE;
 				}
@@ -895,7 +1277,7 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 		}
 
 		/* 执行到此处表示有一部分数据被放到了队列中去了, 因而需要添加一个可写事件侦听 */
-		sp_write(ss->event_fd, s->fd, s, true);
+		sp_write(shard_of(ss, id)->event_fd, s->fd, s, true);
 	} else {
 		if (s->protocol == PROTOCOL_TCP) {
 			if (priority == PRIORITY_LOW) {
@@ -913,6 +1295,36 @@ send_socket(struct socket_server *ss, struct request_send * request, struct sock
 	return -1;
 }
 
+/* TCP 套接字在持有直接写入锁的情况下发送, 先将工作线程直接写入的剩余数据放回写缓冲队列 */
+static int
+send_socket(struct socket_server *ss, struct request_send * request, struct socket_message *result, int priority, const uint8_t *udp_address) {
+	int id = request->id;
+	struct socket * s = &ss->slot[HASH_ID(id)];
+	struct socket_lock l;
+	socket_lock_init(s, &l);
+	if (s->id != id || s->protocol != PROTOCOL_TCP) {
+		return send_socket_(ss, request, &l, result, priority, udp_address);
+	}
+	socket_lock(&l);
+	if (raise_direct_write(ss, s) && s->type != SOCKET_TYPE_INVALID) {
+		sp_write(shard_of(ss, id)->event_fd, s->fd, s, true);
+	}
+	int r = send_socket_(ss, request, &l, result, priority, udp_address);
+	socket_unlock(&l);
+	return r;
+}
+
+/* 工作线程直接写入了一部分数据之后, 通知 socket 线程开启可写事件侦听, 以便接着发送剩余的数据 */
+static int
+trigger_write(struct socket_server *ss, struct request_send * request, struct socket_message *result) {
+	int id = request->id;
+	struct socket * s = &ss->slot[HASH_ID(id)];
+	if (s->type == SOCKET_TYPE_INVALID || s->id != id)
+		return -1;
+	sp_write(shard_of(ss, id)->event_fd, s->fd, s, true);
+	return -1;
+}
+
 /* 将已经处于 LISTEN 状态的套接字文件描述符与 skynet 的套接字关联. 如果失败将由出参 result 提示失败的原因.
  * 如果成功, 套接字的状态类型将变为 SOCKET_TYPE_PLISTEN , 失败时将变为 SOCKET_TYPE_INVALID 并且文件描述将被关闭.
  *
@@ -961,20 +1373,28 @@ close_socket(struct socket_server *ss, struct request_close *request, struct soc
 		result->data = NULL;
 		return SOCKET_CLOSE;
 	}
+	struct socket_lock l;
+	socket_lock_init(s, &l);
+	socket_lock(&l);
+	raise_direct_write(ss, s);
 	if (!send_buffer_empty(s)) { 
-		int type = send_buffer(ss,s,result);
-		if (type != -1)
+		int type = send_buffer(ss,s,&l,result);
+		if (type != -1) {
+			socket_unlock(&l);
 			return type;
+		}
 	}
 	/* 当要求立即关闭或者发送缓冲已经为空的情况下, 将关闭套接字并返回关闭 */
 	if (request->shutdown || send_buffer_empty(s)) {
-		force_close(ss,s,result);
+		force_close(ss,s,&l,result);
+		socket_unlock(&l);
 		result->id = id;
 		result->opaque = request->opaque;
 		return SOCKET_CLOSE;
 	}
 	/* 其它情况返回半关闭的状态 */
 	s->type = SOCKET_TYPE_HALFCLOSE;
+	socket_unlock(&l);
 
 	return -1;
 }
@@ -1022,8 +1442,10 @@ start_socket(struct socket_server *ss, struct request_start *request, struct soc
 	/* 将两种状态下的套接字推进并接收 I/O 事件, 失败将导致套接字关闭;
 	 * 需要注意的是状态推进和转移将导致套接字的 opaque 发生变化. */
 	if (s->type == SOCKET_TYPE_PACCEPT || s->type == SOCKET_TYPE_PLISTEN) {
-		if (sp_add(ss->event_fd, s->fd, s)) {
-			force_close(ss, s, result);
+		if (sp_add(shard_of(ss, id)->event_fd, s->fd, s)) {
+			struct socket_lock l;
+			socket_lock_init(s, &l);
+			force_close(ss, s, &l, result);
 			result->data = strerror(errno);
 			return SOCKET_ERROR;
 		}
@@ -1055,42 +1477,24 @@ setopt_socket(struct socket_server *ss, struct request_setopt *request) {
 	setsockopt(s->fd, IPPROTO_TCP, request->what, &v, sizeof(v));
 }
 
-/* 从管道中读取数据并保存在缓冲中, 管道中的数据大小一定是 sz , 并且保证小于 256 个字节, 这是由 skynet 系统保证的.
- * 参数: pipefd 是管道的文件描述符; buffer 是接收数据的缓冲; sz 是数据的大小, 保证管道中一定是等量的.
- * 返回: 函数无返回值 */
+/* 从命令队列中取走所有的命令作为一批, 反转为压入的顺序后接在 cmd 之后. 每次 I/O 事件循环只取一批,
+ * 之后压入的命令会敲响门铃, 留待下一次事件循环处理, 命令再多也不会耽误 I/O 事件.
+ * 参数: sh 是当前 socket 线程;
+ * 函数无返回值 */
 static void
-block_readpipe(int pipefd, void *buffer, int sz) {
-	for (;;) {
-		int n = read(pipefd, buffer, sz);
-		if (n<0) {
-			/* 如果被中断则再次执行, 否则意味着出现了别的错误 */
-			if (errno == EINTR)
-				continue;
-			fprintf(stderr, "socket-server : read pipe error %s.\n",strerror(errno));
-			return;
-		}
-		// must atomic read from a pipe
-		assert(n == sz);
+take_cmd(struct socket_shard *sh) {
+	if (ATOM_LOAD(&sh->inbox) == NULL) {
 		return;
 	}
-}
-
-/* 检查是否有命令, 方式是检查接收命令的管道文件描述符是否有可读事件. 此函数是非阻塞的. 不论是否有数据都将立即返回.
- * 虽然管道的两个文件描述符是阻塞的, 但是此检查函数却是非阻塞的.
- * 参数: ss 是套接字服务器;
- * 返回: 1 表示有命令, 0 表示没有命令. */
-static int
-has_cmd(struct socket_server *ss) {
-	struct timeval tv = {0,0};
-	int retval;
-
-	FD_SET(ss->recvctrl_fd, &ss->rfds);
-
-	retval = select(ss->recvctrl_fd+1, &ss->rfds, NULL, NULL, &tv);
-	if (retval == 1) {
-		return 1;
+	struct request_node *stack = ATOM_XCHG(&sh->inbox, NULL);
+	struct request_node *list = sh->cmd;
+	while (stack) {
+		struct request_node *next = stack->next;
+		stack->next = list;
+		list = stack;
+		stack = next;
 	}
-	return 0;
+	sh->cmd = list;
 }
 
 /* 增加一个 UDP 的套接字, 参数 udp 中包含预先分配好的系统 UDP 套接字文件描述符和套接字插槽.
@@ -1147,23 +1551,14 @@ set_udp_address(struct socket_server *ss, struct request_setudp *request, struct
 }
 
 // return type
-/* 从管道中读取命令并执行相应的命令, 把执行的结果放入出参 result 中返回, 调用者可以依据函数的返回值和 result 来决定下一步的动作.
+/* 执行一条命令, 把执行的结果放入出参 result 中返回, 调用者可以依据函数的返回值和 result 来决定下一步的动作.
  * 结果为 -1 表示套接字状态未发生改变, 通常调用者可以继续下一次的调用, 如 socket_server_poll 函数所为. 如果套接字的状态
  * 发生了改变, 如关闭(SOCKET_CLOSE)、出错(SOCKET_ERROR)、打开(SOCKET_OPEN)、服务器退出(SOCKET_EXIT) 将返回给调用者.
  *
- * 参数: ss 是套接字服务器; 出参 result 用于接收命令处理的结果;
+ * 参数: ss 是套接字服务器; type 是命令的类型; buffer 是请求体, 只涉及当前 socket 线程的套接字; 出参 result 用于接收命令处理的结果;
  * 返回: -1 表示状态不发生改变, 其它值在 socket_server.h 中定义的 7 中状态中的一种, 表示状态发生了改变. */
 static int
-ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
-	int fd = ss->recvctrl_fd;
-	// the length of message is one byte, so 256+8 buffer size is enough.
-	uint8_t buffer[256];
-	uint8_t header[2];
-	block_readpipe(fd, header, sizeof(header));
-	int type = header[0];
-	int len = header[1];
-	block_readpipe(fd, buffer, len);
-	// ctrl command only exist in local fd, so don't worry about endian.
+ctrl_cmd(struct socket_server *ss, int type, char *buffer, struct socket_message *result) {
 	switch (type) {
 	case 'S':
 		return start_socket(ss,(struct request_start *)buffer, result);
@@ -1183,9 +1578,14 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 		result->data = NULL;
 		return SOCKET_EXIT;
 	case 'D':
-		return send_socket(ss, (struct request_send *)buffer, result, PRIORITY_HIGH, NULL);
-	case 'P':
-		return send_socket(ss, (struct request_send *)buffer, result, PRIORITY_LOW, NULL);
+	case 'P': {
+		struct request_send * request = (struct request_send *)buffer;
+		int ret = send_socket(ss, request, result, type == 'D' ? PRIORITY_HIGH : PRIORITY_LOW, NULL);
+		if (request->ref) {
+			dec_sending_ref(ss, request->id);
+		}
+		return ret;
+	}
 	case 'A': {
 		struct request_send_udp * rsu = (struct request_send_udp *)buffer;
 		return send_socket(ss, &rsu->send, result, PRIORITY_HIGH, rsu->address);
@@ -1198,6 +1598,8 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	case 'U':
 		add_udp_socket(ss, (struct request_udp *)buffer);
 		return -1;
+	case 'W':
+		return trigger_write(ss, (struct request_send *)buffer, result);
 	default:
 		fprintf(stderr, "socket-server: Unknown ctrl %c.\n",type);
 		return -1;
@@ -1206,19 +1608,92 @@ ctrl_cmd(struct socket_server *ss, struct socket_message *result) {
 	return -1;
 }
 
+/* 大小为 sz 字节的接收缓冲所属的级别, 即不小于 sz 的最小级别. 返回值不小于 READ_POOL_CLASS 时表示不属于缓冲池. */
+static inline int
+read_class(int sz) {
+	int c = 0;
+	int size = MIN_READ_BUFFER;
+	while (size < sz && c < READ_POOL_CLASS) {
+		size <<= 1;
+		++c;
+	}
+	return c;
+}
+
+/* 从缓冲池中取出一个第 c 级的接收缓冲. 先从本线程的缓存中取, 缓存用完时取走整个回收栈, 都没有时返回 NULL . */
+static void *
+read_take(struct socket_server *ss, struct socket_shard *sh, int c) {
+	void *buffer = sh->read_cache[c];
+	if (buffer == NULL) {
+		struct read_pool *pool = &ss->recycle[c];
+		if (ATOM_LOAD(&pool->head) == NULL) {
+			return NULL;
+		}
+		buffer = ATOM_XCHG(&pool->head, NULL);
+		ATOM_XCHG(&pool->count, 0);
+	}
+	sh->read_cache[c] = *(void **)buffer;
+	return buffer;
+}
+
+/* 分配一个至少 sz 字节的接收缓冲, 缓冲池中没有时以 MALLOC 分配.
+ * 缓冲池中的缓冲也是 MALLOC 分配的, 大小恰好是所属级别的大小, 所以服务以 FREE 释放缓冲同样是正确的. */
+static void *
+read_alloc(struct socket_server *ss, struct socket_shard *sh, int sz) {
+	int c = read_class(sz);
+	if (c >= READ_POOL_CLASS) {
+		return MALLOC(sz);
+	}
+	void *buffer = read_take(ss, sh, c);
+	if (buffer == NULL) {
+		buffer = MALLOC(MIN_READ_BUFFER << c);
+	}
+	return buffer;
+}
+
+/* 将 socket 线程自己没有交出去的接收缓冲放回本线程的缓存, sz 为分配时的大小 */
+static inline void
+read_free(struct socket_shard *sh, void *buffer, int sz) {
+	int c = read_class(sz);
+	if (c >= READ_POOL_CLASS) {
+		FREE(buffer);
+		return;
+	}
+	*(void **)buffer = sh->read_cache[c];
+	sh->read_cache[c] = buffer;
+}
+
+/* 服务只知道数据的长度, 按长度归还的缓冲会落到数据所属的级别. 读到的数据 n 不到缓冲 sz 的一半时,
+ * 若缓冲池中有数据所属级别的缓冲, 就把数据移过去, 原来的缓冲留在本线程再次使用, 使各级别的取出与归还大致相等. */
+static void *
+read_fit(struct socket_server *ss, struct socket_shard *sh, void *buffer, int sz, int n) {
+	int c = read_class(n);
+	if (c >= read_class(sz)) {
+		return buffer;
+	}
+	void *fit = read_take(ss, sh, c);
+	if (fit == NULL) {
+		return buffer;
+	}
+	memcpy(fit, buffer, n);
+	read_free(sh, buffer, sz);
+	return fit;
+}
+
 // return -1 (ignore) when error
 /* 从 TCP 类型的套接字中读取数据并将数据放入到 result 中, 如果成功将返回 SOCKET_DATA 并携带数据.
  * 在出错或关闭的情况下, result 将携带关闭信息. 其它情况下返回 -1 并且 result 不携带任何信息.
  *
- * 参数: ss 是套接字服务器; s 是需要读取数据的套接字; 出参 result 用于接收数据读取结果;
+ * 参数: ss 是套接字服务器; s 是需要读取数据的套接字; l 是直接写入锁; 出参 result 用于接收数据读取结果;
  * 返回: SOCKET_DATA 表明有数据, SOCKET_ERROR 表示读取出错, SOCKET_CLOSE 表示套接字已经关闭, -1 表示状态不改变. */
 static int
-forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_message * result) {
+forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
+	struct socket_shard *sh = shard_of(ss, s->id);
 	int sz = s->p.size;
-	char * buffer = MALLOC(sz);
+	char * buffer = read_alloc(ss, sh, sz);
 	int n = (int)read(s->fd, buffer, sz);
 	if (n<0) {
-		FREE(buffer);
+		read_free(sh, buffer, sz);
 		switch(errno) {
 		case EINTR:
 			break;
@@ -1227,7 +1702,7 @@ forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_me
 			break;
 		default:
 			// close when error
-			force_close(ss, s, result);
+			force_close(ss, s, l, result);
 			result->data = strerror(errno);
 			return SOCKET_ERROR;
 		}
@@ -1235,14 +1710,14 @@ forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_me
 	}
 	/* [ck]在可读的情况下读取的数据量为 0 , 表明对端关闭了套接字[/ck] */
 	if (n==0) {
-		FREE(buffer);
-		force_close(ss, s, result);
+		read_free(sh, buffer, sz);
+		force_close(ss, s, l, result);
 		return SOCKET_CLOSE;
 	}
 
 	if (s->type == SOCKET_TYPE_HALFCLOSE) {
 		// discard recv data
-		FREE(buffer);
+		read_free(sh, buffer, sz);
 		return -1;
 	}
 
@@ -1255,7 +1730,7 @@ forward_message_tcp(struct socket_server *ss, struct socket *s, struct socket_me
 	result->opaque = s->opaque;
 	result->id = s->id;
 	result->ud = n;
-	result->data = buffer;
+	result->data = read_fit(ss, sh, buffer, sz, n);
 	return SOCKET_DATA;
 }
 
@@ -1282,49 +1757,101 @@ gen_udp_address(int protocol, union sockaddr_all *sa, uint8_t * udp_address) {
 	return addrsz;
 }
 
+/* 以一次系统调用从 udp 套接字 fd 中接收若干个数据包放入 b 中, linux 下使用 recvmmsg , 其它平台调用一次 recvfrom .
+ * 返回: 接收到的数据包数量, 失败时返回 -1 并设置 errno . */
+static int
+udp_recv_batch(int fd, struct udp_batch *b) {
+#if defined(__linux__)
+	struct mmsghdr msg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	int i;
+	for (i=0;i<UDP_BATCH;i++) {
+		iov[i].iov_base = b->buffer[i];
+		iov[i].iov_len = MAX_UDP_PACKAGE;
+		memset(&msg[i].msg_hdr, 0, sizeof(msg[i].msg_hdr));
+		msg[i].msg_hdr.msg_name = &b->addr[i];
+		msg[i].msg_hdr.msg_namelen = sizeof(b->addr[i]);
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
+	int n = recvmmsg(fd, msg, UDP_BATCH, 0, NULL);
+	for (i=0;i<n;i++) {
+		b->size[i] = msg[i].msg_len;
+		b->addrsz[i] = msg[i].msg_hdr.msg_namelen;
+	}
+	return n;
+#else
+	b->addrsz[0] = sizeof(b->addr[0]);
+	int n = recvfrom(fd, b->buffer[0], MAX_UDP_PACKAGE, 0, &b->addr[0].s, &b->addrsz[0]);
+	if (n < 0)
+		return -1;
+	b->size[0] = n;
+	return 1;
+#endif
+}
+
 /* 从 UDP 或者 UDPv6 类型的套接字中读取数据, 得到的数据将通过 result 回传给调用者, 最终成功将返回 SOCKET_UDP .
+ * 数据包以 udp_recv_batch 成批接收, 每次调用交出一个, 这一批交完之后才再次接收. 调用者在返回 SOCKET_UDP 之后
+ * 会再次以同一个套接字调用此函数, 直到返回 -1 .
  * 如果发生了错误将导致套接字被关闭, 并且返回 SOCKET_ERROR , result 中包含关闭信息. 其它情况下将返回 -1 并且不读取任何数据.
  *
- * 参数: ss 是套接字服务器; s 是需要读取数据的套接字; 出参 result 用于接收数据, 也有可能是关闭的信息;
+ * 参数: ss 是套接字服务器; s 是需要读取数据的套接字; l 是直接写入锁; 出参 result 用于接收数据, 也有可能是关闭的信息;
  * 返回: SOCKET_UDP 表示读取成功; SOCKET_ERROR 表示读取出错; -1 表示状态不发生改变; */
 static int
-forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_message * result) {
-	union sockaddr_all sa;
-	socklen_t slen = sizeof(sa);
-	int n = recvfrom(s->fd, ss->udpbuffer,MAX_UDP_PACKAGE,0,&sa.s,&slen);
-	if (n<0) {
-		switch(errno) {
-		case EINTR:
-		case AGAIN_WOULDBLOCK:
-			break;
-		default:
-			// close when error
-			force_close(ss, s, result);
-			result->data = strerror(errno);
-			return SOCKET_ERROR;
-		}
-		return -1;
-	}
-	uint8_t * data;
-	if (slen == sizeof(sa.v4)) {
-		if (s->protocol != PROTOCOL_UDP)
-			return -1;
-		data = MALLOC(n + 1 + 2 + 4);
-		gen_udp_address(PROTOCOL_UDP, &sa, data + n);
-	} else {
-		if (s->protocol != PROTOCOL_UDPv6)
-			return -1;
-		data = MALLOC(n + 1 + 2 + 16);
-		gen_udp_address(PROTOCOL_UDPv6, &sa, data + n);
+forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message * result) {
+	struct socket_shard *sh = shard_of(ss, s->id);
+	struct udp_batch *b = sh->udp;
+	if (b == NULL) {
+		b = sh->udp = MALLOC(sizeof(*b));
+		b->id = -1;
+		b->n = 0;
+		b->index = 0;
 	}
-	memcpy(data, ss->udpbuffer, n);
+	for (;;) {
+		/* 上一批数据包已经交完, 或者属于别的套接字(套接字在交完之前被关闭了), 接收新的一批 */
+		if (b->id != s->id || b->index >= b->n) {
+			int n = udp_recv_batch(s->fd, b);
+			b->id = s->id;
+			b->index = 0;
+			b->n = n < 0 ? 0 : n;
+			if (n<0) {
+				switch(errno) {
+				case EINTR:
+				case AGAIN_WOULDBLOCK:
+					break;
+				default:
+					// close when error
+					force_close(ss, s, l, result);
+					result->data = strerror(errno);
+					return SOCKET_ERROR;
+				}
+				return -1;
+			}
+		}
+		int i = b->index++;
+		int n = b->size[i];
+		union sockaddr_all *sa = &b->addr[i];
+		uint8_t * data;
+		if (b->addrsz[i] == sizeof(sa->v4)) {
+			if (s->protocol != PROTOCOL_UDP)
+				continue;
+			data = MALLOC(n + 1 + 2 + 4);
+			gen_udp_address(PROTOCOL_UDP, sa, data + n);
+		} else {
+			if (s->protocol != PROTOCOL_UDPv6)
+				continue;
+			data = MALLOC(n + 1 + 2 + 16);
+			gen_udp_address(PROTOCOL_UDPv6, sa, data + n);
+		}
+		memcpy(data, b->buffer[i], n);
 
-	result->opaque = s->opaque;
-	result->id = s->id;
-	result->ud = n;
-	result->data = (char *)data;
+		result->opaque = s->opaque;
+		result->id = s->id;
+		result->ud = n;
+		result->data = (char *)data;
 
-	return SOCKET_UDP;
+		return SOCKET_UDP;
+	}
 }
 
 /* 报告连接是否完成, 当套接字连接时不能马上完成时, 可以通过 poll 函数来检测套接字的可写状态. 如果可写表示连接完成.
@@ -1333,12 +1860,12 @@ forward_message_udp(struct socket_server *ss, struct socket *s, struct socket_me
  * 参数: ss 是套接字服务器; s 是未完成连接的套接字; 出参 result 用于接收连接成功的信息或者失败关闭的信息;
  * 返回: 成功时返回 SOCKET_OPEN , 失败时将导致套接字关闭并返回 SOCKET_ERROR . */
 static int
-report_connect(struct socket_server *ss, struct socket *s, struct socket_message *result) {
+report_connect(struct socket_server *ss, struct socket *s, struct socket_lock *l, struct socket_message *result) {
 	int error;
 	socklen_t len = sizeof(error);  
 	int code = getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &error, &len);
 	if (code < 0 || error) {
-		force_close(ss,s, result);
+		force_close(ss,s,l,result);
 		/* code 有可能大于 0 的原因在于自定义的套接字选项的处理器会返回正值 */
 		if (code >= 0)
 			result->data = strerror(error);
@@ -1350,15 +1877,16 @@ report_connect(struct socket_server *ss, struct socket *s, struct socket_message
 		result->opaque = s->opaque;
 		result->id = s->id;
 		result->ud = 0;
+		struct socket_shard *sh = shard_of(ss, s->id);
 		if (send_buffer_empty(s)) {
-			sp_write(ss->event_fd, s->fd, s, false);
+			sp_write(sh->event_fd, s->fd, s, false);
 		}
 		union sockaddr_all u;
 		socklen_t slen = sizeof(u);
 		if (getpeername(s->fd, &u.s, &slen) == 0) {
 			void * sin_addr = (u.s.sa_family == AF_INET) ? (void*)&u.v4.sin_addr : (void *)&u.v6.sin6_addr;
-			if (inet_ntop(u.s.sa_family, sin_addr, ss->buffer, sizeof(ss->buffer))) {
-				result->data = ss->buffer;
+			if (inet_ntop(u.s.sa_family, sin_addr, sh->buffer, sizeof(sh->buffer))) {
+				result->data = sh->buffer;
 				return SOCKET_OPEN;
 			}
 		}
@@ -1413,23 +1941,25 @@ report_accept(struct socket_server *ss, struct socket *s, struct socket_message
 	int sin_port = ntohs((u.s.sa_family == AF_INET) ? u.v4.sin_port : u.v6.sin6_port);
 	char tmp[INET6_ADDRSTRLEN];
 	if (inet_ntop(u.s.sa_family, sin_addr, tmp, sizeof(tmp))) {
-		snprintf(ss->buffer, sizeof(ss->buffer), "%s:%d", tmp, sin_port);
-		result->data = ss->buffer;
+		/* 新的套接字可能属于别的 socket 线程, 地址信息写在侦听套接字所属的(即当前的)线程中 */
+		struct socket_shard *sh = shard_of(ss, s->id);
+		snprintf(sh->buffer, sizeof(sh->buffer), "%s:%d", tmp, sin_port);
+		result->data = sh->buffer;
 	}
 
 	return 1;
 }
 
 /* 当套接字发生错误或者关闭时, 将剩余的未处理的事件关闭. 其中 result 包含套接字, result 是上一个套接字处理的结果.
- * 参数: ss 是套接字服务器; result 是套接字处理的结果, 里边包含了一个套接字 id; type 是结果类型, 只有 SOCKET_CLOSE 和 SOCKET_ERROR 会被处理.
+ * 参数: sh 是当前 socket 线程; result 是套接字处理的结果, 里边包含了一个套接字 id; type 是结果类型, 只有 SOCKET_CLOSE 和 SOCKET_ERROR 会被处理.
  * 函数没有返回值 */
 static inline void 
-clear_closed_event(struct socket_server *ss, struct socket_message * result, int type) {
+clear_closed_event(struct socket_shard *sh, struct socket_message * result, int type) {
 	if (type == SOCKET_CLOSE || type == SOCKET_ERROR) {
 		int id = result->id;
 		int i;
-		for (i=ss->event_index; i<ss->event_n; i++) {
-			struct event *e = &ss->ev[i];
+		for (i=sh->event_index; i<sh->event_n; i++) {
+			struct event *e = &sh->ev[i];
 			struct socket *s = e->s;
 			if (s) {
 				if (s->type == SOCKET_TYPE_INVALID && s->id == id) {
@@ -1445,48 +1975,65 @@ clear_closed_event(struct socket_server *ss, struct socket_message * result, int
 /* 套接字服务器的处理函数, 此函数将依次检查并执行发过来的套接字指令, 当 I/O 事件处理完之后阻塞等待 I/O 事件
  * 或者如果没有处理完将处理最近的套接字事件, 事件的优先顺序是先处理未完成的连接和侦听接收事件, 其后才是对套接字进行读写.
  *
- * 参数: ss 是套接字服务器; 出参 result 用于接收各种处理的结果; 出参 more 表示上次的事件列表还未处理完, 0 表示已经处理完成;
+ * 每条 socket 线程以自己的编号调用此函数, 只处理属于自己的套接字.
+ *
+ * 参数: ss 是套接字服务器; thread 是 socket 线程的编号, 从 0 开始; 出参 result 用于接收各种处理的结果;
+ * 出参 more 表示上次的事件列表还未处理完, 0 表示已经处理完成;
  * 返回: socket_server.h 中定义的 socket 的事件类型, 或者 -1 表示等待 I/O 事件失败. */
 int 
-socket_server_poll(struct socket_server *ss, struct socket_message * result, int * more) {
+socket_server_poll(struct socket_server *ss, int thread, struct socket_message * result, int * more) {
+	struct socket_shard *sh = &ss->shard[thread];
 	for (;;) {
-		/* 虽然是优先处理套接字命令, 但处理过一次之后, 需要先等待处理完上次的套接字事件才会接着处理套接字命令 */
-		if (ss->checkctrl) {
-			if (has_cmd(ss)) {
-				/* 处理套接字命令, -1 将接着再处理一次 */
-				int type = ctrl_cmd(ss, result);
-				if (type != -1) {
-					clear_closed_event(ss, result, type);
-					return type;
-				} else {
-					continue;
-				}
+		/* 虽然是优先处理套接字命令, 但处理过一批之后, 需要先等待处理完上次的套接字事件才会接着处理套接字命令 */
+		if (sh->checkctrl) {
+			sh->checkctrl = 0;
+			take_cmd(sh);
+		}
+		if (sh->cmd) {
+			struct request_node *node = sh->cmd;
+			sh->cmd = node->next;
+			/* 处理套接字命令, -1 将接着再处理一条. 结果中的数据不会引用请求体, 可以立即释放 */
+			int type = ctrl_cmd(ss, node->type, node->request.u.buffer, result);
+			FREE(node);
+			if (type != -1) {
+				clear_closed_event(sh, result, type);
+				return type;
 			} else {
-				ss->checkctrl = 0;
+				continue;
 			}
 		}
-		if (ss->event_index == ss->event_n) {
-			ss->event_n = sp_wait(ss->event_fd, ss->ev, MAX_EVENT);
-			/* 当 sp_wait 返回时, 有可能其中包含了管道命令接收端的读事件, 因而需要标记检查命令 */
-			ss->checkctrl = 1;
+		if (sh->event_index == sh->event_n) {
+			sh->event_n = sp_wait(sh->event_fd, sh->ev, MAX_EVENT);
+			/* 门铃响了则先清除它再取命令, 这样取走命令之后压入的命令总会再次敲响门铃.
+			 * 即便门铃没有响也需要标记检查命令, 门铃只在队列由空变为非空时才会敲响 */
+			int i;
+			for (i=0;i<sh->event_n;i++) {
+				if (sh->ev[i].s == NULL) {
+					doorbell_clear(sh);
+					break;
+				}
+			}
+			sh->checkctrl = 1;
 			if (more) {
 				*more = 0;
 			}
-			ss->event_index = 0;
-			if (ss->event_n <= 0) {
-				ss->event_n = 0;
+			sh->event_index = 0;
+			if (sh->event_n <= 0) {
+				sh->event_n = 0;
 				return -1;
 			}
 		}
-		struct event *e = &ss->ev[ss->event_index++];
+		struct event *e = &sh->ev[sh->event_index++];
 		struct socket *s = e->s;
 		if (s == NULL) {
-			// dispatch pipe message at beginning
+			// dispatch ctrl command at beginning
 			continue;
 		}
+		struct socket_lock l;
+		socket_lock_init(s, &l);
 		switch (s->type) {
 		case SOCKET_TYPE_CONNECTING:
-			return report_connect(ss, s, result);
+			return report_connect(ss, s, &l, result);
 		case SOCKET_TYPE_LISTEN: {
 			int ok = report_accept(ss, s, result);
 			if (ok > 0) {
@@ -1504,20 +2051,20 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 			if (e->read) {
 				int type;
 				if (s->protocol == PROTOCOL_TCP) {
-					type = forward_message_tcp(ss, s, result);
+					type = forward_message_tcp(ss, s, &l, result);
 				} else {
-					type = forward_message_udp(ss, s, result);
+					type = forward_message_udp(ss, s, &l, result);
 					if (type == SOCKET_UDP) {
 						// try read again
 						/* [ck]为何需要再读一次?[/ck] */
-						--ss->event_index;
+						--sh->event_index;
 						return SOCKET_UDP;
 					}
 				}
 				if (e->write && type != SOCKET_CLOSE && type != SOCKET_ERROR) {
 					// Try to dispatch write message next step if write flag set.
 					e->read = false;
-					--ss->event_index;
+					--sh->event_index;
 				}
 				/* -1 表示读取当状态不变, 将不再处理此套接字的读取事件, 而是继续处理其它事件 */
 				if (type == -1)
@@ -1525,7 +2072,7 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 				return type;
 			}
 			if (e->write) {
-				int type = send_buffer(ss, s, result);
+				int type = send_buffer(ss, s, &l, result);
 				if (type == -1)
 					break;
 				return type;
@@ -1535,31 +2082,34 @@ socket_server_poll(struct socket_server *ss, struct socket_message * result, int
 	}
 }
 
-/* 将套接字的命令写入到管道中去, 通过 recvctrl_fd 文件描述符可以从管道中读取数据并执行相应的命令.
+/* 将套接字的命令压入 socket 线程 sh 的命令队列. 请求体复制到新分配的节点中, 只复制实际使用的 len 个字节.
+ * 队列原本为空时敲响门铃唤醒 socket 线程, 否则它一定还没有取走之前的命令, 会一并取走这条命令.
  *
- * 参数: ss 是套接字服务器; request 是请求体, 其第 9 个字节开始为真正的请求体内容, 长度为 len ;
- *      type 是请求的类型, 用于后面的分发动作; len 是请求体内容的长度;
+ * 参数: sh 是接收命令的 socket 线程; request 是请求体, 长度为 len ; type 是请求的类型, 用于后面的分发动作;
  *
  * 函数无返回值
  */
 static void
-send_request(struct socket_server *ss, struct request_package *request, char type, int len) {
-	/* 7、8 个字节用于写入命令的类型和长度 */
-	request->header[6] = (uint8_t)type;
-	request->header[7] = (uint8_t)len;
-	for (;;) {
-		int n = write(ss->sendctrl_fd, &request->header[6], len+2);
-		if (n<0) {
-			if (errno != EINTR) {
-				fprintf(stderr, "socket-server : send ctrl command error %s.\n", strerror(errno));
-			}
-			continue;
-		}
-		assert(n == len+2);
-		return;
+shard_request(struct socket_shard *sh, struct request_package *request, char type, int len) {
+	struct request_node *node = MALLOC(offsetof(struct request_node, request) + len);
+	node->type = type;
+	memcpy(&node->request, request, len);
+	struct request_node *head;
+	do {
+		head = sh->inbox;
+		node->next = head;
+	} while (!ATOM_CAS_POINTER(&sh->inbox, head, node));
+	if (head == NULL) {
+		doorbell_ring(sh);
 	}
 }
 
+/* 将关于套接字 id 的命令发给它所属的 socket 线程 */
+static inline void
+send_request(struct socket_server *ss, int id, struct request_package *request, char type, int len) {
+	shard_request(shard_of(ss, id), request, type, len);
+}
+
 /* 生成一个 TCP 连接请求对象, 要求地址 addr 的长度不能超过 256 个字节.
  * 参数: ss 是套接字服务器; 出参 req 将包含 TCP 连接请求体; opaque 是服务句柄; addr 是对象主机名; port 是对端服务端口;
  * 返回: 主机名的长度, 如果 addr 过长或者无法获取到套接字插槽将失败并返回 -1 . */
@@ -1591,10 +2141,17 @@ socket_server_connect(struct socket_server *ss, uintptr_t opaque, const char * a
 	int len = open_request(ss, &request, opaque, addr, port);
 	if (len < 0)
 		return -1;
-	send_request(ss, &request, 'O', sizeof(request.u.open) + len);
+	send_request(ss, request.u.open.id, &request, 'O', sizeof(request.u.open) + len);
 	return request.u.open.id;
 }
 
+/* 工作线程能否直接写入套接字: 已经连接的 TCP 套接字, 写缓冲为空, 没有直接写入的剩余数据, 命令队列中也没有它的发送命令 */
+static inline int
+can_direct_write(struct socket *s, int id) {
+	return s->id == id && s->type == SOCKET_TYPE_CONNECTED && s->protocol == PROTOCOL_TCP
+		&& send_buffer_empty(s) && s->dw_buffer == NULL && ATOM_LOAD(&s->sending) == (ID_TAG16(id) << 16);
+}
+
 /* 释放缓存的内存, 释放的方法是先生成一个 send_object , 其中包含了释放缓存的函数.
  * 之所以这样的原因是此模块支持两种生成缓存的方式.
  *
@@ -1609,7 +2166,9 @@ free_buffer(struct socket_server *ss, const void * buffer, int sz) {
 
 // return -1 when error
 /* 向套接字发送高权限的数据, 此函数可以用于 TCP 和 UDP (需要先调用 socket_server_udp_connect ) 两种协议的套接字.
- * 发送的过程是异步的, 函数先将内容写入到管道中, 并由专门的处理线程完成发送操作, 或者写入到低权限的写缓冲队列中去.
+ * 已经连接的 TCP 套接字写缓冲为空时, 调用者(工作线程)在直接写入锁的保护下直接写入文件描述符, 只把没有写完的剩余数据
+ * 交给 socket 线程, 并发一条 W 命令让它开启可写事件侦听. 其它情况下发送是异步的, 发送命令压入命令队列,
+ * 由 socket 线程完成发送操作.
  *
  * 参数: ss 是套接字服务器; id 是发送数据的套接字标识; buffer 是发送的数据内容; sz 是发送的大小;
  * 返回: 套接字中的写缓冲数据大小, 如果失败将返回 -1 . */
@@ -1621,12 +2180,60 @@ socket_server_send(struct socket_server *ss, int id, const void * buffer, int sz
 		return -1;
 	}
 
+	struct socket_lock l;
+	socket_lock_init(s, &l);
+
+	/* socket 线程正持有锁(发送写缓冲或者关闭套接字)时不等待, 走命令队列 */
+	if (can_direct_write(s, id) && socket_trylock(&l)) {
+		// may be we can send directly, double check
+		if (can_direct_write(s, id)) {
+			// send directly
+			struct send_object so;
+			send_object_init(ss, &so, (void *)buffer, sz);
+			ssize_t n;
+			for (;;) {
+				n = write(s->fd, so.buffer, so.sz);
+				if (n >= 0 || errno != EINTR)
+					break;
+			}
+			if (n < 0) {
+				/* 写满或者出错都交给 socket 线程, 出错时它会在可写事件中关闭套接字 */
+				n = 0;
+			}
+			if (n == so.sz) {
+				// write done
+				socket_unlock(&l);
+				so.free_func((void *)buffer);
+				return 0;
+			}
+			// write failed, put buffer into s->dw_* , and let socket thread send it. see send_buffer()
+			s->dw_buffer = buffer;
+			s->dw_size = sz;
+			s->dw_offset = n;
+
+			socket_unlock(&l);
+
+			struct request_package request;
+			request.u.send.id = id;
+			request.u.send.sz = 0;
+			request.u.send.buffer = NULL;
+			request.u.send.ref = 0;
+
+			// let socket thread enable write event
+			send_request(ss, id, &request, 'W', sizeof(request.u.send));
+
+			return so.sz - n;
+		}
+		socket_unlock(&l);
+	}
+
 	struct request_package request;
 	request.u.send.id = id;
 	request.u.send.sz = sz;
 	request.u.send.buffer = (char *)buffer;
+	request.u.send.ref = inc_sending_ref(s, id);
 
-	send_request(ss, &request, 'D', sizeof(request.u.send));
+	send_request(ss, id, &request, 'D', sizeof(request.u.send));
 	return s->wb_size;
 }
 
@@ -1647,11 +2254,12 @@ socket_server_send_lowpriority(struct socket_server *ss, int id, const void * bu
 	request.u.send.id = id;
 	request.u.send.sz = sz;
 	request.u.send.buffer = (char *)buffer;
+	request.u.send.ref = inc_sending_ref(s, id);
 
-	send_request(ss, &request, 'P', sizeof(request.u.send));
+	send_request(ss, id, &request, 'P', sizeof(request.u.send));
 }
 
-/* 退出整个套接字服务器命令, 调用此函数并不是真正销毁套接字服务器而是以异步的方式给处理线程返回一个 SOCKET_EXIT 状态.
+/* 退出整个套接字服务器命令, 调用此函数并不是真正销毁套接字服务器而是以异步的方式给每条处理线程返回一个 SOCKET_EXIT 状态.
  * 这样处理线程可以安全的退出, 从而不再处理套接字事件. 真正销毁内存实际上是在整个 skynet 系统退出时.
  *
  * 参数: ss 是套接字服务器
@@ -1659,7 +2267,10 @@ socket_server_send_lowpriority(struct socket_server *ss, int id, const void * bu
 void
 socket_server_exit(struct socket_server *ss) {
 	struct request_package request;
-	send_request(ss, &request, 'X', 0);
+	int i;
+	for (i=0;i<ss->shard_n;i++) {
+		shard_request(&ss->shard[i], &request, 'X', 0);
+	}
 }
 
 /* 关闭套接字, 此函数会在写缓冲全部发送完之后才真的关闭套接字, 在此之前套接字将处于半关闭状态.
@@ -1673,7 +2284,7 @@ socket_server_close(struct socket_server *ss, uintptr_t opaque, int id) {
 	request.u.close.id = id;
 	request.u.close.shutdown = 0;
 	request.u.close.opaque = opaque;
-	send_request(ss, &request, 'K', sizeof(request.u.close));
+	send_request(ss, id, &request, 'K', sizeof(request.u.close));
 }
 
 /* 立即关闭套接字, 此函数将尽可能快的关闭套接字. 如果套接字的写缓冲中还有数据, 将尽可能多的写入,
@@ -1687,7 +2298,7 @@ socket_server_shutdown(struct socket_server *ss, uintptr_t opaque, int id) {
 	request.u.close.id = id;
 	request.u.close.shutdown = 1;
 	request.u.close.opaque = opaque;
-	send_request(ss, &request, 'K', sizeof(request.u.close));
+	send_request(ss, id, &request, 'K', sizeof(request.u.close));
 }
 
 // return -1 means failed
@@ -1786,7 +2397,7 @@ socket_server_listen(struct socket_server *ss, uintptr_t opaque, const char * ad
 	request.u.listen.opaque = opaque;
 	request.u.listen.id = id;
 	request.u.listen.fd = fd;
-	send_request(ss, &request, 'L', sizeof(request.u.listen));
+	send_request(ss, id, &request, 'L', sizeof(request.u.listen));
 	return id;
 }
 
@@ -1802,7 +2413,7 @@ socket_server_bind(struct socket_server *ss, uintptr_t opaque, int fd) {
 	request.u.bind.opaque = opaque;
 	request.u.bind.id = id;
 	request.u.bind.fd = fd;
-	send_request(ss, &request, 'B', sizeof(request.u.bind));
+	send_request(ss, id, &request, 'B', sizeof(request.u.bind));
 	return id;
 }
 
@@ -1816,7 +2427,7 @@ socket_server_start(struct socket_server *ss, uintptr_t opaque, int id) {
 	struct request_package request;
 	request.u.start.id = id;
 	request.u.start.opaque = opaque;
-	send_request(ss, &request, 'S', sizeof(request.u.start));
+	send_request(ss, id, &request, 'S', sizeof(request.u.start));
 }
 
 /* 设置套接字的非延迟属性. 函数无返回值. */
@@ -1826,7 +2437,7 @@ socket_server_nodelay(struct socket_server *ss, int id) {
 	request.u.setopt.id = id;
 	request.u.setopt.what = TCP_NODELAY;
 	request.u.setopt.value = 1;
-	send_request(ss, &request, 'T', sizeof(request.u.setopt));
+	send_request(ss, id, &request, 'T', sizeof(request.u.setopt));
 }
 
 /* 设置套接字服务器使用 userobject , 一旦设置成功, 将调用 soi 接口中的函数来生成和销毁套接字写缓存. */
@@ -1835,6 +2446,28 @@ socket_server_userobject(struct socket_server *ss, struct socket_object_interfac
 	ss->soi = *soi;
 }
 
+/* 归还 SOCKET_DATA 消息携带的接收缓冲, 可以在任意线程中调用. sz 为消息中的 ud , 即数据的长度.
+ * 缓冲的实际大小不小于 sz 所属级别的大小, 所以按 sz 放入对应级别的回收栈总是安全的; 回收栈已满或者不属于缓冲池时直接释放. */
+void
+socket_server_free_buffer(struct socket_server *ss, void *buffer, int sz) {
+	int c = read_class(sz);
+	if (c >= READ_POOL_CLASS) {
+		FREE(buffer);
+		return;
+	}
+	struct read_pool *pool = &ss->recycle[c];
+	if (ATOM_INC(&pool->count) > READ_POOL_BYTES / (MIN_READ_BUFFER << c)) {
+		ATOM_DEC(&pool->count);
+		FREE(buffer);
+		return;
+	}
+	void *head;
+	do {
+		head = ATOM_LOAD(&pool->head);
+		*(void **)buffer = head;
+	} while (!ATOM_CAS_POINTER(&pool->head, head, buffer));
+}
+
 // UDP
 /* 生成一个 UDP 套接字, addr 和 port 中的任意都可以为 NULL 或 0 , 如果不为此值将会绑定到这两个值表示的地址上.
  * 参数: ss 是套接字服务器; opaque 是服务句柄; addr 是绑定的地址可以为 NULL ; port 是绑定的端口号可以为 0 ;
@@ -1869,7 +2502,7 @@ socket_server_udp(struct socket_server *ss, uintptr_t opaque, const char * addr,
 	request.u.udp.opaque = opaque;
 	request.u.udp.family = family;
 
-	send_request(ss, &request, 'U', sizeof(request.u.udp));	
+	send_request(ss, id, &request, 'U', sizeof(request.u.udp));	
 	return id;
 }
 
@@ -1890,6 +2523,7 @@ socket_server_udp_send(struct socket_server *ss, int id, const struct socket_udp
 	request.u.send_udp.send.id = id;
 	request.u.send_udp.send.sz = sz;
 	request.u.send_udp.send.buffer = (char *)buffer;
+	request.u.send_udp.send.ref = 0;
 	
 	/* 复制到请求体的地址中, 如果不存在相应的 type 或者地址为 NULL 将不能成功发送
 	 * [ck]当 addr 为 NULL 时, 可以从套接字中取得地址[/ck] */
@@ -1909,7 +2543,7 @@ socket_server_udp_send(struct socket_server *ss, int id, const struct socket_udp
 
 	memcpy(request.u.send_udp.address, udp_address, addrsz);	
 
-	send_request(ss, &request, 'A', sizeof(request.u.send_udp.send)+addrsz);
+	send_request(ss, id, &request, 'A', sizeof(request.u.send_udp.send)+addrsz);
 	return s->wb_size;
 }
 
@@ -1949,7 +2583,7 @@ socket_server_udp_connect(struct socket_server *ss, int id, const char * addr, i
 
 	freeaddrinfo( ai_list );
 
-	send_request(ss, &request, 'C', sizeof(request.u.set_udp) - sizeof(request.u.set_udp.address) +addrsz);
+	send_request(ss, id, &request, 'C', sizeof(request.u.set_udp) - sizeof(request.u.set_udp.address) +addrsz);
 
 	return 0;
 }
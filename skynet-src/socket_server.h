@@ -22,9 +22,11 @@ struct socket_message {
 	char * data;          /* 当存在数据时, data 里边包含数据内容 */
 };
 
-struct socket_server * socket_server_create();
+// thread is the number of socket threads, each one calls socket_server_poll with its own index
+struct socket_server * socket_server_create(int thread);
 void socket_server_release(struct socket_server *);
-int socket_server_poll(struct socket_server *, struct socket_message *result, int *more);
+int socket_server_thread(struct socket_server *);
+int socket_server_poll(struct socket_server *, int thread, struct socket_message *result, int *more);
 
 void socket_server_exit(struct socket_server *);
 void socket_server_close(struct socket_server *, uintptr_t opaque, int id);
@@ -66,4 +68,7 @@ struct socket_object_interface {
 // if you send package sz == -1, use soi.
 void socket_server_userobject(struct socket_server *, struct socket_object_interface *soi);
 
+// return the buffer of a SOCKET_DATA message, sz is its ud (size of data) . It can be called from any thread.
+void socket_server_free_buffer(struct socket_server *, void *buffer, int sz);
+
 #endif
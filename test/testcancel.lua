@@ -0,0 +1,49 @@
+local skynet = require "skynet"
+
+-- 定时器取消测试: 被取消的定时器不会调用函数, 也不会再产生消息; 已经到期的定时器取消失败, 之后到达的消息被忽略.
+-- 用法: start = "testcancel"
+
+local N = 10000
+
+skynet.start(function()
+	local fired = 0
+	local function f()
+		fired = fired + 1
+	end
+
+	local message = tonumber(skynet.stat "message")
+	local id = {}
+	for i = 1, N do
+		id[i] = skynet.timeout(20, f)
+	end
+	for i = 1, N do
+		assert(skynet.cancel(id[i]))
+	end
+	assert(not skynet.cancel(id[1]))
+	skynet.sleep(40)
+	-- 期间只有 skynet.sleep 自己的一条消息
+	local n = tonumber(skynet.stat "message") - message
+	skynet.error(string.format("cancel %d timers : fired = %d, message = %d", N, fired, n))
+	assert(fired == 0 and n < 10)
+
+	-- 立即到期的定时器无法取消, 但它的函数也不会再被调用
+	local t = skynet.timeout(0, f)
+	assert(not skynet.cancel(t))
+	skynet.sleep(1)
+	assert(fired == 0)
+
+	-- 唤醒睡眠的协程时同时取消它的定时器
+	local co
+	skynet.fork(function()
+		co = coroutine.running()
+		assert(skynet.sleep(1000) == "BREAK")
+		fired = fired + 1
+	end)
+	skynet.yield()
+	skynet.wakeup(co)
+	skynet.sleep(10)
+	assert(fired == 1)
+
+	skynet.error("cancel test ok")
+	skynet.exit()
+end)
@@ -0,0 +1,105 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.kill
+
+-- 服务查找竞争测试: 多个发送者服务同时向一组服务地址发送消息, 每次发送都会由 skynet_handle_grab 查找目的服务,
+-- 同时另一个服务不断创建和退出服务(触发注册、卸载和插槽扩容), 统计查找的吞吐量.
+-- 调整配置中的 thread 后运行, 对比不同工作线程数量下的结果.
+-- 用法: start = "testgrabbench" , 可选参数为 发送者数量 每个发送者发送的消息数量 目的地址的类型
+-- 目的地址的类型默认为 dead (已经退出的服务, 只测试查找本身), 为 live 时发送给存活的服务.
+
+local mode = ...
+
+if mode == "sender" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(session, address, targets, n)
+		skynet.ret()
+		local m = #targets
+		for i = 1, n do
+			skynet.send(targets[i % m + 1], "lua")
+		end
+		skynet.send(address, "lua", "done")
+	end)
+end)
+
+elseif mode == "target" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function() end)
+end)
+
+elseif mode == "churn" then
+
+local running = true
+
+skynet.start(function()
+	skynet.dispatch("lua", function(session, address, cmd)
+		if cmd == "stop" then
+			running = false
+			skynet.ret()
+		end
+	end)
+	skynet.fork(function()
+		while running do
+			local s = skynet.newservice(SERVICE_NAME, "target")
+			skynet.kill(s)
+			skynet.yield()
+		end
+	end)
+end)
+
+else
+
+local sender, count, kind = ...
+sender = tonumber(sender) or 8
+count = tonumber(count) or 100000
+kind = kind or "dead"
+
+local finish
+local done = 0
+
+skynet.start(function()
+	local targets = {}
+	for i = 1, 16 do
+		targets[i] = skynet.newservice(SERVICE_NAME, "target")
+	end
+	if kind == "dead" then
+		for i = 1, #targets do
+			skynet.kill(targets[i])
+		end
+	end
+	local senders = {}
+	for i = 1, sender do
+		senders[i] = skynet.newservice(SERVICE_NAME, "sender")
+	end
+	local churn = skynet.newservice(SERVICE_NAME, "churn")
+	skynet.dispatch("lua", function(session, address, cmd)
+		done = done + 1
+		if done == sender then
+			skynet.wakeup(finish)
+		end
+	end)
+	finish = coroutine.running()
+	local start = skynet.now()
+	for i = 1, sender do
+		skynet.call(senders[i], "lua", targets, count)
+	end
+	skynet.wait(finish)
+	local ti = skynet.now() - start
+	local total = sender * count
+	skynet.error(string.format("grab bench (%s) : %d senders * %d lookups in %.2fs, %.0f lookup/s",
+		kind, sender, count, ti / 100, total * 100 / math.max(ti, 1)))
+	skynet.call(churn, "lua", "stop")
+	skynet.kill(churn)
+	for i = 1, sender do
+		skynet.kill(senders[i])
+	end
+	if kind == "live" then
+		for i = 1, #targets do
+			skynet.kill(targets[i])
+		end
+	end
+	skynet.exit()
+end)
+
+end
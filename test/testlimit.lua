@@ -0,0 +1,75 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.limit
+
+-- 消息队列上限测试: 消费者设置队列上限后忙碌一段时间, 生产者在此期间发送大量带序号的消息, 分别检查三种超限策略.
+-- 用法: start = "testlimit"
+
+local mode, policy, limit = ...
+
+if mode == "consumer" then
+
+local recv = 0
+local first	-- 收到的第一条消息的序号
+
+skynet.start(function()
+	skynet.limit(tonumber(limit), policy)
+	skynet.dispatch("lua", function(session, _, cmd, i)
+		if cmd == "block" then
+			-- 忙等而不是 sleep , 让消息堆积在队列中
+			local ti = os.clock() + 0.2
+			while os.clock() < ti do end
+		elseif cmd == "count" then
+			skynet.ret(skynet.pack(recv, tonumber(skynet.stat "drop"), tonumber(skynet.stat "reject"), first))
+		else
+			recv = recv + 1
+			first = first or i
+		end
+	end)
+end)
+
+else
+
+local N = 1000
+local LIMIT = 10
+
+local function test(policy)
+	local consumer = skynet.newservice(SERVICE_NAME, "consumer", policy, LIMIT)
+	local signal = 0
+	skynet.overload(function(source, length)
+		assert(source == consumer and length >= LIMIT)
+		signal = signal + 1
+	end)
+	skynet.send(consumer, "lua", "block")
+	skynet.sleep(1)	-- 等待消费者开始忙碌
+	local accept = 0
+	local last	-- 最后一条被接受的消息的序号
+	for i = 1, N do
+		if skynet.send(consumer, "lua", "msg", i) then
+			accept = accept + 1
+			last = i
+		end
+	end
+	skynet.sleep(50)
+	local recv, drop, reject, first = skynet.call(consumer, "lua", "count")
+	skynet.error(string.format("limit %s : accept = %d, recv = %d, drop = %d, reject = %d, signal = %d",
+		policy, accept, recv, drop, reject, signal))
+	if policy == "reject" then
+		assert(reject > 0 and accept + reject == N and recv == accept)
+	elseif policy == "drop" then
+		-- 队列达到两倍上限之后拒绝新的消息, 消费者恢复之后丢弃最旧的消息, 只处理最新的 LIMIT 条
+		assert(reject > 0 and accept + reject == N and drop > 0 and recv + drop == accept)
+		assert(recv == LIMIT and first == last - recv + 1)
+	else
+		assert(accept == N and recv == N and signal > 0)
+	end
+	skynet.kill(consumer)
+end
+
+skynet.start(function()
+	test "reject"
+	test "drop"
+	test "signal"
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,94 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.kill
+
+-- 消息队列竞争测试: 多个生产者服务同时向同一个消费者服务发送消息, 统计吞吐量.
+-- 分别以默认(无锁队列)和 CFLAGS += -DUSE_RING_MQ (自旋锁环绕表) 编译后运行此测试即可对比两者.
+-- 用法: start = "testmqbench" , 可选参数为 生产者数量 每个生产者发送的消息数量 消息协议
+-- 消息协议默认为 lua (打包后不复制发送), 为 text 时以短字符串发送, 测试 skynet_send 复制消息内容的路径.
+
+local mode = ...
+
+if mode == "consumer" then
+
+local total
+local recv = 0
+local finish
+
+local function count()
+	recv = recv + 1
+	if total and recv == total then
+		finish(true)
+	end
+end
+
+skynet.register_protocol {
+	name = "text",
+	id = skynet.PTYPE_TEXT,
+	unpack = function() end,
+	dispatch = count,
+}
+
+skynet.start(function()
+	skynet.dispatch("lua", function(session, address, cmd, n)
+		if cmd == "wait" then
+			total = n
+			finish = skynet.response()
+			recv = recv - 1
+		end
+		count()
+	end)
+end)
+
+elseif mode == "producer" then
+
+skynet.register_protocol {
+	name = "text",
+	id = skynet.PTYPE_TEXT,
+	pack = function(...) return ... end,
+}
+
+skynet.start(function()
+	skynet.dispatch("lua", function(session, address, consumer, n, proto)
+		skynet.ret()
+		if proto == "text" then
+			for i = 1, n do
+				skynet.send(consumer, "text", "blackhole")
+			end
+		else
+			for i = 1, n do
+				skynet.send(consumer, "lua", "blackhole")
+			end
+		end
+	end)
+end)
+
+else
+
+local producer, count, proto = ...
+producer = tonumber(producer) or 16
+count = tonumber(count) or 100000
+proto = proto or "lua"
+
+skynet.start(function()
+	local consumer = skynet.newservice(SERVICE_NAME, "consumer")
+	local producers = {}
+	for i = 1, producer do
+		producers[i] = skynet.newservice(SERVICE_NAME, "producer")
+	end
+	local total = producer * count
+	local start = skynet.now()
+	for i = 1, producer do
+		skynet.call(producers[i], "lua", consumer, count, proto)
+	end
+	skynet.call(consumer, "lua", "wait", total)
+	local ti = skynet.now() - start
+	skynet.error(string.format("mq bench (%s) : %d producers * %d messages in %.2fs, %.0f msg/s",
+		proto, producer, count, ti / 100, total * 100 / math.max(ti, 1)))
+	for i = 1, producer do
+		skynet.kill(producers[i])
+	end
+	skynet.kill(consumer)
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,54 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.name skynet.kill
+
+-- 服务名字测试: 给服务起大量名字, 检查以名字发送消息、卸载服务后名字失效以及同名字重新注册后能找到新的服务.
+-- 同时统计命名和以名字查找的耗时. 配置 namecache 后运行可以测试服务的名字缓存.
+-- 用法: start = "testname" , 可选参数为 名字数量
+
+local mode, count = ...
+
+if mode == "target" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function()
+		skynet.ret(skynet.pack(skynet.self()))
+	end)
+end)
+
+else
+
+count = tonumber(mode) or 20000
+
+skynet.start(function()
+	local target = skynet.newservice(SERVICE_NAME, "target")
+	local start = skynet.now()
+	for i = 1, count do
+		skynet.name(".name" .. i, target)
+	end
+	local ti = skynet.now() - start
+	skynet.error(string.format("name %d services in %.2fs", count, ti / 100))
+	assert(skynet.localname(".name1") == target and skynet.localname(".name" .. count) == target)
+
+	start = skynet.now()
+	for n = 1, 10 do
+		for i = 1, count, 100 do
+			assert(skynet.call(".name" .. i, "lua") == target)
+		end
+	end
+	ti = skynet.now() - start
+	skynet.error(string.format("call by name %d times in %.2fs", count // 10, ti / 100))
+
+	-- 卸载服务后它的名字都被删除, 名字缓存也应该失效
+	skynet.kill(target)
+	assert(skynet.localname(".name1") == nil and skynet.localname(".name" .. count) == nil)
+	assert(not pcall(skynet.call, ".name1", "lua"))
+
+	local other = skynet.newservice(SERVICE_NAME, "target")
+	skynet.name(".name1", other)
+	assert(skynet.call(".name1", "lua") == other)
+	skynet.kill(other)
+	skynet.error("name test ok")
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,54 @@
+local skynet = require "skynet"
+local socket = require "socket"
+
+-- 写缓冲队列测试: 一次性向一个连接发送大量的小数据包, 高低权限交替, 数据包在写缓冲队列中堆积, 以 writev 成批写入.
+-- 接收端检查收到的字节总数, 以及同一权限的数据包保持发送的顺序.
+-- 用法: start = "testsendlist"
+
+local N = 100000
+local PORT = 18801
+local PAD = string.rep("x", 100)
+
+skynet.start(function()
+	-- 接收端接受连接之后暂不开启, 不读取数据, 发送端的内核写缓冲很快被写满, 其后的数据包堆积在写缓冲队列中
+	local lid = socket.listen("127.0.0.1", PORT)
+	local accepted
+	socket.start(lid, function(id, addr)
+		accepted = id
+	end)
+
+	local fd = socket.open("127.0.0.1", PORT)
+	for i = 1, N do
+		if i % 3 == 0 then
+			socket.lwrite(fd, string.format("L%06d%s\n", i, PAD))
+		else
+			socket.write(fd, string.format("H%06d%s\n", i, PAD))
+		end
+	end
+	-- 关闭要等待写缓冲发送完, 放在另一个协程中
+	skynet.fork(socket.close, fd)
+
+	while not accepted do
+		skynet.sleep(1)
+	end
+	local id = accepted
+	socket.start(id)
+	local last = { H = 0, L = 0 }
+	local count = 0
+	while true do
+		local line = socket.readline(id)
+		if not line then
+			break
+		end
+		local p, i = line:match "^([HL])(%d+)x+$"
+		i = tonumber(i)
+		assert(p and i > last[p], line)
+		last[p] = i
+		count = count + 1
+	end
+	socket.close(id)
+	socket.close(lid)
+	skynet.error(string.format("send list : %d packets, received = %d", N, count))
+	assert(count == N)
+	skynet.exit()
+end)
@@ -0,0 +1,73 @@
+local skynet = require "skynet"
+require "skynet.manager"	-- import skynet.kill
+
+-- 定时器测试: 多个服务中的大量协程反复以毫秒为单位睡眠, 统计定时器的吞吐量以及实际睡眠时间比预期多出的误差(抖动).
+-- 分别以配置 timer_tick = 1 和 timer_tick = 10 (默认) 运行此测试即可对比两种精度.
+-- 用法: start = "testtimerbench" , 可选参数为 服务数量 每个服务的协程数量 每个协程的睡眠次数 睡眠的毫秒数
+
+local mode = ...
+
+if mode == "sleeper" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function(session, address, co, n, ms)
+		local jitter = {}
+		local finish = 0
+		local response = skynet.response()
+		for i = 1, co do
+			skynet.fork(function()
+				for j = 1, n do
+					local t = skynet.hpc()
+					skynet.sleep_ms(ms)
+					jitter[#jitter+1] = (skynet.hpc() - t) / 1000000 - ms
+				end
+				finish = finish + 1
+				if finish == co then
+					response(true, jitter)
+				end
+			end)
+		end
+	end)
+end)
+
+else
+
+local service, co, n, ms = ...
+service = tonumber(service) or 8
+co = tonumber(co) or 1000
+n = tonumber(n) or 10
+ms = tonumber(ms) or 3
+
+skynet.start(function()
+	local sleepers = {}
+	for i = 1, service do
+		sleepers[i] = skynet.newservice(SERVICE_NAME, "sleeper")
+	end
+	local all = {}
+	local finish = 0
+	local start = skynet.hpc()
+	for i = 1, service do
+		skynet.fork(function()
+			local jitter = skynet.call(sleepers[i], "lua", co, n, ms)
+			table.move(jitter, 1, #jitter, #all + 1, all)
+			finish = finish + 1
+		end)
+	end
+	while finish < service do
+		skynet.sleep(1)
+	end
+	local ti = (skynet.hpc() - start) / 1000000000
+	table.sort(all)
+	local sum = 0
+	for _, v in ipairs(all) do
+		sum = sum + v
+	end
+	skynet.error(string.format("timer bench : %d timers of %dms in %.2fs, %.0f timer/s, jitter avg %.2fms p50 %.2fms p99 %.2fms max %.2fms",
+		#all, ms, ti, #all / ti, sum / #all, all[#all // 2 + 1], all[math.ceil(#all * 0.99)], all[#all]))
+	for i = 1, service do
+		skynet.kill(sleepers[i])
+	end
+	skynet.exit()
+end)
+
+end
@@ -0,0 +1,38 @@
+local skynet = require "skynet"
+
+-- 定时器合并分发测试: 同一滴答内到期的大量定时器全部被调用. 配置 timer_coalesce = true 时它们合并为少数几条消息,
+-- 否则每个定时器一条消息. 一个定时器函数出错不影响同一滴答内的其它定时器.
+-- 用法: start = "testtimercoalesce"
+
+local N = 10000
+
+skynet.start(function()
+	local coalesce = skynet.getenv "timer_coalesce" == "true"
+	local fired = 0
+	local function f()
+		fired = fired + 1
+	end
+
+	local message = tonumber(skynet.stat "message")
+	for i = 1, N do
+		skynet.timeout(10, f)
+	end
+	skynet.sleep(30)
+	local n = tonumber(skynet.stat "message") - message
+	skynet.error(string.format("timer coalesce %s : %d timers, fired = %d, message = %d", coalesce, N, fired, n))
+	assert(fired == N)
+	if coalesce then
+		assert(n < 10)
+	else
+		assert(n > N)
+	end
+
+	-- 第一个定时器出错, 同一滴答内的第二个定时器照常调用
+	fired = 0
+	skynet.timeout(5, function() error "timer error (expected)" end)
+	skynet.timeout(5, f)
+	skynet.sleep(20)
+	assert(fired == 1)
+
+	skynet.exit()
+end)
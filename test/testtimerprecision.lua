@@ -0,0 +1,79 @@
+local skynet = require "skynet"
+
+-- 定时器精度测试: 多个服务中的少量协程反复睡眠一个滴答, 每次都在上一个定时器刚刚触发、定时线程多半还醒着的时候注册.
+-- 每个定时器都应该在 1 ~ 2 个滴答之内触发, 而不是等到定时线程下一次空闲醒来(最长 100 毫秒).
+-- 定时器稀疏时问题最明显, 配置 timer_tick = 1 更容易出现.
+-- 用法: start = "testtimerprecision"
+
+local S = 8		-- 服务数量
+local M = 2		-- 每个服务的协程数量
+local K = 500		-- 每个协程睡眠的次数
+
+local mode = ...
+local TICK = tonumber(skynet.getenv "timer_tick") == 1 and 1 or 10	-- 一个滴答的毫秒数
+local LIMIT = 2 * TICK + 30	-- 单次睡眠的最长耗时, 单位毫秒, 留出线程调度的余量
+
+if mode == "sleeper" then
+
+skynet.start(function()
+	skynet.dispatch("lua", function()
+		local count = 0
+		local total = 0
+		local worst = 0
+		local done = 0
+		local co = coroutine.running()
+		for i = 1, M do
+			skynet.fork(function()
+				for j = 1, K do
+					local t = skynet.hpc()
+					skynet.sleep_ms(TICK)
+					local elapsed = (skynet.hpc() - t) // 1000000
+					count = count + 1
+					total = total + elapsed
+					if elapsed > worst then
+						worst = elapsed
+					end
+				end
+				done = done + 1
+				if done == M then
+					skynet.wakeup(co)
+				end
+			end)
+		end
+		skynet.wait()
+		skynet.ret(skynet.pack(count, total, worst))
+		skynet.exit()
+	end)
+end)
+
+else
+
+skynet.start(function()
+	local count = 0
+	local total = 0
+	local worst = 0
+	local done = 0
+	local co = coroutine.running()
+	for i = 1, S do
+		local sleeper = skynet.newservice(SERVICE_NAME, "sleeper")
+		skynet.fork(function()
+			local c, t, w = skynet.call(sleeper, "lua")
+			count = count + c
+			total = total + t
+			if w > worst then
+				worst = w
+			end
+			done = done + 1
+			if done == S then
+				skynet.wakeup(co)
+			end
+		end)
+	end
+	skynet.wait()
+	skynet.error(string.format("timer precision : %d sleeps, average = %.2f ms, worst = %d ms",
+		count, total / count, worst))
+	assert(total / count <= 2 * TICK and worst < LIMIT)
+	skynet.exit()
+end)
+
+end